@@ -66,5 +66,12 @@ namespace OrthancPlugins
       return (bundle_ == other.bundle_ &&
               item_ == other.item_);
     }
+
+    bool operator< (const CacheIndex& other) const
+    {
+      return (bundle_ < other.bundle_ ||
+              (bundle_ == other.bundle_ &&
+               item_ < other.item_));
+    }
   };
 }
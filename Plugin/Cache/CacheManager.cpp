@@ -24,10 +24,18 @@
 #include "CacheManager.h"
 
 #include <Compatibility.h>
+#include <OrthancException.h>
 #include <Toolbox.h>
 #include <SQLite/Transaction.h>
 
 #include <boost/lexical_cast.hpp>
+#include <cassert>
+#include <set>
+
+
+// Number of cache hits whose recency is kept in memory, before being
+// written to the SQLite index as a single transaction
+static const size_t MAX_PENDING_TOUCHES = 1000;
 
 
 namespace OrthancPlugins
@@ -109,6 +117,13 @@ namespace OrthancPlugins
       return maxSpace_;
     }
 
+    // Returns this quota, reduced to the given percentage
+    BundleQuota Scale(unsigned int percent) const
+    {
+      return BundleQuota(static_cast<uint32_t>(static_cast<uint64_t>(maxCount_) * percent / 100),
+                         maxSpace_ * percent / 100);
+    }
+
     bool IsSatisfied(const Bundle& bundle) const
     {
       if (maxCount_ != 0 &&
@@ -130,6 +145,10 @@ namespace OrthancPlugins
 
   struct CacheManager::PImpl
   {
+    typedef std::map<std::string, unsigned int>  PinnedFiles;
+    typedef std::list<int64_t>  Touches;   // Least recently accessed first
+    typedef std::map<int64_t, Touches::iterator>  TouchesIndex;
+
     OrthancPluginContext* context_;
     Orthanc::SQLite::Connection& db_;
     Orthanc::FilesystemStorage& storage_;
@@ -139,13 +158,33 @@ namespace OrthancPlugins
     BundleQuota  defaultQuota_;
     BundleQuotas  quotas_;
 
+    PinnedFiles  pinned_;    // Files being read, with their number of readers
+    std::set<std::string>  deferred_;  // Pinned files that were removed from the index
+
+    // The "seq" of the cache hits that are not written yet to SQLite
+    Touches       touches_;
+    TouchesIndex  touchesIndex_;
+
+    unsigned int  highWatermark_;  // Percentage of the quotas
+    unsigned int  lowWatermark_;
+    bool          asynchronousRemoval_;
+    std::list<std::string>  pendingRemovals_;  // Files to be unlinked
+
+    std::map<int, uint64_t>  evictedCounts_;  // Number of evicted items, per bundle
+    bool                     evictionTracking_;
+    std::list<CacheIndex>    evictedItems_;  // Only if "evictionTracking_" is enabled
+
     PImpl(OrthancPluginContext* context,
           Orthanc::SQLite::Connection& db,
           Orthanc::FilesystemStorage& storage) :
       context_(context),
       db_(db), 
       storage_(storage), 
-      sanityCheck_(false)
+      sanityCheck_(false),
+      highWatermark_(100),
+      lowWatermark_(100),
+      asynchronousRemoval_(false),
+      evictionTracking_(false)
     {
     }
   };
@@ -181,6 +220,73 @@ namespace OrthancPlugins
   }
 
 
+  void CacheManager::Touch(int64_t seq)
+  {
+    PImpl::TouchesIndex::iterator found = pimpl_->touchesIndex_.find(seq);
+    if (found != pimpl_->touchesIndex_.end())
+    {
+      // Move to the back of the list of the touched items
+      pimpl_->touches_.splice(pimpl_->touches_.end(), pimpl_->touches_, found->second);
+    }
+    else
+    {
+      pimpl_->touches_.push_back(seq);
+      pimpl_->touchesIndex_[seq] = --pimpl_->touches_.end();
+    }
+  }
+
+
+  void CacheManager::ForgetTouch(int64_t seq)
+  {
+    PImpl::TouchesIndex::iterator found = pimpl_->touchesIndex_.find(seq);
+    if (found != pimpl_->touchesIndex_.end())
+    {
+      pimpl_->touches_.erase(found->second);
+      pimpl_->touchesIndex_.erase(found);
+    }
+  }
+
+
+  void CacheManager::FlushTouchesInternal()
+  {
+    // Must be called inside a transaction
+    if (pimpl_->touches_.empty())
+    {
+      return;
+    }
+
+    int64_t next;
+
+    {
+      Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT MAX(seq) FROM Cache");
+      if (!s.Step() ||
+          s.ColumnIsNull(0))
+      {
+        pimpl_->touches_.clear();
+        pimpl_->touchesIndex_.clear();
+        return;
+      }
+
+      next = s.ColumnInt64(0) + 1;
+    }
+
+    // Give the touched items new "seq" values, in the order of their
+    // last access, so that they are the last ones to be evicted
+    for (PImpl::Touches::const_iterator it = pimpl_->touches_.begin();
+         it != pimpl_->touches_.end(); ++it)
+    {
+      Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "UPDATE Cache SET seq=? WHERE seq=?");
+      s.BindInt64(0, next);
+      s.BindInt64(1, *it);
+      s.Run();
+      next++;
+    }
+
+    pimpl_->touches_.clear();
+    pimpl_->touchesIndex_.clear();
+  }
+
+
   void CacheManager::MakeRoom(Bundle& bundle,
                               std::list<std::string>& toRemove,
                               int bundleIndex,
@@ -188,26 +294,51 @@ namespace OrthancPlugins
   {
     toRemove.clear();
 
-    // Make room in the bundle
-    while (!quota.IsSatisfied(bundle))
+    if (quota.IsSatisfied(bundle))
     {
-      Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? ORDER BY seq");
+      return;
+    }
+
+    // The LRU order must be up-to-date before evicting
+    FlushTouchesInternal();
+
+    // Collect the least recently used items in one ordered scan,
+    // until enough room is available in the bundle
+    int64_t lastSeq = 0;
+
+    {
+      Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize, item FROM Cache WHERE bundle=? ORDER BY seq");
       s.BindInt(0, bundleIndex);
 
-      if (s.Step())
+      while (!quota.IsSatisfied(bundle) &&
+             s.Step())
       {
-        Orthanc::SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-        t.BindInt64(0, s.ColumnInt64(0));
-        t.Run();
-
+        lastSeq = s.ColumnInt64(0);
         toRemove.push_back(s.ColumnString(1));
         bundle.Remove(s.ColumnInt64(2));
+
+        if (pimpl_->evictionTracking_)
+        {
+          pimpl_->evictedItems_.push_back(CacheIndex(bundleIndex, s.ColumnString(3)));
+        }
       }
-      else
-      {
-        // Should never happen
-        throw std::runtime_error("Internal error");
-      }
+    }
+
+    pimpl_->evictedCounts_[bundleIndex] += toRemove.size();
+
+    if (!quota.IsSatisfied(bundle))
+    {
+      // Should never happen
+      throw std::runtime_error("Internal error");
+    }
+
+    if (!toRemove.empty())
+    {
+      // Remove all the victims at once
+      Orthanc::SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE bundle=? AND seq<=?");
+      t.BindInt(0, bundleIndex);
+      t.BindInt64(1, lastSeq);
+      t.Run();
     }
   }
 
@@ -229,7 +360,7 @@ namespace OrthancPlugins
     for (std::list<std::string>::const_iterator
            it = toRemove.begin(); it != toRemove.end(); ++it)
     {
-      pimpl_->storage_.Remove(*it, Orthanc::FileContentType_Unknown);
+      RemoveFile(*it);
     }
 
     pimpl_->bundles_[bundleIndex] = bundle;
@@ -237,6 +368,37 @@ namespace OrthancPlugins
 
 
 
+  void CacheManager::RemoveFile(const std::string& uuid)
+  {
+    if (pimpl_->pinned_.find(uuid) == pimpl_->pinned_.end())
+    {
+      UnlinkFile(uuid);
+    }
+    else
+    {
+      // Some reader is still accessing this file: Postpone its removal
+      pimpl_->deferred_.insert(uuid);
+    }
+  }
+
+
+
+  void CacheManager::UnlinkFile(const std::string& uuid)
+  {
+    if (pimpl_->asynchronousRemoval_)
+    {
+      // The file is not indexed anymore: It will be removed from the
+      // filesystem later on, outside of the critical section
+      pimpl_->pendingRemovals_.push_back(uuid);
+    }
+    else
+    {
+      pimpl_->storage_.Remove(uuid, Orthanc::FileContentType_Unknown);
+    }
+  }
+
+
+
   void CacheManager::ReadBundleStatistics()
   {
     pimpl_->bundles_.clear();
@@ -287,6 +449,35 @@ namespace OrthancPlugins
   }
 
 
+  CacheManager::~CacheManager()
+  {
+    try
+    {
+      FlushTouches();
+    }
+    catch (...)
+    {
+      // Losing the recency of the last cache hits is harmless
+    }
+
+    std::list<std::string> toRemove;
+    TakePendingRemovals(toRemove);
+    RemoveFiles(toRemove);
+  }
+
+
+  void CacheManager::FlushTouches()
+  {
+    if (!pimpl_->touches_.empty())
+    {
+      std::unique_ptr<Orthanc::SQLite::Transaction> transaction(new Orthanc::SQLite::Transaction(pimpl_->db_));
+      transaction->Begin();
+      FlushTouchesInternal();
+      transaction->Commit();
+    }
+  }
+
+
   OrthancPluginContext* CacheManager::GetPluginContext() const
   {
     return pimpl_->context_;
@@ -339,6 +530,10 @@ namespace OrthancPlugins
     std::unique_ptr<Orthanc::SQLite::Transaction> transaction(new Orthanc::SQLite::Transaction(pimpl_->db_));
     transaction->Begin();
 
+    // The cache hits that happened before this item was created must
+    // be written first, to keep the LRU order consistent
+    FlushTouchesInternal();
+
     Bundle bundle = GetBundle(bundleIndex);
 
     std::list<std::string>  toRemove;
@@ -363,6 +558,7 @@ namespace OrthancPlugins
         t.BindInt64(0, s.ColumnInt64(0));
         t.Run();
 
+        ForgetTouch(s.ColumnInt64(0));
         toRemove.push_back(s.ColumnString(1));
         bundle.Remove(s.ColumnInt64(2));
       }
@@ -389,7 +585,7 @@ namespace OrthancPlugins
         for (std::list<std::string>::const_iterator
                it = toRemove.begin(); it != toRemove.end(); ++it)
         {
-          pimpl_->storage_.Remove(*it, Orthanc::FileContentType_Unknown);
+          RemoveFile(*it);
         }
       }
     }
@@ -406,40 +602,29 @@ namespace OrthancPlugins
   {
     SanityCheck();
 
-    std::unique_ptr<Orthanc::SQLite::Transaction> transaction(new Orthanc::SQLite::Transaction(pimpl_->db_));
-    transaction->Begin();
-
-    Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item=?");
-    s.BindInt(0, bundle);
-    s.BindString(1, item);
-    if (!s.Step())
     {
-      return false;
-    }
+      Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item=?");
+      s.BindInt(0, bundle);
+      s.BindString(1, item);
+      if (!s.Step())
+      {
+        return false;
+      }
+
+      uuid = s.ColumnString(1);
+      size = s.ColumnInt64(2);
 
-    int64_t seq = s.ColumnInt64(0);
-    uuid = s.ColumnString(1);
-    size = s.ColumnInt64(2);
+      // Touch the cache to fulfill the LRU scheme. This is only done
+      // in memory, so that cache hits do not write to SQLite.
+      Touch(s.ColumnInt64(0));
+    }
 
-    // Touch the cache to fulfill the LRU scheme.
-    Orthanc::SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-    t.BindInt64(0, seq);
-    if (t.Run())
+    if (pimpl_->touches_.size() >= MAX_PENDING_TOUCHES)
     {
-      Orthanc::SQLite::Statement u(pimpl_->db_, SQLITE_FROM_HERE, "INSERT INTO Cache VALUES(NULL, ?, ?, ?, ?)");
-      u.BindInt(0, bundle);
-      u.BindString(1, item);
-      u.BindString(2, uuid);
-      u.BindInt64(3, size);
-      if (u.Run())
-      {
-        // Everything was OK. Commit the changes to the cache.
-        transaction->Commit();
-        return true;
-      }
+      FlushTouches();
     }
 
-    return false;
+    return true;
   }
 
 
@@ -458,11 +643,48 @@ namespace OrthancPlugins
   {
     std::string uuid;
     uint64_t size;
-    if (!LocateInCache(uuid, size, bundle, item))
+    if (!Acquire(uuid, size, bundle, item))
+    {
+      return false;
+    }
+
+    try
+    {
+      ReadFile(content, uuid, size);
+    }
+    catch (...)
+    {
+      Release(uuid);
+      throw;
+    }
+
+    Release(uuid);
+    return true;
+  }
+
+
+  bool CacheManager::Acquire(std::string& uuid,
+                             uint64_t& size,
+                             int bundle,
+                             const std::string& item)
+  {
+    if (LocateInCache(uuid, size, bundle, item))
+    {
+      pimpl_->pinned_[uuid] += 1;
+      return true;
+    }
+    else
     {
       return false;
     }
+  }
+
 
+  void CacheManager::ReadFile(std::string& content,
+                              const std::string& uuid,
+                              uint64_t size)
+  {
+    // No mutex is needed here, as long as the file is pinned
     bool ok;
     try
     {
@@ -487,13 +709,35 @@ namespace OrthancPlugins
       ok = false;
     }
 
-    if (ok)
+    if (!ok)
     {
-      return true;
+      throw std::runtime_error("Error in the filesystem");
     }
-    else
+  }
+
+
+  void CacheManager::Release(const std::string& uuid)
+  {
+    PImpl::PinnedFiles::iterator found = pimpl_->pinned_.find(uuid);
+    if (found == pimpl_->pinned_.end())
     {
-      throw std::runtime_error("Error in the filesystem");
+      throw std::runtime_error("Internal error");
+    }
+
+    assert(found->second > 0);
+    found->second -= 1;
+
+    if (found->second == 0)
+    {
+      pimpl_->pinned_.erase(found);
+
+      std::set<std::string>::iterator deferred = pimpl_->deferred_.find(uuid);
+      if (deferred != pimpl_->deferred_.end())
+      {
+        // The file was evicted or invalidated while being read
+        pimpl_->deferred_.erase(deferred);
+        UnlinkFile(uuid);
+      }
     }
   }
 
@@ -523,8 +767,9 @@ namespace OrthancPlugins
       if (t.Run())
       {
         transaction->Commit();
+        ForgetTouch(seq);
         pimpl_->bundles_[bundleIndex] = bundle;
-        pimpl_->storage_.Remove(uuid, Orthanc::FileContentType_Unknown);
+        RemoveFile(uuid);
       }
     }
   }
@@ -544,6 +789,119 @@ namespace OrthancPlugins
     SanityCheck();
   }
 
+  void CacheManager::SetEvictionWatermarks(unsigned int high,
+                                           unsigned int low)
+  {
+    if (low == 0 ||
+        low > high ||
+        high > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    pimpl_->highWatermark_ = high;
+    pimpl_->lowWatermark_ = low;
+  }
+
+
+  bool CacheManager::IsAboveHighWatermark() const
+  {
+    for (Bundles::const_iterator it = pimpl_->bundles_.begin();
+         it != pimpl_->bundles_.end(); ++it)
+    {
+      if (!GetBundleQuota(it->first).Scale(pimpl_->highWatermark_).IsSatisfied(it->second))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
+  void CacheManager::Reclaim()
+  {
+    SanityCheck();
+
+    std::list<int> toReclaim;
+
+    for (Bundles::const_iterator it = pimpl_->bundles_.begin();
+         it != pimpl_->bundles_.end(); ++it)
+    {
+      if (!GetBundleQuota(it->first).Scale(pimpl_->highWatermark_).IsSatisfied(it->second))
+      {
+        toReclaim.push_back(it->first);
+      }
+    }
+
+    for (std::list<int>::const_iterator it = toReclaim.begin(); it != toReclaim.end(); ++it)
+    {
+      EnsureQuota(*it, GetBundleQuota(*it).Scale(pimpl_->lowWatermark_));
+    }
+
+    SanityCheck();
+  }
+
+
+  void CacheManager::SetAsynchronousRemoval(bool enabled)
+  {
+    pimpl_->asynchronousRemoval_ = enabled;
+  }
+
+
+  void CacheManager::TakePendingRemovals(std::list<std::string>& uuids)
+  {
+    uuids.clear();
+    uuids.swap(pimpl_->pendingRemovals_);
+  }
+
+
+  void CacheManager::SetEvictionTracking(bool enabled)
+  {
+    pimpl_->evictionTracking_ = enabled;
+
+    if (!enabled)
+    {
+      pimpl_->evictedItems_.clear();
+    }
+  }
+
+
+  void CacheManager::TakeEvictedItems(std::list<CacheIndex>& items)
+  {
+    items.clear();
+    items.swap(pimpl_->evictedItems_);
+  }
+
+
+  void CacheManager::GetBundleStatistics(BundleStatistics& target,
+                                         int bundle) const
+  {
+    const Bundle b = GetBundle(bundle);
+    target.count = b.GetCount();
+    target.space = b.GetSpace();
+
+    std::map<int, uint64_t>::const_iterator found = pimpl_->evictedCounts_.find(bundle);
+    target.evictedCount = (found == pimpl_->evictedCounts_.end() ? 0 : found->second);
+  }
+
+
+  void CacheManager::RemoveFiles(const std::list<std::string>& uuids)
+  {
+    for (std::list<std::string>::const_iterator it = uuids.begin(); it != uuids.end(); ++it)
+    {
+      try
+      {
+        pimpl_->storage_.Remove(*it, Orthanc::FileContentType_Unknown);
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        // Ignore the files that cannot be removed
+      }
+    }
+  }
+
+
   void CacheManager::SetDefaultQuota(uint32_t maxCount,
                                      uint64_t maxSpace)
   {
@@ -568,12 +926,15 @@ namespace OrthancPlugins
     Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT fileUuid FROM Cache");
     while (s.Step())
     {
-      pimpl_->storage_.Remove(s.ColumnString(0), Orthanc::FileContentType_Unknown);
+      RemoveFile(s.ColumnString(0));
     }  
 
     Orthanc::SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache");
     t.Run();
 
+    pimpl_->touches_.clear();
+    pimpl_->touchesIndex_.clear();
+
     ReadBundleStatistics();
     SanityCheck();
   }
@@ -584,11 +945,15 @@ namespace OrthancPlugins
   {
     SanityCheck();
 
+    // Write the pending touches, so that none of them refers to the
+    // items that are about to be removed
+    FlushTouches();
+
     Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT fileUuid FROM Cache WHERE bundle=?");
     s.BindInt(0, bundle);
     while (s.Step())
     {
-      pimpl_->storage_.Remove(s.ColumnString(0), Orthanc::FileContentType_Unknown);
+      RemoveFile(s.ColumnString(0));
     }  
 
     Orthanc::SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE bundle=?");
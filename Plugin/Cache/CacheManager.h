@@ -23,6 +23,8 @@
 
 #pragma once
 
+#include "CacheIndex.h"
+
 #include <FileStorage/FilesystemStorage.h>
 #include <SQLite/Connection.h>
 
@@ -38,12 +40,21 @@ namespace OrthancPlugins
   enum CacheProperty
   {
     CacheProperty_OrthancVersion,
-    CacheProperty_WebViewerVersion
+    CacheProperty_WebViewerVersion,
+    CacheProperty_DecodedImageFormat
   };
 
 
   class CacheManager : public boost::noncopyable
   {
+  public:
+    struct BundleStatistics
+    {
+      uint32_t  count;
+      uint64_t  space;
+      uint64_t  evictedCount;  // Items evicted to satisfy the quota, since the startup
+    };
+
   private:
     struct PImpl;
     boost::shared_ptr<PImpl> pimpl_;
@@ -75,6 +86,16 @@ namespace OrthancPlugins
                        int bundle,
                        const std::string& item);
 
+    void RemoveFile(const std::string& uuid);
+
+    void UnlinkFile(const std::string& uuid);
+
+    void Touch(int64_t seq);
+
+    void ForgetTouch(int64_t seq);
+
+    void FlushTouchesInternal();
+
     void SanityCheck();  // Only for debug
 
 
@@ -83,8 +104,18 @@ namespace OrthancPlugins
                  Orthanc::SQLite::Connection& db,
                  Orthanc::FilesystemStorage& storage);
 
+    ~CacheManager();
+
     OrthancPluginContext* GetPluginContext() const;
 
+    /**
+     * The LRU order of the cache hits is kept in memory, and is only
+     * written to SQLite together with the next store or eviction,
+     * after a batch of cache hits, or at destruction. This method
+     * forces this write.
+     **/
+    void FlushTouches();
+
     void SetSanityCheckEnabled(bool enabled);
 
     void Clear();
@@ -98,6 +129,48 @@ namespace OrthancPlugins
     void SetDefaultQuota(uint32_t maxCount,
                          uint64_t maxSpace);
 
+    /**
+     * Background eviction. The quotas are always enforced by
+     * "Store()", but a reclaimer thread can keep the bundles below
+     * them, so that "Store()" does not need to evict: Once a bundle
+     * exceeds "high" percent of its quota, "Reclaim()" evicts its
+     * items until "low" percent of the quota is reached. By default,
+     * both watermarks are 100%, which corresponds to the synchronous
+     * eviction.
+     **/
+    void SetEvictionWatermarks(unsigned int high,
+                               unsigned int low);
+
+    bool IsAboveHighWatermark() const;
+
+    void Reclaim();
+
+    /**
+     * If asynchronous removal is enabled, the files that are evicted
+     * or invalidated are not removed from the filesystem, but queued.
+     * "TakePendingRemovals()" gets this queue (with the mutex), and
+     * "RemoveFiles()" removes the files (without the mutex).
+     **/
+    void SetAsynchronousRemoval(bool enabled);
+
+    void TakePendingRemovals(std::list<std::string>& uuids);
+
+    void RemoveFiles(const std::list<std::string>& uuids);
+
+    /**
+     * If eviction tracking is enabled, the items that are evicted to
+     * satisfy the quotas are recorded, until "TakeEvictedItems()"
+     * gets them. This allows to know which items were never accessed
+     * before leaving the cache. The invalidated items are not
+     * recorded.
+     **/
+    void SetEvictionTracking(bool enabled);
+
+    void TakeEvictedItems(std::list<CacheIndex>& items);
+
+    void GetBundleStatistics(BundleStatistics& target,
+                             int bundle) const;
+
     bool IsCached(int bundle,
                   const std::string& item);
 
@@ -105,6 +178,26 @@ namespace OrthancPlugins
                 int bundle,
                 const std::string& item);
 
+    /**
+     * The 3 methods below allow to read a cached file without holding
+     * the mutex that protects the cache manager. "Acquire()" and
+     * "Release()" must be called while holding this mutex, as any
+     * other method. In between, the file is pinned: If it gets
+     * evicted or invalidated, its removal from the filesystem is
+     * deferred until "Release()", so "ReadFile()" can safely be
+     * called without the mutex.
+     **/
+    bool Acquire(std::string& uuid,
+                 uint64_t& size,
+                 int bundle,
+                 const std::string& item);
+
+    void ReadFile(std::string& content,
+                  const std::string& uuid,
+                  uint64_t size);
+
+    void Release(const std::string& uuid);
+
     void Invalidate(int bundle,
                     const std::string& item);
 
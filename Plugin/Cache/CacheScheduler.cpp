@@ -27,242 +27,252 @@
 
 #include <Compatibility.h>
 #include <OrthancException.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/tss.hpp>
+#include <algorithm>
+#include <cassert>
 #include <stdio.h>
 
 namespace OrthancPlugins
 {
-  class DynamicString : public Orthanc::IDynamicObject
+  // The job that is executed by the current worker, as seen by its
+  // factory
+  struct CurrentJob
   {
-  private:
-    std::string   value_;
+    std::string  session_;
+    bool         isDiscarded_;
+  };
 
-  public:
-    explicit DynamicString(const std::string& value) : value_(value)
+  static boost::thread_specific_ptr<CurrentJob>  currentJob_;
+
+
+  static uint64_t GetElapsedMicroseconds(const boost::posix_time::ptime& start)
+  {
+    const boost::posix_time::time_duration elapsed =
+      boost::posix_time::microsec_clock::universal_time() - start;
+
+    if (elapsed.is_negative())
     {
+      return 0;
     }
-
-    const std::string& GetValue() const
+    else
     {
-      return value_;
+      return static_cast<uint64_t>(elapsed.total_microseconds());
     }
-  };
+  }
 
 
-  class CacheScheduler::PrefetchQueue : public boost::noncopyable
+  /**
+   * A "PendingItem" is the job that generates one cache item. It is
+   * registered in the "pending_" table of the scheduler from the
+   * moment it is queued until its result is available, so that
+   * concurrent requests for the same item share the same job. Its
+   * queueing state ("priority_", "isQueued_", "isRefresh_",
+   * "session_", "enqueueTime_") is protected by the "pendingMutex_"
+   * of the scheduler, whereas its result is protected by its own
+   * mutex.
+   **/
+  class CacheScheduler::PendingItem : public boost::noncopyable
   {
+  public:
+    enum Result
+    {
+      Result_Success,
+      Result_Failure,
+      Result_AlreadyCached,
+      Result_Exception,
+      Result_Cancelled
+    };
+
   private:
-    boost::mutex                 mutex_;
-    Orthanc::SharedMessageQueue  queue_;
-    std::set<std::string>        content_;
+    CacheIndex                  index_;
+    Priority                    priority_;
+    bool                        isQueued_;
+    bool                        isRefresh_;
+    std::string                 session_;
+    boost::posix_time::ptime    enqueueTime_;
+
+    boost::mutex                mutex_;
+    boost::condition_variable   finished_;
+    bool                        isFinished_;
+    Result                      result_;
+    bool                        invalidated_;
+    std::string                 content_;
+    Orthanc::ErrorCode          errorCode_;
+    std::string                 errorMessage_;
 
   public:
-    explicit PrefetchQueue(size_t maxSize) : queue_(maxSize)
+    PendingItem(int bundle,
+                const std::string& item) :
+      index_(bundle, item),
+      priority_(Priority_Interactive),
+      isQueued_(false),
+      isRefresh_(false),
+      isFinished_(false),
+      result_(Result_Failure),
+      invalidated_(false),
+      errorCode_(Orthanc::ErrorCode_InternalError)
     {
-      queue_.SetLifoPolicy();
     }
 
-    void Enqueue(const std::string& item)
+    const CacheIndex& GetIndex() const
     {
-      boost::mutex::scoped_lock lock(mutex_);
-
-      if (content_.find(item) != content_.end())
-      {
-        // This cache index is already pending in the queue
-        return;
-      }
-
-      content_.insert(item);
-      queue_.Enqueue(new DynamicString(item));
+      return index_;
     }
 
-    DynamicString* Dequeue(int32_t msTimeout)
+    Priority GetPriority() const
     {
-      std::unique_ptr<Orthanc::IDynamicObject> message(queue_.Dequeue(msTimeout));
-      if (message.get() == NULL)
-      {
-        return NULL;
-      }
-
-      const DynamicString& index = dynamic_cast<const DynamicString&>(*message);
+      return priority_;
+    }
 
-      {
-        boost::mutex::scoped_lock lock(mutex_);
-        content_.erase(index.GetValue());
-      }
+    bool IsQueued() const
+    {
+      return isQueued_;
+    }
 
-      return dynamic_cast<DynamicString*>(message.release());
+    // A refresh regenerates the item even if it is already cached
+    bool IsRefresh() const
+    {
+      return isRefresh_;
     }
-  };
 
+    void SetRefresh()
+    {
+      isRefresh_ = true;
+    }
 
-  class CacheScheduler::Prefetcher : public boost::noncopyable
-  {
-  private:
-    int             bundleIndex_;
-    ICacheFactory&  factory_;
-    CacheManager&   cache_;
-    boost::mutex&   cacheMutex_;
-    PrefetchQueue&  queue_;
+    // The session that asked for a prefetching, which can cancel it.
+    // Empty if the job is shared by several sessions, or anonymous.
+    const std::string& GetSession() const
+    {
+      return session_;
+    }
 
-    bool            done_;
-    boost::thread   thread_;
-    boost::mutex    invalidatedMutex_;
-    bool            invalidated_;
-    std::string     prefetching_;
+    void SetSession(const std::string& session)
+    {
+      session_ = session;
+    }
 
-    static void Worker(Prefetcher* that)
+    const boost::posix_time::ptime& GetEnqueueTime() const
     {
-      while (!(that->done_))
-      {
-        std::unique_ptr<DynamicString> prefetch(that->queue_.Dequeue(500));
+      return enqueueTime_;
+    }
 
-        try
-        {
-          if (prefetch.get() != NULL)
-          {
-            {
-              boost::mutex::scoped_lock lock(that->invalidatedMutex_);
-              that->invalidated_ = false;
-              that->prefetching_ = prefetch->GetValue();
-            }
-
-            {
-              boost::mutex::scoped_lock lock(that->cacheMutex_);
-              if (that->cache_.IsCached(that->bundleIndex_, prefetch->GetValue()))
-              {
-                // This item is already cached
-                continue;
-              }
-            }
-
-            std::string content;
-
-            try
-            {
-              if (!that->factory_.Create(content, prefetch->GetValue()))
-              {
-                // The factory cannot generate this item
-                continue;
-              }
-            }
-            catch (...)
-            {
-              // Exception
-              continue;
-            }
-
-            {
-              boost::mutex::scoped_lock lock(that->invalidatedMutex_);
-              if (that->invalidated_)
-              {
-                // This item has been invalidated
-                continue;
-              }
-              
-              {
-                boost::mutex::scoped_lock lock2(that->cacheMutex_);
-                that->cache_.Store(that->bundleIndex_, prefetch->GetValue(), content);
-              }
-            }
-          }
-        }
-        catch (std::bad_alloc&)
-        {
-          OrthancPluginLogError(that->cache_.GetPluginContext(), 
-                                "Not enough memory for the prefetcher of the Web viewer to work");
-        }
-        catch (...)
-        {
-          OrthancPluginLogError(that->cache_.GetPluginContext(), 
-                                "Unhandled native exception inside the prefetcher of the Web viewer");
-        }
-      }
+    void SetQueued(Priority priority)
+    {
+      priority_ = priority;
+      isQueued_ = true;
+      enqueueTime_ = boost::posix_time::microsec_clock::universal_time();
     }
 
+    void SetDequeued()
+    {
+      isQueued_ = false;
+    }
 
-  public:
-    Prefetcher(int             bundleIndex,
-               ICacheFactory&  factory,
-               CacheManager&   cache,
-               boost::mutex&   cacheMutex,
-               PrefetchQueue&  queue) :
-      bundleIndex_(bundleIndex),
-      factory_(factory),
-      cache_(cache),
-      cacheMutex_(cacheMutex),
-      queue_(queue)
+    void SignalInvalidated()
     {
-      done_ = false;
-      thread_ = boost::thread(Worker, this);
+      boost::mutex::scoped_lock lock(mutex_);
+      invalidated_ = true;
     }
 
-    ~Prefetcher()
+    bool IsInvalidated()
     {
-      done_ = true;
-      if (thread_.joinable())
-      {
-        thread_.join();
-      }
+      boost::mutex::scoped_lock lock(mutex_);
+      return invalidated_;
     }
 
-    void SignalInvalidated(const std::string& item)
+    bool IsFinished()
     {
-      boost::mutex::scoped_lock lock(invalidatedMutex_);
+      boost::mutex::scoped_lock lock(mutex_);
+      return isFinished_;
+    }
 
-      if (prefetching_ == item)
+    // Only the first result of a job is taken into consideration
+    void SetResult(Result result,
+                   const std::string& content)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (isFinished_)
       {
-        invalidated_ = true;
+        return;
       }
-    }
-  };
 
+      isFinished_ = true;
+      result_ = result;
 
+      if (result == Result_Success)
+      {
+        content_ = content;
+      }
 
-  class CacheScheduler::BundleScheduler
-  {
-  private:
-    std::unique_ptr<ICacheFactory>   factory_;
-    PrefetchQueue                    queue_;
-    std::vector<Prefetcher*>         prefetchers_;
+      finished_.notify_all();
+    }
 
-  public:
-    BundleScheduler(int bundleIndex,
-                    ICacheFactory* factory,
-                    CacheManager&   cache,
-                    boost::mutex&   cacheMutex,
-                    size_t numThreads,
-                    size_t queueSize) :
-      factory_(factory),
-      queue_(queueSize)
+    void SetException(Orthanc::ErrorCode code,
+                      const std::string& message)
     {
-      prefetchers_.resize(numThreads, NULL);
-
-      for (size_t i = 0; i < numThreads; i++)
+      boost::mutex::scoped_lock lock(mutex_);
+      if (isFinished_)
       {
-        prefetchers_[i] = new Prefetcher(bundleIndex, *factory_, cache, cacheMutex, queue_);
+        return;
       }
+
+      isFinished_ = true;
+      result_ = Result_Exception;
+      errorCode_ = code;
+      errorMessage_ = message;
+      finished_.notify_all();
     }
 
-    ~BundleScheduler()
+    // Rethrows on the waiting thread the exception that was raised
+    // by the factory on the worker thread
+    Result WaitResult(std::string& content)
     {
-      for (size_t i = 0; i < prefetchers_.size(); i++)
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (!isFinished_)
       {
-        if (prefetchers_[i] != NULL)
-          delete prefetchers_[i];
+        finished_.wait(lock);
       }
-    }
 
-    void Invalidate(const std::string& item)
-    {
-      for (size_t i = 0; i < prefetchers_.size(); i++)
+      switch (result_)
       {
-        prefetchers_[i]->SignalInvalidated(item);
+        case Result_Success:
+          content = content_;
+          break;
+
+        case Result_Exception:
+          if (errorCode_ == Orthanc::ErrorCode_InternalError &&
+              !errorMessage_.empty())
+          {
+            throw std::runtime_error(errorMessage_);
+          }
+          else
+          {
+            throw Orthanc::OrthancException(errorCode_);
+          }
+
+        default:
+          break;
       }
+
+      return result_;
     }
+  };
 
-    void Prefetch(const std::string& item)
+
+
+  class CacheScheduler::BundleScheduler : public boost::noncopyable
+  {
+  private:
+    std::unique_ptr<ICacheFactory>   factory_;
+
+  public:
+    explicit BundleScheduler(ICacheFactory* factory) :
+      factory_(factory)
     {
-      queue_.Enqueue(item);
     }
 
     bool CallFactory(std::string& content,
@@ -295,158 +305,1358 @@ namespace OrthancPlugins
   }
 
 
-  
-  CacheScheduler::CacheScheduler(CacheManager& cache,
-                                 unsigned int maxPrefetchSize) :
-    maxPrefetchSize_(maxPrefetchSize),
-    cache_(cache)
+  void CacheScheduler::EnqueueJob(const boost::shared_ptr<PendingItem>& job,
+                                  Priority priority)
   {
-  }
+    // The "pendingMutex_" must be locked by the caller
+    job->SetQueued(priority);
 
-
-  CacheScheduler::~CacheScheduler()
-  {
-    for (BundleSchedulers::iterator it = bundles_.begin(); 
-         it != bundles_.end(); ++it)
+    if (priority == Priority_Interactive)
     {
-      delete it->second;
+      // Interactive requests are served in their order of arrival
+      queues_[Priority_Interactive].push_back(job);
+    }
+    else
+    {
+      // Prefetching favors the most recent requests (LIFO), and the
+      // oldest ones are dropped if the queue is full
+      Queue& queue = queues_[Priority_Prefetch];
+      queue.push_front(job);
+
+      Queue::iterator it = queue.end();
+      while (queue.size() > maxPrefetchSize_ &&
+             it != queue.begin())
+      {
+        --it;
+
+        if ((*it)->IsRefresh())
+        {
+          // Refreshes are never dropped, as the obsolete value would
+          // otherwise stay in the cache forever
+          continue;
+        }
+
+        // Only the background accesses can be waiting for a job that
+        // is still queued as a prefetch, as the interactive accesses
+        // promote it
+        (*it)->SetDequeued();
+        (*it)->SetResult(PendingItem::Result_Cancelled, "");
+        pending_.erase((*it)->GetIndex());
+        RecordCancelledPrefetch((*it)->GetIndex().GetBundle());
+        it = queue.erase(it);
+      }
     }
+
+    jobAvailable_.notify_one();
   }
 
 
-  void CacheScheduler::Register(int bundle, 
-                                ICacheFactory* factory /* takes ownership */,
-                                size_t  numThreads)
+  void CacheScheduler::UnqueueJob(const boost::shared_ptr<PendingItem>& job)
   {
-    boost::mutex::scoped_lock lock(factoryMutex_);
+    // The "pendingMutex_" must be locked by the caller
+    Queue& queue = queues_[job->GetPriority()];
 
-    BundleSchedulers::iterator it = bundles_.find(bundle);
-    if (it != bundles_.end())
+    for (Queue::iterator it = queue.begin(); it != queue.end(); ++it)
     {
-      // This bundle is already registered
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      if (it->get() == job.get())
+      {
+        queue.erase(it);
+        job->SetDequeued();
+        return;
+      }
     }
-
-    bundles_[bundle] = new BundleScheduler(bundle, factory, cache_, cacheMutex_, numThreads, maxPrefetchSize_);
   }
 
 
-  void CacheScheduler::SetQuota(int bundle,
-                                uint32_t maxCount,
-                                uint64_t maxSpace)
+  void CacheScheduler::PromoteJob(const boost::shared_ptr<PendingItem>& job)
   {
-    boost::mutex::scoped_lock lock(cacheMutex_);
-    cache_.SetBundleQuota(bundle, maxCount, maxSpace);
+    // The "pendingMutex_" must be locked by the caller
+    UnqueueJob(job);
+    EnqueueJob(job, Priority_Interactive);
   }
 
 
-  void CacheScheduler::Invalidate(int bundle,
-                                  const std::string& item)
+  boost::shared_ptr<CacheScheduler::PendingItem> CacheScheduler::DequeueJob(unsigned int msTimeout)
   {
+    boost::mutex::scoped_lock lock(pendingMutex_);
+
+    if (queues_[Priority_Interactive].empty() &&
+        queues_[Priority_Prefetch].empty())
     {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      cache_.Invalidate(bundle, item);
+      jobAvailable_.timed_wait(lock, boost::posix_time::milliseconds(msTimeout));
+    }
+
+    for (unsigned int i = 0; i < 2; i++)
+    {
+      // Interactive jobs are always served before prefetching
+      const Priority priority = (i == 0 ? Priority_Interactive : Priority_Prefetch);
+
+      while (!queues_[priority].empty())
+      {
+        boost::shared_ptr<PendingItem> job = queues_[priority].front();
+        queues_[priority].pop_front();
+        job->SetDequeued();
+
+        const uint64_t wait = GetElapsedMicroseconds(job->GetEnqueueTime());
+
+        if (priority == Priority_Prefetch &&
+            !job->IsRefresh() &&
+            maxPrefetchAge_ != 0 &&
+            wait > static_cast<uint64_t>(maxPrefetchAge_) * 1000000)
+        {
+          // This prefetching has become irrelevant while waiting
+          // (e.g. the viewer was closed), forget about it
+          job->SetResult(PendingItem::Result_Cancelled, "");
+          pending_.erase(job->GetIndex());
+          RecordCancelledPrefetch(job->GetIndex().GetBundle());
+          continue;
+        }
+
+        statistics_[priority].dequeuedCount++;
+        statistics_[priority].totalWaitMicroseconds += wait;
+        statistics_[priority].maxWaitMicroseconds =
+          std::max(statistics_[priority].maxWaitMicroseconds, wait);
+
+        return job;
+      }
     }
 
-    GetBundleScheduler(bundle).Invalidate(item);
+    return boost::shared_ptr<PendingItem>();
   }
 
 
-  void CacheScheduler::ApplyPrefetchPolicy(int bundle,
-                                           const std::string& item,
-                                           const std::string& content)
+  void CacheScheduler::ExecuteJob(PendingItem& job)
   {
-    boost::recursive_mutex::scoped_lock lock(policyMutex_);
+    const int bundle = job.GetIndex().GetBundle();
+    const std::string& item = job.GetIndex().GetItem();
 
-    if (policy_.get() != NULL)
     {
-      std::list<CacheIndex> toPrefetch;
+      std::unique_ptr<CurrentJob> current(new CurrentJob);
+      current->isDiscarded_ = false;
 
       {
-        policy_->Apply(toPrefetch, *this, CacheIndex(bundle, item), content);
+        boost::mutex::scoped_lock lock(pendingMutex_);
+        current->session_ = job.GetSession();
       }
 
-      for (std::list<CacheIndex>::const_reverse_iterator
-             it = toPrefetch.rbegin(); it != toPrefetch.rend(); ++it)
+      currentJob_.reset(current.release());
+    }
+
+    try
+    {
+      if (job.GetPriority() == Priority_Prefetch &&
+          !job.IsRefresh())
+      {
+        bool isCached;
+
+        {
+          boost::mutex::scoped_lock lock(cacheMutex_);
+          isCached = cache_.IsCached(bundle, item);
+        }
+
+        if (isCached)
+        {
+          // This item was cached after the prefetching was scheduled
+          RemovePending(job);
+          job.SetResult(PendingItem::Result_AlreadyCached, "");
+          return;
+        }
+      }
+
+      std::string content;
+      bool success = GetBundleScheduler(bundle).CallFactory(content, item);
+
+      if (success &&
+          currentJob_->isDiscarded_)
       {
-        Prefetch(it->GetBundle(), it->GetItem());
+        // The content is given to the requests that wait for it, as
+        // for an invalidated job, but it is neither stored nor
+        // promoted into the memory cache
+        job.SignalInvalidated();
       }
-    }
-  }
 
+      if (success &&
+          !job.IsInvalidated() &&
+          !job.IsFinished())  // Not already stored by the factory using "Store()"
+      {
+        StoreInCache(bundle, item, content);
 
-  bool CacheScheduler::Access(std::string& content,
-                              int bundle,
-                              const std::string& item)
-  {
-    bool existing;
+        if (job.IsRefresh())
+        {
+          // Forget about the previous value in the memory cache. This
+          // also prevents the concurrent readers of the previous
+          // value from promoting it into the memory cache.
+          memory_.Invalidate(bundle, item);
+        }
+        else if (job.GetPriority() == Priority_Prefetch)
+        {
+          RecordPrefetched(bundle, item);
+        }
+      }
 
+      // The item is removed from the pending items after it has been
+      // stored, so that no concurrent request misses both of them
+      RemovePending(job);
+      job.SetResult(success ? PendingItem::Result_Success : PendingItem::Result_Failure, content);
+      return;
+    }
+    catch (Orthanc::OrthancException& e)
     {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      existing = cache_.Access(content, bundle, item);
+      RemovePending(job);
+      job.SetException(e.GetErrorCode(), "");
     }
-
-    if (existing)
+    catch (std::bad_alloc&)
     {
-      ApplyPrefetchPolicy(bundle, item, content);
-      return true;
+      OrthancPluginLogError(cache_.GetPluginContext(), 
+                            "Not enough memory for the decoding pool of the Web viewer to work");
+      RemovePending(job);
+      job.SetException(Orthanc::ErrorCode_NotEnoughMemory, "");
     }
-
-    if (!GetBundleScheduler(bundle).CallFactory(content, item))
+    catch (std::runtime_error& e)
     {
-      // This item cannot be generated by the factory
-      return false;
+      RemovePending(job);
+      job.SetException(Orthanc::ErrorCode_InternalError, e.what());
     }
-
+    catch (...)
     {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      cache_.Store(bundle, item, content);
+      OrthancPluginLogError(cache_.GetPluginContext(), 
+                            "Unhandled native exception inside the decoding pool of the Web viewer");
+      RemovePending(job);
+      job.SetException(Orthanc::ErrorCode_InternalError, "");
     }
-
-    ApplyPrefetchPolicy(bundle, item, content);
-
-    return true;
   }
 
 
-  void CacheScheduler::Prefetch(int bundle,
-                                const std::string& item)
+  void CacheScheduler::Worker(CacheScheduler* that)
   {
-    GetBundleScheduler(bundle).Prefetch(item);
+    while (!that->done_)
+    {
+      boost::shared_ptr<PendingItem> job = that->DequeueJob(500);
+
+      if (job.get() != NULL)
+      {
+        that->ExecuteJob(*job);
+      }
+    }
   }
 
 
-  void CacheScheduler::RegisterPolicy(IPrefetchPolicy* policy)
+  void CacheScheduler::Reclaimer(CacheScheduler* that)
   {
-    boost::recursive_mutex::scoped_lock lock(policyMutex_);
-    policy_.reset(policy);
+    while (!that->done_)
+    {
+      std::list<std::string> toRemove;
+
+      try
+      {
+        boost::mutex::scoped_lock lock(that->cacheMutex_);
+
+        // Also wake up periodically, to unlink the files that were
+        // invalidated or released by the readers in the meantime
+        that->reclaimNeeded_.timed_wait(lock, boost::posix_time::milliseconds(100));
+
+        if (that->cache_.IsAboveHighWatermark())
+        {
+          that->cache_.Reclaim();
+          that->TrackEvictions();
+        }
+
+        that->cache_.TakePendingRemovals(toRemove);
+      }
+      catch (std::runtime_error& e)
+      {
+        OrthancPluginLogError(that->cache_.GetPluginContext(), e.what());
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        OrthancPluginLogError(that->cache_.GetPluginContext(), e.What());
+      }
+
+      // Unlinking the files is done without locking the cache
+      that->cache_.RemoveFiles(toRemove);
+    }
   }
 
 
-  ICacheFactory& CacheScheduler::GetFactory(int bundle)
+  void CacheScheduler::Planner(CacheScheduler* that)
   {
-    return GetBundleScheduler(bundle).GetFactory();
+    for (;;)
+    {
+      PlanningRequest request;
+
+      {
+        boost::mutex::scoped_lock lock(that->planningMutex_);
+
+        while (!that->planningDone_ &&
+               that->planningQueue_.empty())
+        {
+          that->planningAvailable_.wait(lock);
+        }
+
+        if (that->planningDone_)
+        {
+          return;
+        }
+
+        PlanningRequests::iterator found = that->planningRequests_.find(that->planningQueue_.front());
+        assert(found != that->planningRequests_.end());
+
+        request = found->second;
+        that->planningRequests_.erase(found);
+        that->planningQueue_.pop_front();
+      }
+
+      try
+      {
+        that->ApplyPrefetchPolicy(request);
+      }
+      catch (std::runtime_error& e)
+      {
+        OrthancPluginLogError(that->cache_.GetPluginContext(), e.what());
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        OrthancPluginLogError(that->cache_.GetPluginContext(), e.What());
+      }
+    }
   }
 
 
-  void CacheScheduler::SetProperty(CacheProperty property,
-                   const std::string& value)
+  void CacheScheduler::StoreInCache(int bundle,
+                                    const std::string& item,
+                                    const std::string& content)
   {
     boost::mutex::scoped_lock lock(cacheMutex_);
-    cache_.SetProperty(property, value);
+    cache_.Store(bundle, item, content);
+    TrackEvictions();
+
+    if (reclaimer_ != NULL &&
+        cache_.IsAboveHighWatermark())
+    {
+      reclaimNeeded_.notify_one();
+    }
   }
 
   
-  bool CacheScheduler::LookupProperty(std::string& target,
-                                      CacheProperty property)
+  CacheScheduler::CacheScheduler(CacheManager& cache,
+                                 unsigned int maxPrefetchSize) :
+    maxPrefetchSize_(maxPrefetchSize),
+    maxPrefetchAge_(0),
+    cache_(cache),
+    memory_(0),  // The memory cache is disabled by default
+    done_(false),
+    batchCount_(0),
+    reclaimer_(NULL),
+    planningDone_(false),
+    planner_(NULL)
   {
-    boost::mutex::scoped_lock lock(cacheMutex_);
-    return cache_.LookupProperty(target, property);
+    for (unsigned int i = 0; i < 2; i++)
+    {
+      statistics_[i].queueDepth = 0;
+      statistics_[i].dequeuedCount = 0;
+      statistics_[i].totalWaitMicroseconds = 0;
+      statistics_[i].maxWaitMicroseconds = 0;
+    }
+
+    // To know which prefetched items are evicted without being used
+    cache_.SetEvictionTracking(true);
   }
 
 
-  void CacheScheduler::Clear()
+  CacheScheduler::~CacheScheduler()
   {
+    // The planner is stopped first, as it might be waiting for an item
+    // that is generated by the decoding pool
+    if (planner_ != NULL)
+    {
+      {
+        boost::mutex::scoped_lock lock(planningMutex_);
+        planningDone_ = true;
+        planningAvailable_.notify_all();
+      }
+
+      if (planner_->joinable())
+      {
+        planner_->join();
+      }
+
+      delete planner_;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(pendingMutex_);
+      done_ = true;
+      jobAvailable_.notify_all();
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+      if (workers_[i]->joinable())
+      {
+        workers_[i]->join();
+      }
+
+      delete workers_[i];
+    }
+
+    if (reclaimer_ != NULL)
+    {
+      {
+        boost::mutex::scoped_lock lock(cacheMutex_);
+        reclaimNeeded_.notify_all();
+      }
+
+      if (reclaimer_->joinable())
+      {
+        reclaimer_->join();
+      }
+
+      delete reclaimer_;
+    }
+
+    for (BundleSchedulers::iterator it = bundles_.begin(); 
+         it != bundles_.end(); ++it)
+    {
+      delete it->second;
+    }
+  }
+
+
+  void CacheScheduler::Register(int bundle, 
+                                ICacheFactory* factory /* takes ownership */,
+                                size_t  numThreads)
+  {
+    boost::mutex::scoped_lock lock(factoryMutex_);
+
+    BundleSchedulers::iterator it = bundles_.find(bundle);
+    if (it != bundles_.end())
+    {
+      // This bundle is already registered
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    bundles_[bundle] = new BundleScheduler(factory);
+
+    // The threads are added to the decoding pool that is shared by
+    // all the bundles
+    for (size_t i = 0; i < numThreads; i++)
+    {
+      workers_.push_back(new boost::thread(Worker, this));
+    }
+  }
+
+
+  void CacheScheduler::SetQuota(int bundle,
+                                uint32_t maxCount,
+                                uint64_t maxSpace)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    cache_.SetBundleQuota(bundle, maxCount, maxSpace);
+    TrackEvictions();
+  }
+
+
+  void CacheScheduler::SetMemoryCacheSize(uint64_t maxSize)
+  {
+    memory_.SetMaximumSize(maxSize);
+  }
+
+
+  void CacheScheduler::SetMaxPrefetchAge(unsigned int seconds)
+  {
+    boost::mutex::scoped_lock lock(pendingMutex_);
+    maxPrefetchAge_ = seconds;
+  }
+
+
+  void CacheScheduler::SetEvictionWatermarks(unsigned int high,
+                                             unsigned int low)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    cache_.SetEvictionWatermarks(high, low);
+    cache_.SetAsynchronousRemoval(true);
+
+    if (reclaimer_ == NULL)
+    {
+      reclaimer_ = new boost::thread(Reclaimer, this);
+    }
+  }
+
+
+  void CacheScheduler::Invalidate(int bundle,
+                                  const std::string& item)
+  {
+    RecordDiscarded(CacheIndex(bundle, item));
+
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cache_.Invalidate(bundle, item);
+    }
+
+    {
+      // If this item is being generated, prevent the obsolete value
+      // from being stored into the cache
+      boost::mutex::scoped_lock lock(pendingMutex_);
+
+      PendingItems::iterator found = pending_.find(CacheIndex(bundle, item));
+      if (found != pending_.end())
+      {
+        found->second->SignalInvalidated();
+      }
+    }
+
+    // The memory cache is invalidated last: Its generation counter
+    // prevents the threads that have read the obsolete value from
+    // the persistent cache (or from the job) from promoting it
+    memory_.Invalidate(bundle, item);
+  }
+
+
+  void CacheScheduler::RemovePending(const PendingItem& job)
+  {
+    boost::mutex::scoped_lock lock(pendingMutex_);
+
+    // The job might have been completed by "Store()", and a new job
+    // might have been registered for the same item in the meantime
+    PendingItems::iterator found = pending_.find(job.GetIndex());
+    if (found != pending_.end() &&
+        found->second.get() == &job)
+    {
+      pending_.erase(found);
+    }
+  }
+
+
+  bool CacheScheduler::ReadFromCache(std::string& content,
+                                     int bundle,
+                                     const std::string& item)
+  {
+    std::string uuid;
+    uint64_t size;
+
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      if (!cache_.Acquire(uuid, size, bundle, item))
+      {
+        return false;
+      }
+    }
+
+    // Read the file outside of the critical section. The file is
+    // pinned, so it cannot be removed by a concurrent eviction.
+    try
+    {
+      cache_.ReadFile(content, uuid, size);
+    }
+    catch (...)
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cache_.Release(uuid);
+      throw;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cache_.Release(uuid);
+    }
+
+    return true;
+  }
+
+
+  boost::shared_ptr<CacheScheduler::PendingItem> CacheScheduler::SubmitJob(int bundle,
+                                                                          const std::string& item,
+                                                                          Priority priority,
+                                                                          const std::string& session)
+  {
+    boost::mutex::scoped_lock lock(pendingMutex_);
+
+    PendingItems::const_iterator found = pending_.find(CacheIndex(bundle, item));
+    if (found == pending_.end())
+    {
+      boost::shared_ptr<PendingItem> job(new PendingItem(bundle, item));
+      job->SetSession(session);
+      pending_.insert(std::make_pair(CacheIndex(bundle, item), job));
+      EnqueueJob(job, priority);
+      return job;
+    }
+    else
+    {
+      // Another request is already generating this item, share its
+      // result. If this is a queued prefetching, a user is now
+      // waiting for it: Promote it to the interactive queue.
+      boost::shared_ptr<PendingItem> job = found->second;
+
+      if (job->GetSession() != session)
+      {
+        // Shared by several sessions, as in "Prefetch()"
+        job->SetSession("");
+      }
+
+      if (priority == Priority_Interactive &&
+          job->IsQueued() &&
+          job->GetPriority() == Priority_Prefetch)
+      {
+        PromoteJob(job);
+      }
+
+      return job;
+    }
+  }
+
+
+  bool CacheScheduler::WaitJob(std::string& content,
+                               bool& isUpToDate,
+                               boost::shared_ptr<PendingItem> job,
+                               int bundle,
+                               const std::string& item,
+                               Priority priority,
+                               const std::string& session)
+  {
+    isUpToDate = true;
+
+    for (;;)
+    {
+      switch (job->WaitResult(content))
+      {
+        case PendingItem::Result_Success:
+          // The result of a job that was invalidated while running is
+          // given to the requests waiting for it, but must not be
+          // promoted into the memory cache
+          isUpToDate = !job->IsInvalidated();
+          return true;
+
+        case PendingItem::Result_Failure:
+          return false;
+
+        case PendingItem::Result_Cancelled:
+          // Only happens to the background accesses, whose job was
+          // dropped from the full prefetch queue, or has aged
+          return false;
+
+        case PendingItem::Result_AlreadyCached:
+          if (ReadFromCache(content, bundle, item))
+          {
+            return true;
+          }
+
+          // The item was evicted in the meantime, generate it again
+          job = SubmitJob(bundle, item, priority, session);
+          break;
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+    }
+  }
+
+
+  bool CacheScheduler::Generate(std::string& content,
+                                bool& isUpToDate,
+                                int bundle,
+                                const std::string& item,
+                                const std::string& session)
+  {
+    return WaitJob(content, isUpToDate, SubmitJob(bundle, item, Priority_Interactive, session),
+                   bundle, item, Priority_Interactive, session);
+  }
+
+
+  CacheScheduler::AccessStatistics& CacheScheduler::GetAccessStatisticsInternal(int bundle)
+  {
+    AccessStatisticsMap::iterator found = accessStatistics_.find(bundle);
+
+    if (found == accessStatistics_.end())
+    {
+      AccessStatistics statistics;
+      statistics.memoryHits = 0;
+      statistics.diskHits = 0;
+      statistics.misses = 0;
+      statistics.prefetchedCount = 0;
+      statistics.prefetchUsed = 0;
+      statistics.prefetchWasted = 0;
+      statistics.prefetchCancelled = 0;
+
+      found = accessStatistics_.insert(std::make_pair(bundle, statistics)).first;
+    }
+
+    return found->second;
+  }
+
+
+  void CacheScheduler::RecordHit(int bundle,
+                                 const std::string& item,
+                                 bool isMemory)
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+
+    AccessStatistics& statistics = GetAccessStatisticsInternal(bundle);
+
+    if (isMemory)
+    {
+      statistics.memoryHits++;
+    }
+    else
+    {
+      statistics.diskHits++;
+    }
+
+    if (!prefetched_.empty() &&
+        prefetched_.erase(CacheIndex(bundle, item)) > 0)
+    {
+      // First access to an item that was prefetched
+      statistics.prefetchUsed++;
+    }
+  }
+
+
+  void CacheScheduler::RecordMiss(int bundle)
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+    GetAccessStatisticsInternal(bundle).misses++;
+  }
+
+
+  void CacheScheduler::RecordPrefetched(int bundle,
+                                        const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+    GetAccessStatisticsInternal(bundle).prefetchedCount++;
+    prefetched_.insert(CacheIndex(bundle, item));
+  }
+
+
+  void CacheScheduler::RecordCancelledPrefetch(int bundle)
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+    GetAccessStatisticsInternal(bundle).prefetchCancelled++;
+  }
+
+
+  void CacheScheduler::RecordDiscarded(const CacheIndex& index)
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+
+    if (!prefetched_.empty() &&
+        prefetched_.erase(index) > 0)
+    {
+      // This item leaves the cache without having been accessed
+      GetAccessStatisticsInternal(index.GetBundle()).prefetchWasted++;
+    }
+  }
+
+
+  void CacheScheduler::TrackEvictions()
+  {
+    std::list<CacheIndex> evicted;
+    cache_.TakeEvictedItems(evicted);
+
+    for (std::list<CacheIndex>::const_iterator it = evicted.begin(); it != evicted.end(); ++it)
+    {
+      RecordDiscarded(*it);
+    }
+  }
+
+
+  void CacheScheduler::ApplyPrefetchPolicy(const PlanningRequest& request)
+  {
+    boost::mutex::scoped_lock lock(policyMutex_);
+
+    if (policy_.get() != NULL)
+    {
+      std::list<CacheIndex> toPrefetch;
+
+      {
+        policy_->Apply(toPrefetch, *this, CacheIndex(request.bundle_, request.item_),
+                       request.content_, request.session_);
+      }
+
+      for (std::list<CacheIndex>::const_reverse_iterator
+             it = toPrefetch.rbegin(); it != toPrefetch.rend(); ++it)
+      {
+        Prefetch(it->GetBundle(), it->GetItem(), request.session_);
+      }
+    }
+  }
+
+
+  void CacheScheduler::SchedulePrefetchPolicy(int bundle,
+                                              const std::string& item,
+                                              const std::string& content,
+                                              const std::string& session)
+  {
+    boost::mutex::scoped_lock lock(planningMutex_);
+
+    if (planner_ == NULL)
+    {
+      // No prefetch policy
+      return;
+    }
+
+    // The anonymous accesses are only merged with the accesses to the same item
+    const PlanningKey key(session, CacheIndex(bundle, session.empty() ? item : ""));
+
+    PlanningRequests::iterator found = planningRequests_.find(key);
+    if (found == planningRequests_.end())
+    {
+      if (planningQueue_.size() >= maxPrefetchSize_)
+      {
+        // Too many accesses are waiting for their planning, forget
+        // about this one as prefetching is only speculative
+        return;
+      }
+
+      planningQueue_.push_back(key);
+      found = planningRequests_.insert(std::make_pair(key, PlanningRequest())).first;
+    }
+
+    // If the session has already made an access that is still to be
+    // planned, it is superseded by this one, but keeps its place
+    found->second.bundle_ = bundle;
+    found->second.item_ = item;
+    found->second.session_ = session;
+
+    // Only copy the payloads that are read by the policy, as the
+    // images can weigh several MB
+    assert(policy_.get() != NULL);
+    if (policy_->IsContentNeeded(bundle))
+    {
+      found->second.content_ = content;
+    }
+    else
+    {
+      found->second.content_.clear();
+    }
+
+    planningAvailable_.notify_one();
+  }
+
+
+  bool CacheScheduler::Access(std::string& content,
+                              int bundle,
+                              const std::string& item)
+  {
+    return Access(content, bundle, item, "");
+  }
+
+
+  bool CacheScheduler::Access(std::string& content,
+                              int bundle,
+                              const std::string& item,
+                              const std::string& session)
+  {
+    AccessTimings timings;
+    return Access(content, timings, bundle, item, session);
+  }
+
+
+  bool CacheScheduler::Access(std::string& content,
+                              AccessTimings& timings,
+                              int bundle,
+                              const std::string& item,
+                              const std::string& session)
+  {
+    timings.lookupMicroseconds = 0;
+    timings.waitMicroseconds = 0;
+    timings.isGenerated = false;
+
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+    if (memory_.Access(content, bundle, item))
+    {
+      // Hit in the memory cache, no need to access SQLite nor the disk
+      timings.lookupMicroseconds = GetElapsedMicroseconds(start);
+      RecordHit(bundle, item, true);
+      SchedulePrefetchPolicy(bundle, item, content, session);
+      return true;
+    }
+
+    // Read before the persistent cache, so that a value that is
+    // invalidated or refreshed in the meantime is not promoted
+    const uint64_t generation = memory_.GetGeneration(bundle, item);
+
+    if (ReadFromCache(content, bundle, item))
+    {
+      timings.lookupMicroseconds = GetElapsedMicroseconds(start);
+      RecordHit(bundle, item, false);
+      memory_.Store(bundle, item, content, generation);
+      SchedulePrefetchPolicy(bundle, item, content, session);
+      return true;
+    }
+
+    // Cache miss: The item is generated by the decoding pool with
+    // the interactive priority, and the calling thread waits for it
+    timings.lookupMicroseconds = GetElapsedMicroseconds(start);
+    timings.isGenerated = true;
+    RecordMiss(bundle);
+
+    const boost::posix_time::ptime submission = boost::posix_time::microsec_clock::universal_time();
+    bool isUpToDate;
+    const bool success = Generate(content, isUpToDate, bundle, item, session);
+    timings.waitMicroseconds = GetElapsedMicroseconds(submission);
+
+    if (!success)
+    {
+      // This item cannot be generated by the factory
+      return false;
+    }
+
+    if (isUpToDate)
+    {
+      memory_.Store(bundle, item, content, generation);
+    }
+
+    SchedulePrefetchPolicy(bundle, item, content, session);
+
+    return true;
+  }
+
+
+  namespace
+  {
+    // Cancels the look-ahead of a batch once it is over, even if the
+    // visitor has thrown an exception (e.g. the client has closed the
+    // connection), as nobody will ever wait for these items
+    class BatchLookAhead : public boost::noncopyable
+    {
+    private:
+      CacheScheduler&  scheduler_;
+      std::string      session_;
+
+    public:
+      BatchLookAhead(CacheScheduler& scheduler,
+                     const std::string& session) :
+        scheduler_(scheduler),
+        session_(session)
+      {
+      }
+
+      ~BatchLookAhead()
+      {
+        scheduler_.CancelPrefetch(session_);
+      }
+
+      const std::string& GetSession() const
+      {
+        return session_;
+      }
+    };
+  }
+
+
+  void CacheScheduler::AccessBatch(IBatchVisitor& visitor,
+                                   int bundle,
+                                   const std::vector<std::string>& items)
+  {
+    // Make sure that a factory is associated with this bundle
+    GetBundleScheduler(bundle);
+
+    size_t window;
+
+    {
+      boost::mutex::scoped_lock lock(factoryMutex_);
+      window = workers_.size();
+    }
+
+    // The window always contains the current item
+    window = std::max(window, static_cast<size_t>(1));
+
+    std::string session;
+
+    {
+      boost::mutex::scoped_lock lock(pendingMutex_);
+      session = "batch/" + boost::lexical_cast<std::string>(batchCount_);
+      batchCount_++;
+    }
+
+    BatchLookAhead lookAhead(*this, session);
+
+    std::vector<uint64_t> generations(items.size());
+    size_t next = 0;  // The next item to be looked ahead
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+      // The missing items that follow the current one are generated
+      // ahead with the prefetch priority, within a window as large as
+      // the decoding pool, so that they never delay the interactive
+      // requests of the other users. The window is queued from its
+      // end, as the prefetch queue is LIFO: The nearest slices come
+      // first out of the queue.
+      const size_t end = std::min(items.size(), i + window);
+
+      for (size_t j = end; j > next; j--)
+      {
+        generations[j - 1] = memory_.GetGeneration(bundle, items[j - 1]);
+
+        if (!IsCached(bundle, items[j - 1]))
+        {
+          Prefetch(bundle, items[j - 1], lookAhead.GetSession());
+        }
+      }
+
+      next = std::max(next, end);
+
+      std::string content;
+      bool success = false;
+      bool promote = false;
+
+      try
+      {
+        if (memory_.Access(content, bundle, items[i]))
+        {
+          RecordHit(bundle, items[i], true);
+          success = true;
+        }
+        else if (ReadFromCache(content, bundle, items[i]))
+        {
+          RecordHit(bundle, items[i], false);
+          success = true;
+          promote = true;
+        }
+        else
+        {
+          // Wait for the item with the interactive priority: Its job
+          // is promoted if it is still queued by the look-ahead
+          RecordMiss(bundle);
+          success = Generate(content, promote, bundle, items[i], lookAhead.GetSession());
+        }
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        // A single item that cannot be decoded must not break the batch
+        success = false;
+      }
+      catch (std::runtime_error&)
+      {
+        success = false;
+      }
+
+      if (success &&
+          promote)
+      {
+        memory_.Store(bundle, items[i], content, generations[i]);
+      }
+
+      visitor.Visit(i, items[i], success, content);
+    }
+  }
+
+
+  void CacheScheduler::Store(int bundle,
+                             const std::string& item,
+                             const std::string& content)
+  {
+    StoreInCache(bundle, item, content);
+
+    // If some job is pending for this item, it is completed right
+    // now, and the requests that are waiting for it are answered
+    boost::shared_ptr<PendingItem> job;
+
+    {
+      boost::mutex::scoped_lock lock(pendingMutex_);
+
+      PendingItems::iterator found = pending_.find(CacheIndex(bundle, item));
+      if (found == pending_.end())
+      {
+        return;
+      }
+
+      job = found->second;
+      pending_.erase(found);
+
+      if (job->IsQueued())
+      {
+        UnqueueJob(job);
+      }
+    }
+
+    job->SetResult(PendingItem::Result_Success, content);
+  }
+
+
+  bool CacheScheduler::AccessInBackground(std::string& content,
+                                          int bundle,
+                                          const std::string& item)
+  {
+    if (Lookup(content, bundle, item))
+    {
+      return true;
+    }
+
+    // Make sure that a factory is associated with this bundle
+    GetBundleScheduler(bundle);
+
+    bool isUpToDate;
+    return WaitJob(content, isUpToDate, SubmitJob(bundle, item, Priority_Prefetch, ""),
+                   bundle, item, Priority_Prefetch, "");
+  }
+
+
+  bool CacheScheduler::Lookup(std::string& content,
+                              int bundle,
+                              const std::string& item)
+  {
+    return (memory_.Access(content, bundle, item) ||
+            ReadFromCache(content, bundle, item));
+  }
+
+
+  bool CacheScheduler::IsCached(int bundle,
+                                const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    return cache_.IsCached(bundle, item);
+  }
+
+
+  void CacheScheduler::Prefetch(int bundle,
+                                const std::string& item)
+  {
+    Prefetch(bundle, item, "");
+  }
+
+
+  void CacheScheduler::Prefetch(int bundle,
+                                const std::string& item,
+                                const std::string& session)
+  {
+    // Make sure that a factory is associated with this bundle
+    GetBundleScheduler(bundle);
+
+    boost::mutex::scoped_lock lock(pendingMutex_);
+
+    PendingItems::iterator found = pending_.find(CacheIndex(bundle, item));
+    if (found != pending_.end())
+    {
+      // This item is already queued or being generated. If another
+      // session asked for it, none of them can cancel it anymore.
+      if (found->second->GetSession() != session)
+      {
+        found->second->SetSession("");
+      }
+
+      return;
+    }
+
+    boost::shared_ptr<PendingItem> job(new PendingItem(bundle, item));
+    job->SetSession(session);
+    pending_.insert(std::make_pair(CacheIndex(bundle, item), job));
+    EnqueueJob(job, Priority_Prefetch);
+  }
+
+
+  size_t CacheScheduler::CancelPrefetch(const std::string& session)
+  {
+    if (session.empty())
+    {
+      return 0;
+    }
+
+    boost::mutex::scoped_lock lock(pendingMutex_);
+
+    // Only the jobs that are still queued as prefetching are
+    // cancelled: Nobody is waiting for them
+    size_t count = 0;
+
+    Queue& queue = queues_[Priority_Prefetch];
+    Queue::iterator it = queue.begin();
+    while (it != queue.end())
+    {
+      if ((*it)->GetSession() == session &&
+          !(*it)->IsRefresh())
+      {
+        (*it)->SetDequeued();
+        (*it)->SetResult(PendingItem::Result_Cancelled, "");
+        pending_.erase((*it)->GetIndex());
+        RecordCancelledPrefetch((*it)->GetIndex().GetBundle());
+        it = queue.erase(it);
+        count++;
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    return count;
+  }
+
+
+  std::string CacheScheduler::GetCurrentSession()
+  {
+    if (currentJob_.get() == NULL)
+    {
+      return "";
+    }
+    else
+    {
+      return currentJob_->session_;
+    }
+  }
+
+
+  void CacheScheduler::DiscardCurrentItem()
+  {
+    if (currentJob_.get() != NULL)
+    {
+      currentJob_->isDiscarded_ = true;
+    }
+  }
+
+
+  void CacheScheduler::CloseSession(const std::string& session)
+  {
+    if (session.empty())
+    {
+      return;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(planningMutex_);
+
+      std::list<PlanningKey>::iterator it = planningQueue_.begin();
+      while (it != planningQueue_.end())
+      {
+        if (it->first == session)
+        {
+          planningRequests_.erase(*it);
+          it = planningQueue_.erase(it);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+
+    {
+      boost::mutex::scoped_lock lock(policyMutex_);
+
+      if (policy_.get() != NULL)
+      {
+        policy_->CloseSession(session);
+      }
+    }
+
+    CancelPrefetch(session);
+  }
+
+
+  void CacheScheduler::Refresh(int bundle,
+                               const std::string& item)
+  {
+    // Make sure that a factory is associated with this bundle
+    GetBundleScheduler(bundle);
+
+    boost::mutex::scoped_lock lock(pendingMutex_);
+
+    PendingItems::iterator found = pending_.find(CacheIndex(bundle, item));
+    if (found != pending_.end())
+    {
+      if (found->second->IsQueued())
+      {
+        // The job has not started yet, so it will see the up-to-date
+        // data: Only make sure it is not skipped if the item is cached
+        found->second->SetRefresh();
+        return;
+      }
+      else
+      {
+        // The running job might be working on obsolete data: Its
+        // result is still given to the requests waiting for it, but
+        // it is not stored, and a new job takes its place
+        found->second->SignalInvalidated();
+        pending_.erase(found);
+      }
+    }
+
+    boost::shared_ptr<PendingItem> job(new PendingItem(bundle, item));
+    job->SetRefresh();
+    pending_.insert(std::make_pair(CacheIndex(bundle, item), job));
+    EnqueueJob(job, Priority_Prefetch);
+  }
+
+
+  void CacheScheduler::GetQueueStatistics(QueueStatistics& target,
+                                          Priority priority)
+  {
+    if (priority != Priority_Interactive &&
+        priority != Priority_Prefetch)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::mutex::scoped_lock lock(pendingMutex_);
+    target = statistics_[priority];
+    target.queueDepth = queues_[priority].size();
+  }
+
+
+  void CacheScheduler::GetAccessStatistics(AccessStatistics& target,
+                                           int bundle)
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+    target = GetAccessStatisticsInternal(bundle);
+  }
+
+
+  void CacheScheduler::GetBundleStatistics(CacheManager::BundleStatistics& target,
+                                           int bundle)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    cache_.GetBundleStatistics(target, bundle);
+  }
+
+
+  void CacheScheduler::RegisterPolicy(IPrefetchPolicy* policy)
+  {
+    // "SchedulePrefetchPolicy()" only locks "planningMutex_" to read
+    // the policy
+    boost::mutex::scoped_lock lock(planningMutex_);
+
+    {
+      boost::mutex::scoped_lock lock2(policyMutex_);
+      policy_.reset(policy);
+    }
+
+    if (planner_ == NULL)
+    {
+      planner_ = new boost::thread(Planner, this);
+    }
+  }
+
+
+  ICacheFactory& CacheScheduler::GetFactory(int bundle)
+  {
+    return GetBundleScheduler(bundle).GetFactory();
+  }
+
+
+  void CacheScheduler::SetProperty(CacheProperty property,
+                   const std::string& value)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    cache_.SetProperty(property, value);
+  }
+
+  
+  bool CacheScheduler::LookupProperty(std::string& target,
+                                      CacheProperty property)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    return cache_.LookupProperty(target, property);
+  }
+
+
+  void CacheScheduler::Clear()
+  {
+    memory_.Clear();
+
+    {
+      boost::mutex::scoped_lock lock(statisticsMutex_);
+      prefetched_.clear();
+    }
+
     boost::mutex::scoped_lock lock(cacheMutex_);
     return cache_.Clear();
   }
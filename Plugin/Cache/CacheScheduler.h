@@ -23,47 +23,241 @@
 
 #pragma once
 
+#include "CacheIndex.h"
 #include "CacheManager.h"
 #include "ICacheFactory.h"
 #include "IPrefetchPolicy.h"
+#include "MemoryCache.h"
 
 #include <Compatibility.h>  // For std::unique_ptr<>
-#include <MultiThreading/SharedMessageQueue.h>
 
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <list>
+#include <map>
+#include <set>
 #include <stdio.h>
+#include <vector>
 
 namespace OrthancPlugins
 {
   class CacheScheduler : public boost::noncopyable
   {
+  public:
+    /**
+     * Priority classes of the decoding pool. The interactive class
+     * corresponds to cache misses for which a user is waiting, and
+     * is always served before the speculative prefetching.
+     **/
+    enum Priority
+    {
+      Priority_Interactive = 0,
+      Priority_Prefetch = 1
+    };
+
+    struct QueueStatistics
+    {
+      size_t    queueDepth;
+      uint64_t  dequeuedCount;
+      uint64_t  totalWaitMicroseconds;
+      uint64_t  maxWaitMicroseconds;
+    };
+
+    // Counters of one bundle since the startup
+    struct AccessStatistics
+    {
+      uint64_t  memoryHits;
+      uint64_t  diskHits;
+      uint64_t  misses;
+      uint64_t  prefetchedCount;    // Items generated by the prefetching
+      uint64_t  prefetchUsed;       // Prefetched items that were accessed afterwards
+      uint64_t  prefetchWasted;     // Prefetched items that were evicted or invalidated before any access
+      uint64_t  prefetchCancelled;  // Queued prefetchings that were cancelled or dropped
+    };
+
+    // Where the time of one access went
+    struct AccessTimings
+    {
+      uint64_t  lookupMicroseconds;  // Memory cache, then SQLite/filesystem cache
+      uint64_t  waitMicroseconds;    // Generation by the decoding pool, including the queue
+      bool      isGenerated;         // Whether the item was missing from the cache
+    };
+
+    class IBatchVisitor : public boost::noncopyable
+    {
+    public:
+      virtual ~IBatchVisitor()
+      {
+      }
+
+      // "success" is "false" if the item cannot be generated
+      virtual void Visit(size_t index,
+                         const std::string& item,
+                         bool success,
+                         const std::string& content) = 0;
+    };
+
   private:
-    class Prefetcher;
-    class PrefetchQueue;
     class BundleScheduler;
+    class PendingItem;
+
+    // An access whose prefetching remains to be planned
+    struct PlanningRequest
+    {
+      int          bundle_;
+      std::string  item_;
+      std::string  content_;
+      std::string  session_;
+    };
+
+    // The accesses of one session to one bundle share the same key,
+    // so that only the most recent of them is planned
+    typedef std::pair<std::string, CacheIndex>  PlanningKey;
 
     typedef std::map<int, BundleScheduler*>  BundleSchedulers;
+    typedef std::map<CacheIndex, boost::shared_ptr<PendingItem> >  PendingItems;
+    typedef std::list<boost::shared_ptr<PendingItem> >  Queue;
+    typedef std::map<PlanningKey, PlanningRequest>  PlanningRequests;
+    typedef std::map<int, AccessStatistics>  AccessStatisticsMap;
 
     size_t                            maxPrefetchSize_;
+    unsigned int                      maxPrefetchAge_;  // In seconds, protected by "pendingMutex_"
     boost::mutex                      cacheMutex_;
     boost::mutex                      factoryMutex_;
-    boost::recursive_mutex            policyMutex_;
+    boost::mutex                      policyMutex_;
     CacheManager&                     cache_;
-    std::unique_ptr<IPrefetchPolicy>  policy_;
+    MemoryCache                       memory_;
+    std::unique_ptr<IPrefetchPolicy>  policy_;  // Modified while holding both "planningMutex_" and "policyMutex_"
     BundleSchedulers                  bundles_;
 
-    void ApplyPrefetchPolicy(int bundle,
-                             const std::string& item,
-                             const std::string& content);
+    // The pending items, the queues and their statistics are
+    // protected by "pendingMutex_"
+    boost::mutex                      pendingMutex_;
+    boost::condition_variable         jobAvailable_;
+    PendingItems                      pending_;
+    Queue                             queues_[2];
+    QueueStatistics                   statistics_[2];
+    bool                              done_;
+    uint64_t                          batchCount_;
+    std::vector<boost::thread*>       workers_;
+
+    // Background eviction, protected by "cacheMutex_"
+    boost::condition_variable         reclaimNeeded_;
+    boost::thread*                    reclaimer_;
+
+    // Background planning of the prefetching, protected by "planningMutex_"
+    boost::mutex                      planningMutex_;
+    boost::condition_variable         planningAvailable_;
+    std::list<PlanningKey>            planningQueue_;
+    PlanningRequests                  planningRequests_;
+    bool                              planningDone_;
+    boost::thread*                    planner_;
+
+    // The counters of the accesses and the prefetched items that were
+    // not accessed yet are protected by "statisticsMutex_", that must
+    // never be locked before another mutex
+    boost::mutex                      statisticsMutex_;
+    AccessStatisticsMap               accessStatistics_;
+    std::set<CacheIndex>              prefetched_;
+
+    static void Worker(CacheScheduler* that);
+
+    static void Reclaimer(CacheScheduler* that);
+
+    static void Planner(CacheScheduler* that);
+
+    void StoreInCache(int bundle,
+                      const std::string& item,
+                      const std::string& content);
+
+    // The methods below update the counters of the accesses
+    AccessStatistics& GetAccessStatisticsInternal(int bundle);
+
+    void RecordHit(int bundle,
+                   const std::string& item,
+                   bool isMemory);
+
+    void RecordMiss(int bundle);
+
+    void RecordPrefetched(int bundle,
+                          const std::string& item);
+
+    void RecordCancelledPrefetch(int bundle);
+
+    void RecordDiscarded(const CacheIndex& index);
+
+    // Gets the items that were evicted by the cache manager, to be
+    // called while holding "cacheMutex_"
+    void TrackEvictions();
+
+    void ApplyPrefetchPolicy(const PlanningRequest& request);
+
+    // Queues the planning of the prefetching that follows an access,
+    // which is done by the planner thread once the item is served
+    void SchedulePrefetchPolicy(int bundle,
+                                const std::string& item,
+                                const std::string& content,
+                                const std::string& session);
 
     BundleScheduler&  GetBundleScheduler(unsigned int bundleIndex);
 
+    void RemovePending(const PendingItem& job);
+
+    void EnqueueJob(const boost::shared_ptr<PendingItem>& job,
+                    Priority priority);
+
+    void UnqueueJob(const boost::shared_ptr<PendingItem>& job);
+
+    void PromoteJob(const boost::shared_ptr<PendingItem>& job);
+
+    boost::shared_ptr<PendingItem> DequeueJob(unsigned int msTimeout);
+
+    void ExecuteJob(PendingItem& job);
+
+    bool ReadFromCache(std::string& content,
+                       int bundle,
+                       const std::string& item);
+
+    // Queues the generation of an item, or shares the job that is
+    // already queued or running for it (and promotes it if it was
+    // only prefetched, and "priority" is interactive). "session" is
+    // the client that asks for the item, if any.
+    boost::shared_ptr<PendingItem> SubmitJob(int bundle,
+                                             const std::string& item,
+                                             Priority priority,
+                                             const std::string& session);
+
+    // "isUpToDate" is set to "false" if the job was invalidated while
+    // running, in which case its result must not be promoted into
+    // the memory cache. "priority" is used if the item must be
+    // generated again.
+    bool WaitJob(std::string& content,
+                 bool& isUpToDate,
+                 boost::shared_ptr<PendingItem> job,
+                 int bundle,
+                 const std::string& item,
+                 Priority priority,
+                 const std::string& session);
+
+    // Asks the decoding pool to generate the item with the
+    // interactive priority, and waits for the result. If the same
+    // item is already queued or being generated, its job is shared
+    // (and promoted if it was only prefetched). Consequently, the
+    // factories must never call "Access()" by themselves.
+    bool Generate(std::string& content,
+                  bool& isUpToDate,
+                  int bundle,
+                  const std::string& item,
+                  const std::string& session);
+
   public:
     CacheScheduler(CacheManager& cache,
                    unsigned int maxPrefetchSize);
 
     ~CacheScheduler();
 
+    // The "numThreads" threads are added to the decoding pool that
+    // is shared by all the bundles
     void Register(int bundle,
                   ICacheFactory* factory /* takes ownership */,
                   size_t  numThreads);
@@ -72,6 +266,22 @@ namespace OrthancPlugins
                   uint32_t maxCount,
                   uint64_t maxSpace);
 
+    void SetMemoryCacheSize(uint64_t maxSize);
+
+    // The prefetchings that wait for more than "seconds" in the queue
+    // are dropped (0 means no limit, the default)
+    void SetMaxPrefetchAge(unsigned int seconds);
+
+    // Starts a reclaimer thread that evicts the items in background
+    // once a bundle exceeds "high" percent of its quota, until "low"
+    // percent is reached. The files are then unlinked outside of the
+    // critical section. Without this call, the eviction and the
+    // removal of the files are done by the thread storing the items.
+    void SetEvictionWatermarks(unsigned int high,
+                               unsigned int low);
+
+    // The policy is applied by a background thread after each access,
+    // and only to the most recent access of each session
     void RegisterPolicy(IPrefetchPolicy* policy /* takes ownership */);
 
     void Invalidate(int bundle,
@@ -81,9 +291,111 @@ namespace OrthancPlugins
                 int bundle,
                 const std::string& item);
 
+    // Same as above, for an access by the client that is identified
+    // by "session", which is given to the prefetch policy
+    bool Access(std::string& content,
+                int bundle,
+                const std::string& item,
+                const std::string& session);
+
+    bool Access(std::string& content,
+                AccessTimings& timings,
+                int bundle,
+                const std::string& item,
+                const std::string& session);
+
+    /**
+     * Accesses a list of items of one bundle, and gives them to the
+     * visitor in their order, as soon as each of them is available.
+     * While an item is waited for with the interactive priority, the
+     * next missing items are generated ahead with the prefetch
+     * priority, within a window as large as the decoding pool, so
+     * that they are ready once the previous items are transmitted.
+     * The look-ahead is cancelled once the batch is over. The
+     * prefetch policy is not applied.
+     **/
+    void AccessBatch(IBatchVisitor& visitor,
+                     int bundle,
+                     const std::vector<std::string>& items);
+
+    // Stores an item that was generated outside of the factory call
+    // for this item (e.g. by a factory that decodes several items at
+    // once). The requests waiting for this item are answered at once.
+    void Store(int bundle,
+               const std::string& item,
+               const std::string& content);
+
+    /**
+     * Reads an item from the cache, or waits for its generation with
+     * the prefetch priority, for the background tasks that must not
+     * compete with the users. The item is not promoted into the
+     * memory cache, and neither the access statistics nor the
+     * prefetch policy are affected. Returns "false" if the item
+     * cannot be generated, or if its generation is dropped from the
+     * prefetch queue (because it is full, or because of aging).
+     **/
+    bool AccessInBackground(std::string& content,
+                            int bundle,
+                            const std::string& item);
+
+    // Reads an item from the cache, without generating it nor
+    // applying the prefetch policy
+    bool Lookup(std::string& content,
+                int bundle,
+                const std::string& item);
+
+    bool IsCached(int bundle,
+                  const std::string& item);
+
     void Prefetch(int bundle,
                   const std::string& item);
 
+    // The prefetchings that are tagged with a session can be
+    // cancelled by this session, as long as they are still queued
+    void Prefetch(int bundle,
+                  const std::string& item,
+                  const std::string& session);
+
+    // Returns the number of cancelled prefetchings
+    size_t CancelPrefetch(const std::string& session);
+
+    // To be called once a client has left: Its accesses that are not
+    // planned yet are forgotten, the prefetch policy is notified, and
+    // its prefetchings are cancelled
+    void CloseSession(const std::string& session);
+
+    // To be called by a factory: The session of the client on whose
+    // behalf the calling worker generates its item, or an empty
+    // string if it is shared by several clients, or anonymous. The
+    // prefetchings that a factory queues with this session are
+    // cancelled together with those of the client.
+    static std::string GetCurrentSession();
+
+    // To be called by a factory whose item is only valid for the
+    // requests that are waiting for it (e.g. because it was generated
+    // from incomplete data): The item is given to these requests, but
+    // it is not cached, and will be generated again on the next access
+    static void DiscardCurrentItem();
+
+    /**
+     * Regenerates an item in the background with the prefetch
+     * priority, even if it is already cached. Contrarily to
+     * "Invalidate()", the previous value keeps being served until it
+     * is replaced by the new one. A refresh is never dropped from the
+     * prefetch queue, nor cancelled.
+     **/
+    void Refresh(int bundle,
+                 const std::string& item);
+
+    void GetQueueStatistics(QueueStatistics& target,
+                            Priority priority);
+
+    void GetAccessStatistics(AccessStatistics& target,
+                             int bundle);
+
+    void GetBundleStatistics(CacheManager::BundleStatistics& target,
+                             int bundle);
+
     ICacheFactory& GetFactory(int bundle);
 
     void SetProperty(CacheProperty property,
@@ -0,0 +1,167 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DecodedFrameCache.h"
+
+#include <cassert>
+
+
+namespace OrthancPlugins
+{
+  void DecodedFrameCache::RemoveInternal(Index::iterator it)
+  {
+    assert(currentSize_ >= it->second->size_);
+    currentSize_ -= it->second->size_;
+
+    recency_.erase(it->second);
+    index_.erase(it);
+  }
+
+
+  void DecodedFrameCache::MakeRoom(uint64_t size)
+  {
+    // Evict the least recently used frames until "size" bytes fit
+    while (!recency_.empty() &&
+           currentSize_ + size > maxSize_)
+    {
+      Index::iterator it = index_.find(recency_.back().key_);
+      assert(it != index_.end());
+      RemoveInternal(it);
+    }
+  }
+
+
+  DecodedFrameCache::DecodedFrameCache(uint64_t maxSize) :
+    maxSize_(maxSize),
+    currentSize_(0)
+  {
+  }
+
+
+  void DecodedFrameCache::SetMaximumSize(uint64_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxSize_ = maxSize;
+    MakeRoom(0);
+  }
+
+
+  uint64_t DecodedFrameCache::GetMaximumSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return maxSize_;
+  }
+
+
+  uint64_t DecodedFrameCache::GetCurrentSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return currentSize_;
+  }
+
+
+  size_t DecodedFrameCache::GetFramesCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return index_.size();
+  }
+
+
+  boost::shared_ptr<DecodedFrameCache::IFrame> DecodedFrameCache::Lookup(const std::string& instanceId,
+                                                                         unsigned int frameIndex)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Index::iterator it = index_.find(Key(instanceId, frameIndex));
+    if (it == index_.end())
+    {
+      return boost::shared_ptr<IFrame>();
+    }
+
+    // Move the frame to the front of the LRU list
+    recency_.splice(recency_.begin(), recency_, it->second);
+
+    return it->second->frame_;
+  }
+
+
+  void DecodedFrameCache::Store(const std::string& instanceId,
+                                unsigned int frameIndex,
+                                const boost::shared_ptr<IFrame>& frame)
+  {
+    const uint64_t size = frame->GetMemorySize();
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const Key key(instanceId, frameIndex);
+
+    Index::iterator it = index_.find(key);
+    if (it != index_.end())
+    {
+      // Replace the previous frame
+      RemoveInternal(it);
+    }
+
+    if (size > maxSize_)
+    {
+      // Too large for this cache (or the cache is disabled)
+      return;
+    }
+
+    MakeRoom(size);
+
+    recency_.push_front(Item());
+    recency_.front().key_ = key;
+    recency_.front().frame_ = frame;
+    recency_.front().size_ = size;
+
+    index_[key] = recency_.begin();
+    currentSize_ += size;
+  }
+
+
+  void DecodedFrameCache::Invalidate(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Index::iterator it = index_.lower_bound(Key(instanceId, 0));
+    while (it != index_.end() &&
+           it->first.first == instanceId)
+    {
+      Index::iterator next = it;
+      ++next;
+      RemoveInternal(it);
+      it = next;
+    }
+  }
+
+
+  void DecodedFrameCache::Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    recency_.clear();
+    index_.clear();
+    currentSize_ = 0;
+  }
+}
@@ -0,0 +1,107 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <string>
+
+namespace OrthancPlugins
+{
+  /**
+   * Short-lived LRU cache of the decoded frames, that sits between
+   * the decoding of the DICOM instances and the encoders. All the
+   * compressions of one frame (e.g. "jpeg80", "jpeg95" and
+   * "deflate") are thus encoded from a single decoding. It is bounded
+   * by the total number of bytes of the frames it holds.
+   **/
+  class DecodedFrameCache : public boost::noncopyable
+  {
+  public:
+    class IFrame : public boost::noncopyable
+    {
+    public:
+      virtual ~IFrame()
+      {
+      }
+
+      // The number of bytes that are accounted for this frame
+      virtual uint64_t GetMemorySize() const = 0;
+    };
+
+  private:
+    typedef std::pair<std::string, unsigned int>  Key;  // Instance and frame index
+
+    struct Item
+    {
+      Key                         key_;
+      boost::shared_ptr<IFrame>  frame_;
+      uint64_t                    size_;
+    };
+
+    typedef std::list<Item>                   Recency;  // Most recent first
+    typedef std::map<Key, Recency::iterator>  Index;
+
+    boost::mutex  mutex_;
+    uint64_t      maxSize_;
+    uint64_t      currentSize_;
+    Recency       recency_;
+    Index         index_;
+
+    void RemoveInternal(Index::iterator it);
+
+    void MakeRoom(uint64_t size);
+
+  public:
+    explicit DecodedFrameCache(uint64_t maxSize);
+
+    // A maximum size of zero disables the cache
+    void SetMaximumSize(uint64_t maxSize);
+
+    uint64_t GetMaximumSize();
+
+    uint64_t GetCurrentSize();
+
+    size_t GetFramesCount();
+
+    // Returns an empty pointer if the frame is not cached. The frame
+    // stays valid even if it is evicted in the meantime.
+    boost::shared_ptr<IFrame> Lookup(const std::string& instanceId,
+                                     unsigned int frameIndex);
+
+    void Store(const std::string& instanceId,
+               unsigned int frameIndex,
+               const boost::shared_ptr<IFrame>& frame);
+
+    // Removes all the frames of one instance
+    void Invalidate(const std::string& instanceId);
+
+    void Clear();
+  };
+}
@@ -39,11 +39,24 @@ namespace OrthancPlugins
     {
     }
 
-    // Mutual exclusion is enforced when calling this method.
+    // Whether "Apply()" reads the content of the items of this bundle.
+    // If not, an empty content is given to "Apply()", which spares the
+    // copy of the payload. Can be called concurrently with "Apply()".
+    virtual bool IsContentNeeded(int bundle) const = 0;
+
+    // This method is called by a background thread of the scheduler
+    // once the item is served, and mutual exclusion is enforced.
     // "toPrefetch" must be listed from top-priority to low-priority.
+    // "session" identifies the client that accessed the item, or is
+    // empty if unknown.
     virtual void Apply(std::list<CacheIndex>& toPrefetch,
                        CacheScheduler& cache,
                        const CacheIndex& index,
-                       const std::string& content) = 0;
+                       const std::string& content,
+                       const std::string& session) = 0;
+
+    // Called once the client has left, with the same mutual exclusion
+    // as "Apply()", so that its state can be released
+    virtual void CloseSession(const std::string& session) = 0;
   };
 }
@@ -0,0 +1,218 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MemoryCache.h"
+
+#include <boost/functional/hash.hpp>
+#include <cassert>
+
+static const size_t GENERATIONS_COUNT = 4096;
+
+
+namespace OrthancPlugins
+{
+  size_t MemoryCache::GetGenerationSlot(const Key& key)
+  {
+    size_t seed = 0;
+    boost::hash_combine(seed, key.first);
+    boost::hash_combine(seed, key.second);
+    return seed % GENERATIONS_COUNT;
+  }
+
+
+  void MemoryCache::RemoveInternal(Index::iterator it)
+  {
+    assert(currentSize_ >= it->second->content_.size());
+    currentSize_ -= it->second->content_.size();
+
+    recency_.erase(it->second);
+    index_.erase(it);
+  }
+
+
+  void MemoryCache::MakeRoom(uint64_t size)
+  {
+    // Evict the least recently used items until "size" bytes fit
+    while (!recency_.empty() &&
+           currentSize_ + size > maxSize_)
+    {
+      Index::iterator it = index_.find(recency_.back().key_);
+      assert(it != index_.end());
+      RemoveInternal(it);
+    }
+  }
+
+
+  MemoryCache::MemoryCache(uint64_t maxSize) :
+    maxSize_(maxSize),
+    currentSize_(0),
+    generations_(GENERATIONS_COUNT, 0)
+  {
+  }
+
+
+  void MemoryCache::SetMaximumSize(uint64_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxSize_ = maxSize;
+    MakeRoom(0);
+  }
+
+
+  uint64_t MemoryCache::GetMaximumSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return maxSize_;
+  }
+
+
+  uint64_t MemoryCache::GetCurrentSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return currentSize_;
+  }
+
+
+  size_t MemoryCache::GetItemsCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return index_.size();
+  }
+
+
+  bool MemoryCache::Access(std::string& content,
+                           int bundle,
+                           const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Index::iterator it = index_.find(Key(bundle, item));
+    if (it == index_.end())
+    {
+      return false;
+    }
+
+    // Move the item to the front of the LRU list
+    recency_.splice(recency_.begin(), recency_, it->second);
+
+    content = it->second->content_;
+    return true;
+  }
+
+
+  void MemoryCache::StoreInternal(const Key& key,
+                                  const std::string& content)
+  {
+    Index::iterator it = index_.find(key);
+    if (it != index_.end())
+    {
+      // Replace the previous value
+      RemoveInternal(it);
+    }
+
+    if (content.size() > maxSize_)
+    {
+      // Too large for the memory cache (or the memory cache is
+      // disabled), the item will be served by the persistent cache
+      return;
+    }
+
+    MakeRoom(content.size());
+
+    recency_.push_front(Item());
+    recency_.front().key_ = key;
+    recency_.front().content_ = content;
+
+    index_[key] = recency_.begin();
+    currentSize_ += content.size();
+  }
+
+
+  void MemoryCache::Store(int bundle,
+                          const std::string& item,
+                          const std::string& content)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    StoreInternal(Key(bundle, item), content);
+  }
+
+
+  uint64_t MemoryCache::GetGeneration(int bundle,
+                                      const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return generations_[GetGenerationSlot(Key(bundle, item))];
+  }
+
+
+  bool MemoryCache::Store(int bundle,
+                          const std::string& item,
+                          const std::string& content,
+                          uint64_t generation)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const Key key(bundle, item);
+
+    if (generations_[GetGenerationSlot(key)] != generation)
+    {
+      // The item was invalidated since it was read, "content" might
+      // be obsolete
+      return false;
+    }
+
+    StoreInternal(key, content);
+    return true;
+  }
+
+
+  void MemoryCache::Invalidate(int bundle,
+                               const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const Key key(bundle, item);
+    generations_[GetGenerationSlot(key)]++;
+
+    Index::iterator it = index_.find(key);
+    if (it != index_.end())
+    {
+      RemoveInternal(it);
+    }
+  }
+
+
+  void MemoryCache::Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    recency_.clear();
+    index_.clear();
+    currentSize_ = 0;
+
+    for (size_t i = 0; i < generations_.size(); i++)
+    {
+      generations_[i]++;
+    }
+  }
+}
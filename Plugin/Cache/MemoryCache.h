@@ -0,0 +1,119 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * In-memory LRU tier that is put in front of the persistent
+   * "CacheManager". It is bounded by the total number of bytes of the
+   * payloads it holds, and is protected by its own mutex, so that
+   * hits can be answered without touching SQLite or the filesystem.
+   *
+   * Each item has a generation counter that is incremented whenever
+   * it is invalidated. A thread that has read an item from the
+   * persistent cache (or has generated it) only promotes it into the
+   * memory cache if its generation has not changed in the meantime,
+   * so that an obsolete value cannot survive its invalidation. The
+   * counters are shared between the items whose keys have the same
+   * hash, which bounds their memory at the price of a few spurious
+   * refusals to promote.
+   **/
+  class MemoryCache : public boost::noncopyable
+  {
+  private:
+    typedef std::pair<int, std::string>  Key;
+
+    struct Item
+    {
+      Key          key_;
+      std::string  content_;
+    };
+
+    typedef std::list<Item>                          Recency;  // Most recent first
+    typedef std::map<Key, Recency::iterator>  Index;
+
+    boost::mutex           mutex_;
+    uint64_t               maxSize_;
+    uint64_t               currentSize_;
+    Recency                recency_;
+    Index                  index_;
+    std::vector<uint64_t>  generations_;
+
+    static size_t GetGenerationSlot(const Key& key);
+
+    void RemoveInternal(Index::iterator it);
+
+    void MakeRoom(uint64_t size);
+
+    void StoreInternal(const Key& key,
+                       const std::string& content);
+
+  public:
+    explicit MemoryCache(uint64_t maxSize);
+
+    // A maximum size of zero disables the memory cache
+    void SetMaximumSize(uint64_t maxSize);
+
+    uint64_t GetMaximumSize();
+
+    uint64_t GetCurrentSize();
+
+    size_t GetItemsCount();
+
+    bool Access(std::string& content,
+                int bundle,
+                const std::string& item);
+
+    void Store(int bundle,
+               const std::string& item,
+               const std::string& content);
+
+    // To be read before accessing the persistent cache, then given
+    // to the "Store()" method below
+    uint64_t GetGeneration(int bundle,
+                           const std::string& item);
+
+    // Only stores the item if it was not invalidated since
+    // "generation" was read, and returns whether it was stored
+    bool Store(int bundle,
+               const std::string& item,
+               const std::string& content,
+               uint64_t generation);
+
+    void Invalidate(int bundle,
+                    const std::string& item);
+
+    void Clear();
+  };
+}
@@ -0,0 +1,267 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "CachePrewarmer.h"
+
+#include "ViewerToolbox.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+#include <algorithm>
+#include <cassert>
+
+
+static const char* const PREWARM_COMPRESSION = "jpeg95-";
+static const char* const PREWARM_PREVIEW_COMPRESSION = "preview256-";
+static const size_t PREWARM_CHUNK_SIZE = 10;
+static const size_t PREWARM_MAX_QUEUE_DEPTH = 10;
+
+
+namespace OrthancPlugins
+{
+  unsigned int PrewarmBudget::Reserve(unsigned int count,
+                                      const boost::posix_time::ptime& now)
+  {
+    if (maxFramesPerHour_ == 0)
+    {
+      return count;
+    }
+
+    if (hourStart_.is_not_a_date_time() ||
+        now < hourStart_ ||
+        now - hourStart_ >= boost::posix_time::hours(1))
+    {
+      hourStart_ = now;
+      usedFrames_ = 0;
+    }
+
+    assert(usedFrames_ <= maxFramesPerHour_);
+    const unsigned int granted = std::min(count, maxFramesPerHour_ - usedFrames_);
+    usedFrames_ += granted;
+
+    return granted;
+  }
+
+
+  class CachePrewarmer::StableResource : public Orthanc::IDynamicObject
+  {
+  private:
+    OrthancPluginResourceType  type_;
+    std::string                id_;
+
+  public:
+    StableResource(OrthancPluginResourceType type,
+                   const std::string& id) :
+      type_(type),
+      id_(id)
+    {
+    }
+
+    OrthancPluginResourceType GetType() const
+    {
+      return type_;
+    }
+
+    const std::string& GetId() const
+    {
+      return id_;
+    }
+  };
+
+
+  void CachePrewarmer::PrefetchFrames()
+  {
+    CacheScheduler::QueueStatistics statistics;
+    scheduler_.GetQueueStatistics(statistics, CacheScheduler::Priority_Prefetch);
+
+    if (statistics.queueDepth >= PREWARM_MAX_QUEUE_DEPTH)
+    {
+      // The decoding pool is busy with the prefetching of the users
+      return;
+    }
+
+    const size_t count = std::min(frames_.size(), PREWARM_CHUNK_SIZE);
+
+    // The prefetch queue is LIFO: Queue the chunk in reverse order,
+    // so that its frames are decoded in the order of the series
+    for (size_t i = count; i > 0; i--)
+    {
+      scheduler_.Prefetch(frames_[i - 1].GetBundle(), frames_[i - 1].GetItem());
+    }
+
+    frames_.erase(frames_.begin(), frames_.begin() + count);
+  }
+
+
+  void CachePrewarmer::WarmSeries(const std::string& seriesId)
+  {
+    if (scheduler_.IsCached(CacheBundle_SeriesInformation, seriesId))
+    {
+      // This series was already opened by a user, or warmed up
+      return;
+    }
+
+    // The series information is generated with the prefetch priority,
+    // and without applying the prefetch policy of the viewers
+    std::string content;
+    Json::Value series;
+    if (!scheduler_.AccessInBackground(content, CacheBundle_SeriesInformation, seriesId) ||
+        !Orthanc::Toolbox::ReadJson(series, content) ||
+        !series.isMember("Slices") ||
+        series["Slices"].type() != Json::arrayValue)
+    {
+      return;
+    }
+
+    const Json::Value& slices = series["Slices"];
+
+    unsigned int count = slices.size();
+    if (maxFramesPerSeries_ != 0 &&
+        count > maxFramesPerSeries_)
+    {
+      count = maxFramesPerSeries_;
+    }
+
+    // Each slice has a low-resolution preview and a full-resolution
+    // image, which are both counted in the budget. As in the viewer,
+    // the previews come first.
+    const unsigned int granted = budget_.Reserve(2 * count, boost::posix_time::microsec_clock::universal_time());
+    if (granted < 2 * count)
+    {
+      LOG(WARNING) << "The hourly budget for warming up the cache of the Web viewer is exhausted, "
+                   << "only " << granted << " out of " << 2 * count << " images of series "
+                   << seriesId << " are warmed up";
+    }
+    else
+    {
+      LOG(INFO) << "Warming up the cache of the Web viewer with " << 2 * count
+                << " images of series " << seriesId;
+    }
+
+    const unsigned int previews = std::min(granted, count);
+
+    for (unsigned int i = 0; i < previews; i++)
+    {
+      frames_.push_back(CacheIndex(CacheBundle_PreviewImage, PREWARM_PREVIEW_COMPRESSION + slices[i].asString()));
+    }
+
+    for (unsigned int i = 0; i < granted - previews; i++)
+    {
+      frames_.push_back(CacheIndex(CacheBundle_DecodedImage, PREWARM_COMPRESSION + slices[i].asString()));
+    }
+  }
+
+
+  void CachePrewarmer::WarmStudy(const std::string& studyId)
+  {
+    Json::Value study;
+    if (!GetJsonFromOrthanc(study, context_, "/studies/" + studyId) ||
+        !study.isMember("Series") ||
+        study["Series"].type() != Json::arrayValue)
+    {
+      return;
+    }
+
+    for (Json::Value::ArrayIndex i = 0; i < study["Series"].size(); i++)
+    {
+      WarmSeries(study["Series"][i].asString());
+    }
+  }
+
+
+  void CachePrewarmer::Worker(CachePrewarmer* that)
+  {
+    while (!that->done_)
+    {
+      try
+      {
+        if (!that->frames_.empty())
+        {
+          that->PrefetchFrames();
+        }
+
+        std::unique_ptr<Orthanc::IDynamicObject> obj(that->queue_.Dequeue(100));
+        if (obj.get() != NULL)
+        {
+          const StableResource& resource = dynamic_cast<const StableResource&>(*obj);
+
+          if (resource.GetType() == OrthancPluginResourceType_Study)
+          {
+            that->WarmStudy(resource.GetId());
+          }
+          else
+          {
+            that->WarmSeries(resource.GetId());
+          }
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot warm up the cache of the Web viewer: " << e.What();
+      }
+      catch (std::runtime_error& e)
+      {
+        LOG(ERROR) << "Cannot warm up the cache of the Web viewer: " << e.what();
+      }
+    }
+  }
+
+
+  CachePrewarmer::CachePrewarmer(OrthancPluginContext* context,
+                                 CacheScheduler& scheduler,
+                                 unsigned int maxFramesPerSeries,
+                                 unsigned int maxFramesPerHour) :
+    context_(context),
+    scheduler_(scheduler),
+    maxFramesPerSeries_(maxFramesPerSeries),
+    budget_(maxFramesPerHour),
+    done_(false)
+  {
+    thread_ = boost::thread(Worker, this);
+  }
+
+
+  CachePrewarmer::~CachePrewarmer()
+  {
+    done_ = true;
+    if (thread_.joinable())
+    {
+      thread_.join();
+    }
+  }
+
+
+  void CachePrewarmer::SignalStableSeries(const std::string& seriesId)
+  {
+    queue_.Enqueue(new StableResource(OrthancPluginResourceType_Series, seriesId));
+  }
+
+
+  void CachePrewarmer::SignalStableStudy(const std::string& studyId)
+  {
+    queue_.Enqueue(new StableResource(OrthancPluginResourceType_Study, studyId));
+  }
+}
@@ -0,0 +1,110 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "Cache/CacheScheduler.h"
+
+#include <MultiThreading/SharedMessageQueue.h>
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <deque>
+
+namespace OrthancPlugins
+{
+  /**
+   * Limits the number of images (full-resolution images and previews)
+   * that are warmed up within one hour, so that a large transfer
+   * (e.g. the migration of an archive) does not flush the cache, nor
+   * keeps the decoding pool busy for hours.
+   **/
+  class PrewarmBudget : public boost::noncopyable
+  {
+  private:
+    unsigned int              maxFramesPerHour_;  // 0 means no limit
+    boost::posix_time::ptime  hourStart_;
+    unsigned int              usedFrames_;
+
+  public:
+    explicit PrewarmBudget(unsigned int maxFramesPerHour) :
+      maxFramesPerHour_(maxFramesPerHour),
+      usedFrames_(0)
+    {
+    }
+
+    // Returns how many of the "count" frames can be warmed up
+    unsigned int Reserve(unsigned int count,
+                         const boost::posix_time::ptime& now);
+  };
+
+
+  /**
+   * Warms the cache up with the series that have become stable, so
+   * that a study that was received overnight is instantly displayed.
+   * The frames are given to the prefetch queue of the decoding pool
+   * by small chunks, and only if this queue is almost empty, so that
+   * the prefetching of the users always comes first.
+   **/
+  class CachePrewarmer : public boost::noncopyable
+  {
+  private:
+    class StableResource;
+
+    OrthancPluginContext*        context_;
+    CacheScheduler&              scheduler_;
+    unsigned int                 maxFramesPerSeries_;  // 0 means all the frames
+    PrewarmBudget                budget_;
+    Orthanc::SharedMessageQueue  queue_;
+    bool                         done_;
+    boost::thread                thread_;
+
+    // The images that remain to be prefetched, only accessed by the
+    // thread of the prewarmer
+    std::deque<CacheIndex>       frames_;
+
+    static void Worker(CachePrewarmer* that);
+
+    void PrefetchFrames();
+
+    void WarmSeries(const std::string& seriesId);
+
+    void WarmStudy(const std::string& studyId);
+
+  public:
+    CachePrewarmer(OrthancPluginContext* context,
+                   CacheScheduler& scheduler,
+                   unsigned int maxFramesPerSeries,
+                   unsigned int maxFramesPerHour);
+
+    ~CachePrewarmer();
+
+    void SignalStableSeries(const std::string& seriesId);
+
+    void SignalStableStudy(const std::string& studyId);
+  };
+}
@@ -23,17 +23,44 @@
 
 #include "DecodedImageAdapter.h"
 
+#include "DecodingMetrics.h"
+#include "ImageKernels.h"
+#include "SeriesInformationAdapter.h"
+#include "SeriesStatistics.h"
 #include "ViewerToolbox.h"
 
+#include <DicomFormat/DicomInstanceHasher.h>
 #include <Images/ImageBuffer.h>
 #include <Images/ImageProcessing.h>
 #include <Logging.h>
 #include <OrthancException.h>
 #include <Toolbox.h>
 
+#include <algorithm>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/regex.hpp>
+#include <string.h>
+
+
+static const unsigned int MIN_PREVIEW_SIZE = 32;
+static const unsigned int MAX_PREVIEW_SIZE = 2048;
+static const uint8_t PREVIEW_QUALITY = 80;
+
+// Ensures that the accumulators of the box downscaling cannot overflow
+static const unsigned int MAX_DOWNSCALING_FACTOR = 256;
+
+static const unsigned int TILE_SIZE = 512;
+static const uint8_t TILE_QUALITY = 90;
+
+// Maximum number of neighbouring tiles that are prefetched once a
+// tile is requested, so that panning a huge frame cannot flood the
+// prefetch queue
+static const unsigned int MAX_PREFETCHED_TILES = 64;
+
+// Number of slices, evenly spaced, whose pixels are used to compute
+// the statistics of a series
+static const unsigned int SERIES_STATISTICS_SAMPLES = 5;
 
 
 namespace OrthancPlugins
@@ -42,167 +69,1634 @@ namespace OrthancPlugins
                            const Json::Value& tags,
                            const std::string& tag)
   {
-    if (tags.type() == Json::objectValue &&
-        tags.isMember(tag) &&
-        tags[tag].type() == Json::objectValue &&
-        tags[tag].isMember("Type") &&
-        tags[tag].isMember("Value") &&
-        tags[tag]["Type"].type() == Json::stringValue &&
-        tags[tag]["Value"].type() == Json::stringValue &&
-        tags[tag]["Type"].asString() == "String")
+    if (tags.type() == Json::objectValue &&
+        tags.isMember(tag) &&
+        tags[tag].type() == Json::objectValue &&
+        tags[tag].isMember("Type") &&
+        tags[tag].isMember("Value") &&
+        tags[tag]["Type"].type() == Json::stringValue &&
+        tags[tag]["Value"].type() == Json::stringValue &&
+        tags[tag]["Type"].asString() == "String")
+    {
+      value = tags[tag]["Value"].asString();
+      return true;
+    }        
+    else
+    {
+      return false;
+    }
+  }
+                                 
+
+  static float GetFloatTag(const Json::Value& tags,
+                           const std::string& tag,
+                           float defaultValue)
+  {
+    std::string tmp;
+    if (GetStringTag(tmp, tags, tag))
+    {
+      try
+      {
+        return boost::lexical_cast<float>(Orthanc::Toolbox::StripSpaces(tmp));
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+      }
+    }
+
+    return defaultValue;
+  }
+                                 
+
+  bool DecodedImageAdapter::ParseUri(CompressionType& type,
+                                     uint8_t& compressionLevel,
+                                     unsigned int& previewSize,
+                                     std::string& instanceId,
+                                     unsigned int& frameIndex,
+                                     const std::string& uri)
+  {
+    boost::regex pattern("^([a-z0-9]+)-([a-z0-9-]+)_([0-9]+)$");
+
+    boost::cmatch what;
+    if (!regex_match(uri.c_str(), what, pattern))
+    {
+      return false;
+    }
+
+    std::string compression(what[1]);
+    instanceId = what[2];
+
+    // The URI comes from the client: A malformed number (such as an
+    // overflowing frame index, or a missing level) is a plain 404
+    try
+    {
+      frameIndex = boost::lexical_cast<unsigned int>(what[3]);
+
+      if (compression == "deflate")
+      {
+        type = CompressionType_Deflate;
+      }
+      else if (compression == "delta")
+      {
+        type = CompressionType_Delta;
+      }
+      else if (boost::starts_with(compression, "jpeg"))
+      {
+        type = CompressionType_Jpeg;
+        int level = boost::lexical_cast<int>(compression.substr(4));
+        if (level <= 0 || level > 100)
+        {
+          return false;
+        }
+
+        compressionLevel = static_cast<uint8_t>(level);
+      }
+      else if (boost::starts_with(compression, "preview"))
+      {
+        // Downscaled JPEG image, whose long edge has at most "previewSize" pixels
+        type = CompressionType_Preview;
+        compressionLevel = PREVIEW_QUALITY;
+        previewSize = boost::lexical_cast<unsigned int>(compression.substr(7));
+        if (previewSize < MIN_PREVIEW_SIZE ||
+            previewSize > MAX_PREVIEW_SIZE)
+        {
+          return false;
+        }
+      }
+      else
+      {
+        return false;
+      }
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      return false;
+    }
+
+    return true;
+  }
+
+
+  bool DecodedImageAdapter::ParseTileUri(unsigned int& level,
+                                         unsigned int& tileX,
+                                         unsigned int& tileY,
+                                         std::string& instanceId,
+                                         unsigned int& frameIndex,
+                                         const std::string& uri)
+  {
+    boost::regex pattern("^([0-9]+)/([0-9]+)/([0-9]+)/([a-z0-9-]+)_([0-9]+)$");
+
+    boost::cmatch what;
+    if (!regex_match(uri.c_str(), what, pattern))
+    {
+      return false;
+    }
+
+    try
+    {
+      level = boost::lexical_cast<unsigned int>(what[1]);
+      tileX = boost::lexical_cast<unsigned int>(what[2]);
+      tileY = boost::lexical_cast<unsigned int>(what[3]);
+      frameIndex = boost::lexical_cast<unsigned int>(what[5]);
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      // Overflowing number in the URI
+      return false;
+    }
+
+    instanceId = what[4];
+    return true;
+  }
+
+
+  unsigned int DecodedImageAdapter::GetTileLevelsCount(unsigned int width,
+                                                       unsigned int height)
+  {
+    const unsigned int longEdge = std::max(width, height);
+
+    unsigned int level = 0;
+    while ((longEdge >> level) > TILE_SIZE &&
+           (2u << level) <= MAX_DOWNSCALING_FACTOR)
+    {
+      level++;
+    }
+
+    return level + 1;
+  }
+
+
+  void DecodedImageAdapter::WriteBinaryImage(std::string& target,
+                                             const Json::Value& metadata,
+                                             const std::string& pixelData)
+  {
+    std::string json;
+    Orthanc::Toolbox::WriteFastJson(json, metadata);
+
+    const uint32_t size = static_cast<uint32_t>(json.size());
+
+    target.resize(4 + json.size() + pixelData.size());
+    target[0] = static_cast<char>(size & 0xff);
+    target[1] = static_cast<char>((size >> 8) & 0xff);
+    target[2] = static_cast<char>((size >> 16) & 0xff);
+    target[3] = static_cast<char>((size >> 24) & 0xff);
+
+    if (!json.empty())
+    {
+      memcpy(&target[4], json.c_str(), json.size());
+    }
+
+    if (!pixelData.empty())
+    {
+      memcpy(&target[4 + json.size()], pixelData.c_str(), pixelData.size());
+    }
+  }
+
+
+  void DecodedImageAdapter::ConvertBinaryImageToJson(std::string& target,
+                                                     const std::string& binary)
+  {
+    DecodingStageTimer timer(DecodingStage_Json);
+
+    if (binary.size() < 4)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+
+    const uint8_t* header = reinterpret_cast<const uint8_t*>(binary.c_str());
+    const size_t size = (static_cast<size_t>(header[0]) |
+                         (static_cast<size_t>(header[1]) << 8) |
+                         (static_cast<size_t>(header[2]) << 16) |
+                         (static_cast<size_t>(header[3]) << 24));
+
+    Json::Value json;
+    if (binary.size() < 4 + size ||
+        !Orthanc::Toolbox::ReadJson(json, binary.c_str() + 4, size))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+
+    std::string base64;
+    Orthanc::Toolbox::EncodeBase64(base64, binary.substr(4 + size));
+    json["Orthanc"]["PixelData"] = base64;
+
+    Orthanc::Toolbox::WriteFastJson(target, json);
+  }
+
+
+  class DecodedImageAdapter::InstanceLoader : public boost::noncopyable
+  {
+  private:
+    OrthancPluginContext*           context_;
+#if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 12, 1)
+    std::unique_ptr<DicomInstance>  instance_;
+#else
+    MemoryBuffer                    dicom_;
+#endif
+    boost::shared_ptr<Json::Value>  tags_;
+    unsigned int                    framesCount_;
+
+  public:
+    InstanceLoader(OrthancPluginContext* context,
+                   const std::string& instanceId) :
+      context_(context),
+      tags_(new Json::Value),
+      framesCount_(1)
+    {
+#if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 12, 1)
+      /**
+       * The DICOM instance is parsed once by the Orthanc core, that
+       * provides both its tags and its decoded frames. This avoids
+       * copying the whole DICOM file into the memory of the plugin,
+       * and a second parsing of the file to get its tags.
+       **/
+      instance_.reset(DicomInstance::Load(instanceId, OrthancPluginLoadDicomInstanceMode_WholeDicom));
+      instance_->GetJson(*tags_);
+      framesCount_ = instance_->GetFramesCount();
+#else
+      // The frames are decoded directly from the buffer that was
+      // allocated by the Orthanc core, without copying it
+      if (!dicom_.RestApiGet("/instances/" + instanceId + "/file", false) ||
+          !GetJsonFromOrthanc(*tags_, context_, "/instances/" + instanceId + "/tags"))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+      }
+
+      std::string numberOfFrames;
+      if (GetStringTag(numberOfFrames, *tags_, "0028,0008"))
+      {
+        try
+        {
+          framesCount_ = boost::lexical_cast<unsigned int>(Orthanc::Toolbox::StripSpaces(numberOfFrames));
+        }
+        catch (boost::bad_lexical_cast&)
+        {
+        }
+      }
+#endif
+
+      if (framesCount_ == 0)
+      {
+        framesCount_ = 1;
+      }
+    }
+
+    // The tags are in the same format as "/instances/.../tags", and
+    // are shared by all the decoded frames of the instance
+    const boost::shared_ptr<Json::Value>& GetTags() const
+    {
+      return tags_;
+    }
+
+    unsigned int GetFramesCount() const
+    {
+      return framesCount_;
+    }
+
+    OrthancImage* DecodeFrame(unsigned int frameIndex)
+    {
+      if (frameIndex >= framesCount_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+#if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 12, 1)
+      return instance_->GetDecodedFrame(frameIndex);
+#else
+      return new OrthancImage(OrthancPluginDecodeDicomImage(
+                                context_, dicom_.GetData(), dicom_.GetSize(), frameIndex));
+#endif
+    }
+  };
+
+
+  // Prevents two threads from decoding the same instance at once
+  class DecodedImageAdapter::BatchLock : public boost::noncopyable
+  {
+  private:
+    DecodedImageAdapter&  that_;
+    std::string           instanceId_;
+    bool                  hasWaited_;
+    bool                  isOwner_;
+
+    void Acquire(const unsigned int* frameIndex)
+    {
+      boost::mutex::scoped_lock lock(that_.batchMutex_);
+
+      while (that_.batches_.find(instanceId_) != that_.batches_.end())
+      {
+        hasWaited_ = true;
+
+        if (frameIndex != NULL &&
+            that_.frames_.Lookup(instanceId_, *frameIndex).get() != NULL)
+        {
+          // The frame was decoded by the thread holding the instance,
+          // no need to wait until it has decoded all the frames
+          return;
+        }
+
+        that_.batchFinished_.wait(lock);
+      }
+
+      that_.batches_.insert(instanceId_);
+      isOwner_ = true;
+    }
+
+  public:
+    BatchLock(DecodedImageAdapter& that,
+              const std::string& instanceId) :
+      that_(that),
+      instanceId_(instanceId),
+      hasWaited_(false),
+      isOwner_(false)
+    {
+      Acquire(NULL);
+    }
+
+    // Stops waiting as soon as the frame is in the cache of the
+    // decoded frames, in which case the instance is not locked
+    BatchLock(DecodedImageAdapter& that,
+              const std::string& instanceId,
+              unsigned int frameIndex) :
+      that_(that),
+      instanceId_(instanceId),
+      hasWaited_(false),
+      isOwner_(false)
+    {
+      Acquire(&frameIndex);
+    }
+
+    ~BatchLock()
+    {
+      if (isOwner_)
+      {
+        boost::mutex::scoped_lock lock(that_.batchMutex_);
+        that_.batches_.erase(instanceId_);
+        that_.batchFinished_.notify_all();
+      }
+    }
+
+    bool HasWaited() const
+    {
+      return hasWaited_;
+    }
+
+    bool IsOwner() const
+    {
+      return isOwner_;
+    }
+  };
+
+
+  static void ConvertRGB48ToRGB24(Orthanc::ImageAccessor& target,
+                                  const Orthanc::ImageAccessor& source)
+  {
+    if (source.GetWidth() != target.GetWidth() ||
+        source.GetHeight() != target.GetHeight())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+    }
+
+    const SimdLevel level = GetBestSimdLevel();
+    const unsigned int width = source.GetWidth();
+    const unsigned int height = source.GetHeight();
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      ConvertRGB48ToRGB24(reinterpret_cast<uint8_t*>(target.GetRow(y)),
+                          reinterpret_cast<const uint16_t*>(source.GetConstRow(y)),
+                          3 * width, level);
+    }
+  }
+
+
+  template <typename SourceType>
+  static void GetMinMaxValue(int64_t& minValue,
+                             int64_t& maxValue,
+                             const Orthanc::ImageAccessor& source)
+  {
+    const SimdLevel level = GetBestSimdLevel();
+    const unsigned int width = source.GetWidth();
+    const unsigned int height = source.GetHeight();
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      SourceType a, b;
+      GetMinMaxValue(a, b, reinterpret_cast<const SourceType*>(source.GetConstRow(y)), width, level);
+
+      if (y == 0 || a < minValue)
+      {
+        minValue = a;
+      }
+
+      if (y == 0 || b > maxValue)
+      {
+        maxValue = b;
+      }
+    }
+  }
+
+
+  // Computes the range of the pixel values of a grayscale image
+  static void GetPixelRange(int64_t& minValue,
+                            int64_t& maxValue,
+                            const Orthanc::ImageAccessor& source)
+  {
+    minValue = 0;
+    maxValue = 0;
+
+    if (source.GetWidth() == 0 ||
+        source.GetHeight() == 0)
+    {
+      return;
+    }
+
+    switch (source.GetFormat())
+    {
+      case Orthanc::PixelFormat_Grayscale16:
+        GetMinMaxValue<uint16_t>(minValue, maxValue, source);
+        break;
+
+      case Orthanc::PixelFormat_SignedGrayscale16:
+        GetMinMaxValue<int16_t>(minValue, maxValue, source);
+        break;
+
+      case Orthanc::PixelFormat_Grayscale8:
+        Orthanc::ImageProcessing::GetMinMaxIntegerValue(minValue, maxValue, source);
+        break;
+
+      default:
+        break;
+    }
+  }
+
+
+  template <typename SourceType>
+  static void StretchToGrayscale8(Orthanc::ImageAccessor& target,
+                                  const Orthanc::ImageAccessor& source,
+                                  int64_t low,
+                                  int64_t high)
+  {
+    if (source.GetWidth() != target.GetWidth() ||
+        source.GetHeight() != target.GetHeight())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+    }
+
+    const SimdLevel level = GetBestSimdLevel();
+    const unsigned int width = source.GetWidth();
+    const unsigned int height = source.GetHeight();
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      StretchToGrayscale8(reinterpret_cast<uint8_t*>(target.GetRow(y)),
+                          reinterpret_cast<const SourceType*>(source.GetConstRow(y)), width,
+                          static_cast<int32_t>(low), static_cast<int32_t>(high), level);
+    }
+  }
+
+
+  /**
+   * Writes the byte planes of the delta predictor (cf. the
+   * "EncodeDeltaPlanes()" kernel) for a 16-bit grayscale image. The
+   * first sample of each row is predicted by the first sample of the
+   * row above, and the other samples by their left neighbour.
+   **/
+  static void EncodeDeltaPlanes(std::string& target,
+                                const Orthanc::ImageAccessor& source)
+  {
+    const SimdLevel level = GetBestSimdLevel();
+    const unsigned int width = source.GetWidth();
+    const unsigned int height = source.GetHeight();
+    const size_t count = static_cast<size_t>(width) * static_cast<size_t>(height);
+
+    target.resize(2 * count);
+
+    if (count == 0)
+    {
+      return;
+    }
+
+    uint8_t* lowPlane = reinterpret_cast<uint8_t*>(&target[0]);
+    uint8_t* highPlane = lowPlane + count;
+
+    uint16_t previous = 0;
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      const uint16_t* row = reinterpret_cast<const uint16_t*>(source.GetConstRow(y));
+      EncodeDeltaPlanes(lowPlane + y * width, highPlane + y * width, row, width, previous, level);
+      previous = row[0];
+    }
+  }
+
+
+  static uint64_t DivideAndRound(uint64_t value,
+                                 uint64_t divisor)
+  {
+    return (value + divisor / 2) / divisor;
+  }
+
+
+  static int64_t DivideAndRound(int64_t value,
+                                int64_t divisor)
+  {
+    if (value >= 0)
+    {
+      return (value + divisor / 2) / divisor;
+    }
+    else
+    {
+      return -((-value + divisor / 2) / divisor);
+    }
+  }
+
+
+  template <typename PixelType, typename SumType, typename TotalType>
+  static void DownscaleBox(Orthanc::ImageAccessor& target,
+                           const Orthanc::ImageAccessor& source,
+                           unsigned int factor,
+                           unsigned int channels)
+  {
+    const SimdLevel level = GetBestSimdLevel();
+    const unsigned int width = target.GetWidth();
+    const unsigned int height = target.GetHeight();
+    const size_t count = static_cast<size_t>(width) * factor * channels;
+    const TotalType area = static_cast<TotalType>(factor) * static_cast<TotalType>(factor);
+
+    std::vector<SumType> sums(count);
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      std::fill(sums.begin(), sums.end(), 0);
+
+      // Vertical pass, that is vectorized
+      for (unsigned int k = 0; k < factor; k++)
+      {
+        AccumulateRow(&sums[0], reinterpret_cast<const PixelType*>(source.GetConstRow(y * factor + k)),
+                      count, level);
+      }
+
+      // Horizontal pass, on the accumulated rows
+      PixelType* q = reinterpret_cast<PixelType*>(target.GetRow(y));
+
+      for (unsigned int x = 0; x < width; x++)
+      {
+        for (unsigned int c = 0; c < channels; c++)
+        {
+          TotalType total = 0;
+          for (unsigned int k = 0; k < factor; k++)
+          {
+            total += sums[(x * factor + k) * channels + c];
+          }
+
+          *q = static_cast<PixelType>(DivideAndRound(total, area));
+          q++;
+        }
+      }
+    }
+  }
+
+
+  // Each pixel of "target" is the average of a square of "factor"
+  // by "factor" pixels of "source"
+  static bool DownscaleBox(Orthanc::ImageAccessor& target,
+                           const Orthanc::ImageAccessor& source,
+                           unsigned int factor)
+  {
+    if (factor > MAX_DOWNSCALING_FACTOR ||
+        target.GetFormat() != source.GetFormat() ||
+        target.GetWidth() * factor > source.GetWidth() ||
+        target.GetHeight() * factor > source.GetHeight())
+    {
+      return false;
+    }
+
+    switch (source.GetFormat())
+    {
+      case Orthanc::PixelFormat_Grayscale8:
+        DownscaleBox<uint8_t, uint32_t, uint64_t>(target, source, factor, 1);
+        return true;
+
+      case Orthanc::PixelFormat_RGB24:
+        DownscaleBox<uint8_t, uint32_t, uint64_t>(target, source, factor, 3);
+        return true;
+
+      case Orthanc::PixelFormat_Grayscale16:
+        DownscaleBox<uint16_t, uint32_t, uint64_t>(target, source, factor, 1);
+        return true;
+
+      case Orthanc::PixelFormat_RGB48:
+        DownscaleBox<uint16_t, uint32_t, uint64_t>(target, source, factor, 3);
+        return true;
+
+      case Orthanc::PixelFormat_SignedGrayscale16:
+        DownscaleBox<int16_t, int32_t, int64_t>(target, source, factor, 1);
+        return true;
+
+      default:
+        return false;
+    }
+  }
+
+
+  // Gives access to the image downscaled by "factor", that is only
+  // computed (into "buffer") if the factor is above 1
+  static bool GetDownscaledImage(std::unique_ptr<Orthanc::ImageBuffer>& buffer,
+                                 Orthanc::ImageAccessor& target,
+                                 const Orthanc::ImageAccessor& source,
+                                 unsigned int factor)
+  {
+    if (factor <= 1)
+    {
+      source.GetReadOnlyAccessor(target);
+      return true;
+    }
+    else
+    {
+      buffer.reset(new Orthanc::ImageBuffer(source.GetFormat(),
+                                            std::max(1u, source.GetWidth() / factor),
+                                            std::max(1u, source.GetHeight() / factor), false));
+      buffer->GetWriteableAccessor(target);
+      return DownscaleBox(target, source, factor);
+    }
+  }
+
+
+  // The physical size of the pixels grows with the downscaling
+  static void ScalePixelSpacing(Json::Value& json,
+                                unsigned int factor)
+  {
+    json["columnPixelSpacing"] = json["columnPixelSpacing"].asFloat() * static_cast<float>(factor);
+    json["rowPixelSpacing"] = json["rowPixelSpacing"].asFloat() * static_cast<float>(factor);
+  }
+
+
+  /**
+   * All the slices of the series are stretched to the range of the
+   * series, which gives a consistent brightness while scrolling. As
+   * this range is only computed on a sample of the slices, it is
+   * extended by the range of the frame, so that no value is ever
+   * clipped.
+   **/
+  static void ExtendToSeriesRange(int64_t& minValue,
+                                  int64_t& maxValue,
+                                  const Json::Value& statistics)
+  {
+    int64_t seriesMin, seriesMax;
+    if (SeriesStatistics::GetRange(seriesMin, seriesMax, statistics))
+    {
+      minValue = std::min(minValue, seriesMin);
+      maxValue = std::max(maxValue, seriesMax);
+    }
+  }
+
+
+  static void WriteImage(std::string& content,
+                         Json::Value& json,
+                         const std::string& pixelData,
+                         const Json::Value& tags)
+  {
+    std::string photometric;
+    if (GetStringTag(photometric, tags, "0028,0004"))
+    {
+      json["Orthanc"]["PhotometricInterpretation"] = photometric;
+    }
+
+    DecodedImageAdapter::WriteBinaryImage(content, json, pixelData);
+  }
+
+
+  class DecodedImageAdapter::DecodedFrame : public DecodedFrameCache::IFrame
+  {
+  private:
+    boost::shared_ptr<Json::Value>  tags_;
+    unsigned int                    framesCount_;
+    std::unique_ptr<OrthancImage>   image_;
+    Orthanc::ImageAccessor          accessor_;
+    int64_t                         minValue_;
+    int64_t                         maxValue_;
+
+  public:
+    DecodedFrame(const boost::shared_ptr<Json::Value>& tags,
+                 unsigned int framesCount,
+                 OrthancImage* image /* takes ownership */) :
+      tags_(tags),
+      framesCount_(framesCount),
+      image_(image)
+    {
+      accessor_.AssignReadOnly(OrthancPlugins::Convert(image_->GetPixelFormat()), image_->GetWidth(),
+                               image_->GetHeight(), image_->GetPitch(), image_->GetBuffer());
+
+      // The range of the pixel values is computed once, for both the
+      // metadata and the stretching of all the JPEG qualities
+      DecodingStageTimer timer(DecodingStage_MinMax);
+      GetPixelRange(minValue_, maxValue_, accessor_);
+    }
+
+    const Json::Value& GetTags() const
+    {
+      return *tags_;
+    }
+
+    unsigned int GetFramesCount() const
+    {
+      return framesCount_;
+    }
+
+    const Orthanc::ImageAccessor& GetAccessor() const
+    {
+      return accessor_;
+    }
+
+    int64_t GetMinValue() const
+    {
+      return minValue_;
+    }
+
+    int64_t GetMaxValue() const
+    {
+      return maxValue_;
+    }
+
+    virtual uint64_t GetMemorySize() const ORTHANC_OVERRIDE
+    {
+      return static_cast<uint64_t>(image_->GetPitch()) * static_cast<uint64_t>(image_->GetHeight());
+    }
+  };
+
+
+  boost::shared_ptr<DecodedImageAdapter::DecodedFrame>
+  DecodedImageAdapter::GetDecodedFrame(std::unique_ptr<InstanceLoader>& instance,
+                                       const std::string& instanceId,
+                                       unsigned int frameIndex)
+  {
+    boost::shared_ptr<DecodedFrameCache::IFrame> cached = frames_.Lookup(instanceId, frameIndex);
+    if (cached.get() != NULL)
+    {
+      return boost::static_pointer_cast<DecodedFrame>(cached);
+    }
+
+    if (instance.get() == NULL)
+    {
+      // The DICOM instance is only loaded if some frame is missing
+      DecodingStageTimer timer(DecodingStage_Fetch);
+      instance.reset(new InstanceLoader(context_, instanceId));
+    }
+
+    std::unique_ptr<OrthancImage> image;
+
+    {
+      DecodingStageTimer timer(DecodingStage_Decode);
+      image.reset(instance->DecodeFrame(frameIndex));
+    }
+
+    boost::shared_ptr<DecodedFrame> frame(
+      new DecodedFrame(instance->GetTags(), instance->GetFramesCount(), image.release()));
+    frames_.Store(instanceId, frameIndex, frame);
+    return frame;
+  }
+
+
+  bool DecodedImageAdapter::EncodeFrame(std::string& content,
+                                        const DecodedFrame& frame,
+                                        const Json::Value& statistics,
+                                        CompressionType type,
+                                        uint8_t level,
+                                        unsigned int previewSize)
+  {
+    bool ok = false;
+
+    const Json::Value& tags = frame.GetTags();
+    int64_t minValue = frame.GetMinValue();
+    int64_t maxValue = frame.GetMaxValue();
+
+    ExtendToSeriesRange(minValue, maxValue, statistics);
+
+    Json::Value json;
+    std::string pixelData;
+
+    if (type == CompressionType_Preview)
+    {
+      const Orthanc::ImageAccessor& source = frame.GetAccessor();
+      const unsigned int longEdge = std::max(source.GetWidth(), source.GetHeight());
+      const unsigned int factor = std::max(1u, (longEdge + previewSize - 1) / previewSize);
+
+      std::unique_ptr<Orthanc::ImageBuffer> buffer;
+      Orthanc::ImageAccessor preview;
+
+      if (!GetDownscaledImage(buffer, preview, source, factor))
+      {
+        return false;
+      }
+
+      if (GetCornerstoneMetadata(json, tags, preview, minValue, maxValue))
+      {
+        ScalePixelSpacing(json, factor);
+        json["Orthanc"]["PreviewScale"] = factor;
+
+        ok = EncodeUsingJpeg(json, pixelData, preview, level, minValue, maxValue);
+      }
+    }
+    else if (GetCornerstoneMetadata(json, tags, frame.GetAccessor(), minValue, maxValue))
+    {
+      if (type == CompressionType_Deflate)
+      {
+        ok = EncodeUsingDeflate(json, pixelData, frame.GetAccessor());
+      }
+      else if (type == CompressionType_Delta)
+      {
+        ok = EncodeUsingDelta(json, pixelData, frame.GetAccessor());
+      }
+      else if (type == CompressionType_Jpeg)
+      {
+        ok = EncodeUsingJpeg(json, pixelData, frame.GetAccessor(), level, minValue, maxValue);
+      }
+    }   
+
+    if (ok)
+    {
+      WriteImage(content, json, pixelData, tags);
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  bool DecodedImageAdapter::EncodeTile(std::string& content,
+                                       const Json::Value& tags,
+                                       const Orthanc::ImageAccessor& source,
+                                       unsigned int level,
+                                       unsigned int levelsCount,
+                                       unsigned int tileX,
+                                       unsigned int tileY,
+                                       int64_t minValue,
+                                       int64_t maxValue)
+  {
+    const unsigned int factor = 1u << level;
+    const unsigned int levelWidth = std::max(1u, source.GetWidth() / factor);
+    const unsigned int levelHeight = std::max(1u, source.GetHeight() / factor);
+
+    if (tileX >= (levelWidth + TILE_SIZE - 1) / TILE_SIZE ||
+        tileY >= (levelHeight + TILE_SIZE - 1) / TILE_SIZE)
+    {
+      return false;
+    }
+
+    const unsigned int x = tileX * TILE_SIZE;
+    const unsigned int y = tileY * TILE_SIZE;
+    const unsigned int width = std::min(TILE_SIZE, levelWidth - x);
+    const unsigned int height = std::min(TILE_SIZE, levelHeight - y);
+
+    if ((x + width) * factor > source.GetWidth() ||
+        (y + height) * factor > source.GetHeight())
+    {
+      // The frame is thinner than the downscaling factor
+      return false;
+    }
+
+    // Only the region of the frame that is covered by the tile is
+    // downscaled, so that each tile can be created independently
+    Orthanc::ImageAccessor region;
+    source.GetRegion(region, x * factor, y * factor, width * factor, height * factor);
+
+    std::unique_ptr<Orthanc::ImageBuffer> buffer;
+    Orthanc::ImageAccessor tile;
+    if (!GetDownscaledImage(buffer, tile, region, factor))
+    {
+      return false;
+    }
+
+    Json::Value json;
+    std::string pixelData;
+    if (!GetCornerstoneMetadata(json, tags, tile, minValue, maxValue) ||
+        !EncodeUsingJpeg(json, pixelData, tile, TILE_QUALITY, minValue, maxValue))
+    {
+      return false;
+    }
+
+    ScalePixelSpacing(json, factor);
+
+    Json::Value& info = json["Orthanc"]["Tile"];
+    info["Level"] = level;
+    info["LevelsCount"] = levelsCount;
+    info["X"] = tileX;
+    info["Y"] = tileY;
+    info["TileSize"] = TILE_SIZE;
+    info["LevelWidth"] = levelWidth;
+    info["LevelHeight"] = levelHeight;
+
+    WriteImage(content, json, pixelData, tags);
+    return true;
+  }
+
+
+  void DecodedImageAdapter::DecodeOtherFrames(std::vector<std::string>& items,
+                                              std::unique_ptr<InstanceLoader>& instance,
+                                              const std::string& instanceId,
+                                              unsigned int framesCount,
+                                              int bundle,
+                                              const std::string& prefix,
+                                              unsigned int frameIndex,
+                                              uint64_t frameSize)
+  {
+    // The decoded frames must stay in their cache until they are
+    // encoded by the prefetching
+    uint64_t maxSize = frames_.GetMaximumSize() / 2;
+    if (maxBatchSize_ != 0)
+    {
+      maxSize = std::min(maxSize, maxBatchSize_);
+    }
+
+    uint64_t batchSize = 0;
+
+    // The frames are decoded in the order of a cine playback that
+    // starts at the requested frame
+    for (unsigned int i = 1; i < framesCount; i++)
+    {
+      const unsigned int index = (frameIndex + i) % framesCount;
+      const std::string item = prefix + boost::lexical_cast<std::string>(index);
+
+      if (scheduler_.IsCached(bundle, item))
+      {
+        continue;
+      }
+
+      // All the frames of an instance have the same size: Stop
+      // before decoding a frame that would not fit in the budget
+      if (batchSize + frameSize > maxSize)
+      {
+        LOG(INFO) << "Too many frames to be decoded at once, stopping at frame "
+                  << index << " of: " << prefix;
+        return;
+      }
+
+      batchSize += GetDecodedFrame(instance, instanceId, index)->GetMemorySize();
+      items.push_back(item);
+
+      {
+        // Wake up the threads that are waiting for this frame
+        boost::mutex::scoped_lock lock(batchMutex_);
+        batchFinished_.notify_all();
+      }
+    }
+  }
+
+
+  void DecodedImageAdapter::StoreOtherFrames(std::unique_ptr<InstanceLoader>& instance,
+                                             const std::string& instanceId,
+                                             unsigned int framesCount,
+                                             const Json::Value& statistics,
+                                             int bundle,
+                                             CompressionType type,
+                                             uint8_t level,
+                                             unsigned int previewSize,
+                                             const std::string& prefix,
+                                             unsigned int frameIndex,
+                                             uint64_t batchSize)
+  {
+    // The frames are stored in the order of a cine playback that
+    // starts at the requested frame
+    for (unsigned int i = 1; i < framesCount; i++)
+    {
+      const unsigned int index = (frameIndex + i) % framesCount;
+      const std::string item = prefix + boost::lexical_cast<std::string>(index);
+
+      if (scheduler_.IsCached(bundle, item))
+      {
+        continue;
+      }
+
+      std::string content;
+      if (!EncodeFrame(content, *GetDecodedFrame(instance, instanceId, index), statistics,
+                       type, level, previewSize))
+      {
+        return;
+      }
+
+      batchSize += content.size();
+      if (maxBatchSize_ != 0 &&
+          batchSize > maxBatchSize_)
+      {
+        LOG(INFO) << "Too many frames to be cached at once, stopping at frame "
+                  << index << " of: " << prefix;
+        return;
+      }
+
+      scheduler_.Store(bundle, item, content);
+    }
+  }
+
+
+
+  bool DecodedImageAdapter::LookupSeriesStatistics(Json::Value& statistics,
+                                                   const Json::Value& tags)
+  {
+    statistics = Json::nullValue;
+
+    // The identifier of the parent series is computed from the tags
+    // of the instance, the same way as the Orthanc core, which avoids
+    // a call to the REST API for each generated image
+    std::string patientId, studyUid, seriesUid, instanceUid;
+    GetStringTag(patientId, tags, "0010,0020");
+
+    if (!GetStringTag(studyUid, tags, "0020,000d") ||
+        !GetStringTag(seriesUid, tags, "0020,000e") ||
+        !GetStringTag(instanceUid, tags, "0008,0018"))
+    {
+      // No series can be associated with this instance
+      return true;
+    }
+
+    std::string seriesId;
+
+    try
+    {
+      seriesId = Orthanc::DicomInstanceHasher(Orthanc::Toolbox::StripSpaces(patientId),
+                                              Orthanc::Toolbox::StripSpaces(studyUid),
+                                              Orthanc::Toolbox::StripSpaces(seriesUid),
+                                              Orthanc::Toolbox::StripSpaces(instanceUid)).HashSeries();
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      // Empty identifiers
+      return true;
+    }
+
+    std::string content;
+    if (!scheduler_.Lookup(content, CacheBundle_SeriesInformation, seriesId))
+    {
+      // The next images of the series will be stretched to its range
+      scheduler_.Prefetch(CacheBundle_SeriesInformation, seriesId, CacheScheduler::GetCurrentSession());
+      return false;
+    }
+
+    Json::Value series;
+    if (Orthanc::Toolbox::ReadJson(series, content) &&
+        series.isMember("Statistics"))
+    {
+      statistics = series["Statistics"];
+    }
+
+    return true;
+  }
+
+
+  bool DecodedImageAdapter::CreateInternal(std::string& content,
+                                           const std::string& uri,
+                                           int bundle)
+  {
+    LOG(INFO) << "Decoding DICOM instance: " << uri;
+
+    CompressionType type;
+    uint8_t level;
+    unsigned int previewSize = 0;
+    std::string instanceId;
+    unsigned int frameIndex;
+    
+    if (!ParseUri(type, level, previewSize, instanceId, frameIndex, uri) ||
+        (type == CompressionType_Preview) != (bundle == CacheBundle_PreviewImage))
+    {
+      return false;
+    }
+
+    // Breakdown of the generation of this frame, for the requests
+    // that are waiting for it
+    DecodingTimings timings;
+    DecodingTimingsScope scope(timings);
+
+    // If the frame was recently decoded for another compression, or
+    // by the first request for a frame of its multi-frame instance,
+    // it is encoded again without loading nor decoding the DICOM
+    // instance, and without waiting for the other threads
+    boost::shared_ptr<DecodedFrame> frame;
+
+    {
+      boost::shared_ptr<DecodedFrameCache::IFrame> cached = frames_.Lookup(instanceId, frameIndex);
+      if (cached.get() != NULL)
+      {
+        frame = boost::static_pointer_cast<DecodedFrame>(cached);
+      }
+    }
+
+    std::unique_ptr<BatchLock> batch;
+    std::unique_ptr<InstanceLoader> instance;
+
+    if (frame.get() == NULL)
+    {
+      batch.reset(new BatchLock(*this, instanceId, frameIndex));
+
+      if (batch->HasWaited() &&
+          scheduler_.Lookup(content, bundle, uri))
+      {
+        // This frame was encoded by another thread in the meantime
+        return true;
+      }
+
+      frame = GetDecodedFrame(instance, instanceId, frameIndex);
+    }
+
+    // The range of the series is only known once its information is
+    // cached. Until then, the frame is stretched to its own range and
+    // only given to the requests that wait for it, so that the cache
+    // never mixes the two kinds of stretching.
+    Json::Value statistics;
+    const bool isSeriesKnown = LookupSeriesStatistics(statistics, frame->GetTags());
+
+    if (!isSeriesKnown)
+    {
+      CacheScheduler::DiscardCurrentItem();
+    }
+
+    if (!EncodeFrame(content, *frame, statistics, type, level, previewSize))
+    {
+      LOG(WARNING) << "Unable to decode the following instance: " << uri;
+      return false;
+    }
+
+    StoreItemTimings(uri, timings);
+
+    if (isSeriesKnown &&
+        instance.get() != NULL &&
+        batch->IsOwner() &&
+        frame->GetFramesCount() > 1)
+    {
+      /**
+       * The multi-frame instance was loaded for this frame. Answer
+       * the requested frame right now, then decode the other frames
+       * while the instance is loaded. The threads waiting for one of
+       * these frames are released as soon as it is decoded. The
+       * encoding of the other frames is queued as prefetching, which
+       * does not lock the instance, so that a long clip cannot keep
+       * the workers of the decoding pool waiting.
+       **/
+      scheduler_.Store(bundle, uri, content);
+
+      const std::string prefix = uri.substr(0, uri.rfind('_') + 1);
+
+      if (frames_.GetMaximumSize() == 0)
+      {
+        /**
+         * The cache of the decoded frames is disabled: The prefetching
+         * of each frame would load the whole instance again. Encode
+         * the other frames while the instance is loaded, at the price
+         * of keeping the instance locked meanwhile.
+         **/
+        try
+        {
+          StoreOtherFrames(instance, instanceId, frame->GetFramesCount(), statistics,
+                           bundle, type, level, previewSize, prefix, frameIndex, content.size());
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          LOG(WARNING) << "Unable to encode all the frames of instance " << instanceId
+                       << ": " << e.What();
+        }
+
+        return true;
+      }
+
+      std::vector<std::string> others;
+
+      try
+      {
+        DecodeOtherFrames(others, instance, instanceId, frame->GetFramesCount(),
+                          bundle, prefix, frameIndex, frame->GetMemorySize());
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(WARNING) << "Unable to decode all the frames of instance " << instanceId
+                     << ": " << e.What();
+      }
+
+      instance.reset();
+      batch.reset();
+
+      // The prefetch queue is LIFO: Queue the frames in reverse order,
+      // so that they are encoded in the order of the cine playback.
+      // They are cancelled together with the other prefetchings of
+      // the client that asked for this frame.
+      const std::string session = CacheScheduler::GetCurrentSession();
+
+      for (size_t i = others.size(); i > 0; i--)
+      {
+        scheduler_.Prefetch(bundle, others[i - 1], session);
+      }
+    }
+
+    return true;
+  }
+
+
+  class DecodedImageAdapter::PreviewFactory : public ICacheFactory
+  {
+  private:
+    DecodedImageAdapter&  that_;
+
+  public:
+    explicit PreviewFactory(DecodedImageAdapter& that) :
+      that_(that)
     {
-      value = tags[tag]["Value"].asString();
-      return true;
-    }        
-    else
+    }
+
+    virtual bool Create(std::string& content,
+                        const std::string& uri) ORTHANC_OVERRIDE
     {
-      return false;
+      return that_.CreateInternal(content, uri, CacheBundle_PreviewImage);
     }
+  };
+
+
+  ICacheFactory* DecodedImageAdapter::CreatePreviewFactory()
+  {
+    return new PreviewFactory(*this);
   }
-                                 
 
-  static float GetFloatTag(const Json::Value& tags,
-                           const std::string& tag,
-                           float defaultValue)
+
+  class DecodedImageAdapter::SeriesInformationFactory : public SeriesInformationAdapter
   {
-    std::string tmp;
-    if (GetStringTag(tmp, tags, tag))
+  private:
+    DecodedImageAdapter&  that_;
+
+    /**
+     * Decodes the sampled slices of one series. The instance that is
+     * loaded is shared by the consecutive samples that are frames of
+     * the same instance (e.g. the samples of a single multi-frame
+     * clip), so that it is only loaded once.
+     **/
+    class Sampler : public boost::noncopyable
+    {
+    private:
+      DecodedImageAdapter&             that_;
+      std::string                      instanceId_;
+      std::unique_ptr<InstanceLoader>  instance_;
+      std::unique_ptr<BatchLock>       batch_;
+
+    public:
+      explicit Sampler(DecodedImageAdapter& that) :
+        that_(that)
+      {
+      }
+
+      void AddFrame(SeriesStatistics& statistics,
+                    const std::string& slice)
+      {
+        const size_t separator = slice.rfind('_');
+        if (separator == std::string::npos)
+        {
+          return;
+        }
+
+        const std::string instanceId = slice.substr(0, separator);
+        const unsigned int frameIndex = boost::lexical_cast<unsigned int>(slice.substr(separator + 1));
+
+        if (instanceId != instanceId_)
+        {
+          instance_.reset();
+          batch_.reset();
+          instanceId_ = instanceId;
+        }
+
+        boost::shared_ptr<DecodedFrameCache::IFrame> cached = that_.frames_.Lookup(instanceId, frameIndex);
+        if (cached.get() != NULL)
+        {
+          statistics.AddFrame(boost::static_pointer_cast<DecodedFrame>(cached)->GetAccessor());
+          return;
+        }
+
+        if (batch_.get() == NULL ||
+            !batch_->IsOwner())
+        {
+          // Stops waiting as soon as the frame is decoded by the thread
+          // that holds the instance (e.g. a batch of a multi-frame clip)
+          batch_.reset();
+          batch_.reset(new BatchLock(that_, instanceId, frameIndex));
+        }
+
+        statistics.AddFrame(that_.GetDecodedFrame(instance_, instanceId, frameIndex)->GetAccessor());
+      }
+    };
+
+  public:
+    explicit SeriesInformationFactory(DecodedImageAdapter& that) :
+      SeriesInformationAdapter(that.context_, that.scheduler_),
+      that_(that)
     {
+    }
+
+    virtual bool Create(std::string& content,
+                        const std::string& seriesId) ORTHANC_OVERRIDE
+    {
+      Json::Value series;
+      if (!SeriesInformationAdapter::Create(content, seriesId) ||
+          !Orthanc::Toolbox::ReadJson(series, content))
+      {
+        return false;
+      }
+
+      /**
+       * The range of a series is frozen once it is computed: When the
+       * series information is refreshed during an acquisition, the
+       * slices that are already cached were stretched to the previous
+       * range, and the new slices must stay consistent with them.
+       * This also spares the decoding of the sampled slices.
+       **/
+      std::string previousContent;
+      Json::Value previous;
+      if (that_.scheduler_.Lookup(previousContent, CacheBundle_SeriesInformation, seriesId) &&
+          Orthanc::Toolbox::ReadJson(previous, previousContent) &&
+          previous.isMember("Statistics"))
+      {
+        series["Statistics"] = previous["Statistics"];
+        content = series.toStyledString();
+        return true;
+      }
+
+      const Json::Value& slices = series["Slices"];
+      const Json::Value::ArrayIndex count = slices.size();
+      const Json::Value::ArrayIndex samples = std::min(count, SERIES_STATISTICS_SAMPLES);
+
+      SeriesStatistics statistics;
+
       try
       {
-        return boost::lexical_cast<float>(Orthanc::Toolbox::StripSpaces(tmp));
+        Sampler sampler(that_);
+
+        for (Json::Value::ArrayIndex i = 0; i < samples; i++)
+        {
+          const Json::Value::ArrayIndex index = (samples == 1 ? count / 2 : i * (count - 1) / (samples - 1));
+          sampler.AddFrame(statistics, slices[index].asString());
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(WARNING) << "Unable to compute the statistics of series " << seriesId << ": " << e.What();
+        return true;  // The series information is still valid
       }
       catch (boost::bad_lexical_cast&)
       {
+        return true;
+      }
+
+      if (statistics.Format(series["Statistics"]))
+      {
+        content = series.toStyledString();
       }
+
+      return true;
     }
+  };
 
-    return defaultValue;
+
+  ICacheFactory* DecodedImageAdapter::CreateSeriesInformationFactory()
+  {
+    return new SeriesInformationFactory(*this);
   }
-                                 
 
-  bool DecodedImageAdapter::ParseUri(CompressionType& type,
-                                     uint8_t& compressionLevel,
-                                     std::string& instanceId,
-                                     unsigned int& frameIndex,
-                                     const std::string& uri)
+
+  typedef std::pair<unsigned int, unsigned int>  TileCoordinates;
+
+  // Lists the other tiles of a level of "countX" by "countY" tiles,
+  // by increasing distance to the tile "(tileX, tileY)"
+  static void ListNeighbourTiles(std::vector<TileCoordinates>& target,
+                                 unsigned int tileX,
+                                 unsigned int tileY,
+                                 unsigned int countX,
+                                 unsigned int countY)
   {
-    boost::regex pattern("^([a-z0-9]+)-([a-z0-9-]+)_([0-9]+)$");
+    const unsigned int rings = std::max(countX, countY);
 
-    boost::cmatch what;
-    if (!regex_match(uri.c_str(), what, pattern))
+    for (unsigned int ring = 1; ring < rings; ring++)
+    {
+      for (unsigned int y = (tileY >= ring ? tileY - ring : 0);
+           y <= tileY + ring && y < countY; y++)
+      {
+        for (unsigned int x = (tileX >= ring ? tileX - ring : 0);
+             x <= tileX + ring && x < countX; x++)
+        {
+          // Only the border of the square of radius "ring"
+          if (x + ring == tileX || x == tileX + ring ||
+              y + ring == tileY || y == tileY + ring)
+          {
+            target.push_back(std::make_pair(x, y));
+          }
+        }
+      }
+    }
+  }
+
+
+  bool DecodedImageAdapter::CreateTile(std::string& content,
+                                       const std::string& uri)
+  {
+    LOG(INFO) << "Creating the tile of DICOM instance: " << uri;
+
+    unsigned int level, tileX, tileY, frameIndex;
+    std::string instanceId;
+
+    if (!ParseTileUri(level, tileX, tileY, instanceId, frameIndex, uri))
     {
       return false;
     }
 
-    std::string compression(what[1]);
-    instanceId = what[2];
-    frameIndex = boost::lexical_cast<unsigned int>(what[3]);
+    DecodingTimings timings;
+    DecodingTimingsScope scope(timings);
+
+    // As in "CreateInternal()", the instance is only locked while its
+    // frame is decoded, not while its tiles are encoded
+    boost::shared_ptr<DecodedFrame> frame;
 
-    if (compression == "deflate")
     {
-      type = CompressionType_Deflate;
+      boost::shared_ptr<DecodedFrameCache::IFrame> cached = frames_.Lookup(instanceId, frameIndex);
+      if (cached.get() != NULL)
+      {
+        frame = boost::static_pointer_cast<DecodedFrame>(cached);
+      }
     }
-    else if (boost::starts_with(compression, "jpeg"))
+
+    if (frame.get() == NULL)
     {
-      type = CompressionType_Jpeg;
-      int level = boost::lexical_cast<int>(compression.substr(4));
-      if (level <= 0 || level > 100)
+      BatchLock batch(*this, instanceId, frameIndex);
+
+      if (batch.HasWaited() &&
+          scheduler_.Lookup(content, CacheBundle_Tile, uri))
       {
-        return false;
+        // This tile was created by another thread in the meantime
+        return true;
       }
 
-      compressionLevel = static_cast<uint8_t>(level);
+      std::unique_ptr<InstanceLoader> instance;
+      frame = GetDecodedFrame(instance, instanceId, frameIndex);
     }
-    else
+
+    const Orthanc::ImageAccessor& source = frame->GetAccessor();
+    const unsigned int levelsCount = GetTileLevelsCount(source.GetWidth(), source.GetHeight());
+
+    if (level >= levelsCount)
     {
       return false;
     }
 
-    return true;
-  }
-
+    int64_t minValue = frame->GetMinValue();
+    int64_t maxValue = frame->GetMaxValue();
 
+    // As in "CreateInternal()", the tiles that are not stretched to
+    // the range of the series are not cached
+    Json::Value statistics;
+    const bool isSeriesKnown = LookupSeriesStatistics(statistics, frame->GetTags());
+    ExtendToSeriesRange(minValue, maxValue, statistics);
 
-  bool DecodedImageAdapter::Create(std::string& content,
-                                   const std::string& uri)
-  {
-    LOG(INFO) << "Decoding DICOM instance: " << uri;
-
-    CompressionType type;
-    uint8_t level;
-    std::string instanceId;
-    unsigned int frameIndex;
-    
-    if (!ParseUri(type, level, instanceId, frameIndex, uri))
+    if (!EncodeTile(content, frame->GetTags(), source, level, levelsCount, tileX, tileY, minValue, maxValue))
     {
+      LOG(WARNING) << "Unable to create the following tile: " << uri;
       return false;
     }
 
-    bool ok = false;
+    StoreItemTimings(uri, timings);
 
-    Json::Value tags;
-    std::string dicom;
-    if (!GetStringFromOrthanc(dicom, context_, "/instances/" + instanceId + "/file") ||
-        !GetJsonFromOrthanc(tags, context_, "/instances/" + instanceId + "/tags"))
+    if (!isSeriesKnown)
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+      CacheScheduler::DiscardCurrentItem();
+      return true;
     }
 
-    std::unique_ptr<OrthancImage> image(
-      new OrthancImage(OrthancPluginDecodeDicomImage(
-                         context_, dicom.c_str(), dicom.size(), frameIndex)));
+    // Answer the requested tile right now, then cache its neighbours
+    // in the same level, nearest first, as the user is likely to pan
+    scheduler_.Store(CacheBundle_Tile, uri, content);
 
-    Json::Value json;
-    if (GetCornerstoneMetadata(json, tags, *image))
+    const unsigned int factor = 1u << level;
+    const unsigned int countX = (std::max(1u, source.GetWidth() / factor) + TILE_SIZE - 1) / TILE_SIZE;
+    const unsigned int countY = (std::max(1u, source.GetHeight() / factor) + TILE_SIZE - 1) / TILE_SIZE;
+    const std::string prefix = boost::lexical_cast<std::string>(level) + "/";
+    const std::string suffix = "/" + instanceId + "_" + boost::lexical_cast<std::string>(frameIndex);
+
+    // The encoded size of the neighbours is estimated from the size
+    // of the requested tile
+    uint64_t batchSize = content.size();
+
+    std::vector<TileCoordinates> neighbours;
+    ListNeighbourTiles(neighbours, tileX, tileY, countX, countY);
+
+    std::vector<std::string> items;
+    std::vector<TileCoordinates> tiles;
+
+    for (size_t i = 0; i < neighbours.size(); i++)
     {
-      if (type == CompressionType_Deflate)
+      const std::string item = (prefix + boost::lexical_cast<std::string>(neighbours[i].first) + "/" +
+                                boost::lexical_cast<std::string>(neighbours[i].second) + suffix);
+
+      if (scheduler_.IsCached(CacheBundle_Tile, item))
       {
-        ok = EncodeUsingDeflate(json, *image);
+        continue;
       }
-      else if (type == CompressionType_Jpeg)
+
+      batchSize += content.size();
+      if (items.size() >= MAX_PREFETCHED_TILES ||
+          (maxBatchSize_ != 0 &&
+           batchSize > maxBatchSize_))
       {
-        ok = EncodeUsingJpeg(json, *image, level);
+        LOG(INFO) << "Too many tiles to be cached at once, stopping at: " << item;
+        break;
       }
-    }   
 
-    if (ok)
+      items.push_back(item);
+      tiles.push_back(neighbours[i]);
+    }
+
+    if (frame->GetMemorySize() <= frames_.GetMaximumSize() / 2)
     {
-      std::string photometric;
-      if (GetStringTag(photometric, tags, "0028,0004"))
+      // The decoded frame stays in its cache until the neighbours are
+      // encoded by the prefetching. The prefetch queue is LIFO: Queue
+      // the neighbours from the farthest one.
+      const std::string session = CacheScheduler::GetCurrentSession();
+
+      for (size_t i = items.size(); i > 0; i--)
       {
-        json["Orthanc"]["PhotometricInterpretation"] = photometric;
+        scheduler_.Prefetch(CacheBundle_Tile, items[i - 1], session);
       }
-
-      Orthanc::Toolbox::WriteFastJson(content, json);
-      return true;
     }
     else
     {
-      LOG(WARNING) << "Unable to decode the following instance: " << uri;
-      return false;
+      // The frame is too large for the cache of the decoded frames:
+      // Encode the neighbours while it is in memory, so that the
+      // prefetching does not decode it again for each tile
+      try
+      {
+        for (size_t i = 0; i < items.size(); i++)
+        {
+          std::string tile;
+          if (!EncodeTile(tile, frame->GetTags(), source, level, levelsCount,
+                          tiles[i].first, tiles[i].second, minValue, maxValue))
+          {
+            LOG(WARNING) << "Unable to create the following tile: " << items[i];
+            break;
+          }
+
+          scheduler_.Store(CacheBundle_Tile, items[i], tile);
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(WARNING) << "Unable to create all the tiles of level " << level
+                     << " of instance " << instanceId << ": " << e.What();
+      }
+    }
+
+    return true;
+  }
+
+
+  class DecodedImageAdapter::TileFactory : public ICacheFactory
+  {
+  private:
+    DecodedImageAdapter&  that_;
+
+  public:
+    explicit TileFactory(DecodedImageAdapter& that) :
+      that_(that)
+    {
+    }
+
+    virtual bool Create(std::string& content,
+                        const std::string& uri) ORTHANC_OVERRIDE
+    {
+      return that_.CreateTile(content, uri);
     }
+  };
+
+
+  ICacheFactory* DecodedImageAdapter::CreateTileFactory()
+  {
+    return new TileFactory(*this);
+  }
+
+
+  bool DecodedImageAdapter::Create(std::string& content,
+                                   const std::string& uri)
+  {
+    return CreateInternal(content, uri, CacheBundle_DecodedImage);
   }
 
 
   bool DecodedImageAdapter::GetCornerstoneMetadata(Json::Value& result,
                                                    const Json::Value& tags,
-                                                   const OrthancImage& image)
+                                                   const Orthanc::ImageAccessor& accessor,
+                                                   int64_t minValue,
+                                                   int64_t maxValue)
   {
     float windowCenter, windowWidth;
 
-    Orthanc::ImageAccessor accessor;
-    accessor.AssignReadOnly(OrthancPlugins::Convert(image.GetPixelFormat()), image.GetWidth(),
-                            image.GetHeight(), image.GetPitch(), image.GetBuffer());
-
     switch (accessor.GetFormat())
     {
       case Orthanc::PixelFormat_Grayscale8:
       case Orthanc::PixelFormat_Grayscale16:
       case Orthanc::PixelFormat_SignedGrayscale16:
       {
-        int64_t a, b;
-        Orthanc::ImageProcessing::GetMinMaxIntegerValue(a, b, accessor);
+        const int64_t a = minValue;
+        const int64_t b = maxValue;
         result["minPixelValue"] = (a < 0 ? static_cast<int32_t>(a) : 0);
         result["maxPixelValue"] = (b > 0 ? static_cast<int32_t>(b) : 1);
         result["color"] = false;
@@ -239,10 +1733,10 @@ namespace OrthancPlugins
 
     result["slope"] = slope;
     result["intercept"] = intercept;
-    result["rows"] = image.GetHeight();
-    result["columns"] = image.GetWidth();
-    result["height"] = image.GetHeight();
-    result["width"] = image.GetWidth();
+    result["rows"] = accessor.GetHeight();
+    result["columns"] = accessor.GetWidth();
+    result["height"] = accessor.GetHeight();
+    result["width"] = accessor.GetWidth();
 
     bool ok = false;
     std::string pixelSpacing;
@@ -278,42 +1772,10 @@ namespace OrthancPlugins
   }
 
 
-  static void ConvertRGB48ToRGB24(Orthanc::ImageAccessor& target,
-                                  const Orthanc::ImageAccessor& source)
-  {
-    if (source.GetWidth() != target.GetWidth() ||
-        source.GetHeight() != target.GetHeight())
-    {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
-    }
-
-    const unsigned int width = source.GetWidth();
-    const unsigned int height = source.GetHeight();
-
-    for (unsigned int y = 0; y < height; y++)
-    {
-      const uint16_t* p = reinterpret_cast<const uint16_t*>(source.GetConstRow(y));
-      uint8_t* q = reinterpret_cast<uint8_t*>(target.GetRow(y));
-
-      for (unsigned int x = 0; x < width; x++)
-      {
-        q[0] = p[0] >> 8;
-        q[1] = p[1] >> 8;
-        q[2] = p[2] >> 8;
-        p += 3;
-        q += 3;
-      }
-    }
-  }
-
-
   bool  DecodedImageAdapter::EncodeUsingDeflate(Json::Value& result,
-                                                const OrthancImage& image)
+                                                std::string& pixelData,
+                                                const Orthanc::ImageAccessor& accessor)
   {
-    Orthanc::ImageAccessor accessor;
-    accessor.AssignReadOnly(OrthancPlugins::Convert(image.GetPixelFormat()), image.GetWidth(),
-                            image.GetHeight(), image.GetPitch(), image.GetBuffer());
-
     std::unique_ptr<Orthanc::ImageBuffer> buffer;
 
     Orthanc::ImageAccessor converted;
@@ -329,7 +1791,12 @@ namespace OrthancPlugins
                                               accessor.GetWidth(),
                                               accessor.GetHeight(), false));
         buffer->GetWriteableAccessor(converted);
-        ConvertRGB48ToRGB24(converted, accessor);
+
+        {
+          DecodingStageTimer timer(DecodingStage_Stretch);
+          ConvertRGB48ToRGB24(converted, accessor);
+        }
+
         break;
 
       case Orthanc::PixelFormat_Grayscale8:
@@ -359,76 +1826,70 @@ namespace OrthancPlugins
     result["Orthanc"]["Compression"] = "Deflate";
     result["sizeInBytes"] = static_cast<Json::Value::UInt64>(converted.GetSize());
 
-    std::string z;
-    CompressUsingDeflate(z, GetGlobalContext(), converted.GetConstBuffer(), converted.GetSize());
-    
-    std::string s;
-    Orthanc::Toolbox::EncodeBase64(s, z);
-    result["Orthanc"]["PixelData"] = s;
+    DecodingStageTimer timer(DecodingStage_Encode);
+    CompressUsingDeflate(pixelData, GetGlobalContext(), converted.GetConstBuffer(), converted.GetSize());
 
     return true;
   }
 
 
 
-  template <typename TargetType, typename SourceType>
-  static void ChangeDynamics(Orthanc::ImageAccessor& target,
-                             const Orthanc::ImageAccessor& source,
-                             SourceType source1, TargetType target1,
-                             SourceType source2, TargetType target2)
+  bool  DecodedImageAdapter::EncodeUsingDelta(Json::Value& result,
+                                              std::string& pixelData,
+                                              const Orthanc::ImageAccessor& accessor)
   {
-    if (source.GetWidth() != target.GetWidth() ||
-        source.GetHeight() != target.GetHeight())
+    std::unique_ptr<Orthanc::ImageBuffer> buffer;
+
+    Orthanc::ImageAccessor converted;
+
+    switch (accessor.GetFormat())
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
-    }
+      case Orthanc::PixelFormat_RGB24:
+      case Orthanc::PixelFormat_RGB48:
+        // The predictor is only applied to the grayscale images
+        return EncodeUsingDeflate(result, pixelData, accessor);
+
+      case Orthanc::PixelFormat_Grayscale8:
+        buffer.reset(new Orthanc::ImageBuffer(Orthanc::PixelFormat_Grayscale16,
+                                              accessor.GetWidth(),
+                                              accessor.GetHeight(), false));
+        buffer->GetWriteableAccessor(converted);
+        Orthanc::ImageProcessing::Convert(converted, accessor);
+        break;
 
-    float scale = static_cast<float>(target2 - target1) / static_cast<float>(source2 - source1);
-    float offset = static_cast<float>(target1) - scale * static_cast<float>(source1);
+      case Orthanc::PixelFormat_Grayscale16:
+      case Orthanc::PixelFormat_SignedGrayscale16:
+        accessor.GetReadOnlyAccessor(converted);
+        break;
 
-    const float minValue = static_cast<float>(std::numeric_limits<TargetType>::min());
-    const float maxValue = static_cast<float>(std::numeric_limits<TargetType>::max());
+      default:
+        // Unsupported pixel format
+        return false;
+    }
 
-    const unsigned int width = source.GetWidth();
-    const unsigned int height = source.GetHeight();
+    DecodingStageTimer timer(DecodingStage_Encode);
 
-    for (unsigned int y = 0; y < height; y++)
-    {
-      const SourceType* p = reinterpret_cast<const SourceType*>(source.GetConstRow(y));
-      TargetType* q = reinterpret_cast<TargetType*>(target.GetRow(y));
+    std::string planes;
+    EncodeDeltaPlanes(planes, converted);
 
-      for (unsigned int x = 0; x < width; x++, p++, q++)
-      {
-        float v = (scale * static_cast<float>(*p)) + offset;
+    result["Orthanc"]["IsSigned"] = (accessor.GetFormat() == Orthanc::PixelFormat_SignedGrayscale16);
+    result["Orthanc"]["Compression"] = "Delta";
+    result["sizeInBytes"] = static_cast<Json::Value::UInt64>(planes.size());
 
-        if (v > maxValue)
-        {
-          *q = std::numeric_limits<TargetType>::max();
-        }
-        else if (v < minValue)
-        {
-          *q = std::numeric_limits<TargetType>::min();
-        }
-        else
-        {
-          //*q = static_cast<TargetType>(boost::math::iround(v));
-          
-          // http://stackoverflow.com/a/485546/881731
-          *q = static_cast<TargetType>(floor(v + 0.5f));
-        }
-      }
-    }
+    CompressUsingDeflate(pixelData, GetGlobalContext(), planes.c_str(), planes.size());
+
+    return true;
   }
 
 
+
   bool  DecodedImageAdapter::EncodeUsingJpeg(Json::Value& result,
-                                             const OrthancImage& image,
-                                             uint8_t quality /* between 0 and 100 */)
+                                             std::string& pixelData,
+                                             const Orthanc::ImageAccessor& accessor,
+                                             uint8_t quality /* between 0 and 100 */,
+                                             int64_t minValue,
+                                             int64_t maxValue)
   {
-    Orthanc::ImageAccessor accessor;
-    accessor.AssignReadOnly(OrthancPlugins::Convert(image.GetPixelFormat()), image.GetWidth(),
-                            image.GetHeight(), image.GetPitch(), image.GetBuffer());
-
     std::unique_ptr<Orthanc::ImageBuffer> buffer;
 
     Orthanc::ImageAccessor converted;
@@ -448,6 +1909,7 @@ namespace OrthancPlugins
                                             accessor.GetHeight(), false));
       buffer->GetWriteableAccessor(converted);
       
+      DecodingStageTimer timer(DecodingStage_Stretch);
       ConvertRGB48ToRGB24(converted, accessor);
     }
     else if (accessor.GetFormat() == Orthanc::PixelFormat_Grayscale16 ||
@@ -461,18 +1923,18 @@ namespace OrthancPlugins
                                             true /* force minimal pitch */));
       buffer->GetWriteableAccessor(converted);
 
-      int64_t a, b;
-      Orthanc::ImageProcessing::GetMinMaxIntegerValue(a, b, accessor);
-      result["Orthanc"]["StretchLow"] = static_cast<int32_t>(a);
-      result["Orthanc"]["StretchHigh"] = static_cast<int32_t>(b);
+      result["Orthanc"]["StretchLow"] = static_cast<int32_t>(minValue);
+      result["Orthanc"]["StretchHigh"] = static_cast<int32_t>(maxValue);
+
+      DecodingStageTimer timer(DecodingStage_Stretch);
 
       if (accessor.GetFormat() == Orthanc::PixelFormat_Grayscale16)
       {
-        ChangeDynamics<uint8_t, uint16_t>(converted, accessor, a, 0, b, 255);
+        StretchToGrayscale8<uint16_t>(converted, accessor, minValue, maxValue);
       }
       else
       {
-        ChangeDynamics<uint8_t, int16_t>(converted, accessor, a, 0, b, 255);
+        StretchToGrayscale8<int16_t>(converted, accessor, minValue, maxValue);
       }
     }
     else
@@ -484,13 +1946,9 @@ namespace OrthancPlugins
     result["Orthanc"]["Compression"] = "Jpeg";
     result["sizeInBytes"] = static_cast<Json::Value::UInt64>(converted.GetSize());
 
-    std::string jpeg;
-    WriteJpegToMemory(jpeg, GetGlobalContext(), converted, quality);
+    DecodingStageTimer timer(DecodingStage_Encode);
+    WriteJpegToMemory(pixelData, GetGlobalContext(), converted, quality);
 
-    std::string s;
-    Orthanc::Toolbox::EncodeBase64(s, jpeg);
-    result["Orthanc"]["PixelData"] = s;
-    
     return true;
   }
 }
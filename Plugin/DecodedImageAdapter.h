@@ -24,11 +24,17 @@
 #pragma once
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
-#include "Cache/ICacheFactory.h"
+#include "Cache/CacheScheduler.h"
+#include "Cache/DecodedFrameCache.h"
 
 #include <Compatibility.h>
+#include <Images/ImageAccessor.h>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <set>
 #include <stdint.h>
+#include <vector>
 #include <json/value.h>
 
 
@@ -40,34 +46,214 @@ namespace OrthancPlugins
     enum CompressionType
     {
       CompressionType_Jpeg,
-      CompressionType_Deflate
+      CompressionType_Deflate,
+      CompressionType_Preview,
+      CompressionType_Delta
     };
 
     static bool ParseUri(CompressionType& type,
                          uint8_t& compressionLevel,
+                         unsigned int& previewSize,
                          std::string& instanceId,
                          unsigned int& frameIndex,
                          const std::string& uri);
 
+    // The tiles are identified as "<level>/<x>/<y>/<instance>_<frame>"
+    static bool ParseTileUri(unsigned int& level,
+                             unsigned int& tileX,
+                             unsigned int& tileY,
+                             std::string& instanceId,
+                             unsigned int& frameIndex,
+                             const std::string& uri);
+
+    // "minValue" and "maxValue" are the range of the pixel values,
+    // that is only meaningful for the grayscale images
     static bool GetCornerstoneMetadata(Json::Value& result,
                                        const Json::Value& tags,
-                                       const OrthancImage& image);
+                                       const Orthanc::ImageAccessor& accessor,
+                                       int64_t minValue,
+                                       int64_t maxValue);
 
     static bool EncodeUsingDeflate(Json::Value& result,
-                                   const OrthancImage& image);
+                                   std::string& pixelData,
+                                   const Orthanc::ImageAccessor& accessor);
+
+    // Lossless compression of the grayscale images, using a delta
+    // predictor and byte planes before zlib
+    static bool EncodeUsingDelta(Json::Value& result,
+                                 std::string& pixelData,
+                                 const Orthanc::ImageAccessor& accessor);
 
     static bool EncodeUsingJpeg(Json::Value& result,
-                                const OrthancImage& image,
-                                uint8_t quality /* between 0 and 100 */);
+                                std::string& pixelData,
+                                const Orthanc::ImageAccessor& accessor,
+                                uint8_t quality /* between 0 and 100 */,
+                                int64_t minValue,
+                                int64_t maxValue);
+
+    class InstanceLoader;
+    class BatchLock;
+    class DecodedFrame;
+    class PreviewFactory;
+    class SeriesInformationFactory;
+    class TileFactory;
+
+    static bool EncodeFrame(std::string& content,
+                            const DecodedFrame& frame,
+                            const Json::Value& statistics,
+                            CompressionType type,
+                            uint8_t level,
+                            unsigned int previewSize);
+
+    // "source" is the full-resolution frame
+    static bool EncodeTile(std::string& content,
+                           const Json::Value& tags,
+                           const Orthanc::ImageAccessor& source,
+                           unsigned int level,
+                           unsigned int levelsCount,
+                           unsigned int tileX,
+                           unsigned int tileY,
+                           int64_t minValue,
+                           int64_t maxValue);
+
+    OrthancPluginContext*  context_;
+    CacheScheduler&        scheduler_;
+    uint64_t               maxBatchSize_;
+    DecodedFrameCache      frames_;
+
+    // The instances whose frames are being decoded by some thread
+    boost::mutex               batchMutex_;
+    boost::condition_variable  batchFinished_;
+    std::set<std::string>      batches_;
+
+    // Gets a decoded frame from the cache, or decodes it (loading the
+    // instance into "instance" if it is not loaded yet)
+    boost::shared_ptr<DecodedFrame> GetDecodedFrame(std::unique_ptr<InstanceLoader>& instance,
+                                                    const std::string& instanceId,
+                                                    unsigned int frameIndex);
+
+    // Decodes the other frames of a multi-frame instance into the
+    // cache of the decoded frames, and lists their missing items.
+    // "frameSize" is the memory size of one decoded frame.
+    void DecodeOtherFrames(std::vector<std::string>& items,
+                           std::unique_ptr<InstanceLoader>& instance,
+                           const std::string& instanceId,
+                           unsigned int framesCount,
+                           int bundle,
+                           const std::string& prefix,
+                           unsigned int frameIndex,
+                           uint64_t frameSize);
+
+    // Encodes and stores the other frames of a multi-frame instance,
+    // if the cache of the decoded frames is disabled
+    void StoreOtherFrames(std::unique_ptr<InstanceLoader>& instance,
+                          const std::string& instanceId,
+                          unsigned int framesCount,
+                          const Json::Value& statistics,
+                          int bundle,
+                          CompressionType type,
+                          uint8_t level,
+                          unsigned int previewSize,
+                          const std::string& prefix,
+                          unsigned int frameIndex,
+                          uint64_t batchSize);
+
+    // Gets the cached statistics of the parent series of an instance,
+    // given its tags ("statistics" is null if they are unavailable).
+    // Returns "false" if the series information is not cached yet, in
+    // which case its generation is queued as prefetching, and the
+    // images that are encoded meanwhile must not be cached.
+    bool LookupSeriesStatistics(Json::Value& statistics,
+                                const Json::Value& tags);
+
+    bool CreateInternal(std::string& content,
+                        const std::string& uri,
+                        int bundle);
 
-    OrthancPluginContext* context_;
+    bool CreateTile(std::string& content,
+                    const std::string& uri);
 
   public:
-    explicit DecodedImageAdapter(OrthancPluginContext* context) :
-      context_(context)
+    DecodedImageAdapter(OrthancPluginContext* context,
+                        CacheScheduler& scheduler) :
+      context_(context),
+      scheduler_(scheduler),
+      maxBatchSize_(0),
+      frames_(0)  // The cache of the decoded frames is disabled by default
     {
     }
 
+    /**
+     * The first request for a frame of a multi-frame instance
+     * decodes all its frames into the cache of the decoded frames,
+     * and queues their encoding as prefetching. This option limits
+     * the total size of the frames that are decoded at once (which
+     * is also limited by half of the cache of the decoded frames),
+     * so that a long clip cannot flush the cache. A value of zero
+     * means no limit. If the cache of the decoded frames is disabled,
+     * the other frames are rather encoded and stored at once, within
+     * the same limit on their encoded size.
+     **/
+    void SetMaxBatchSize(uint64_t size)
+    {
+      maxBatchSize_ = size;
+    }
+
+    // Size of the cache of the decoded frames, that are shared by all
+    // the compressions of one frame
+    void SetDecodedFrameCacheSize(uint64_t size)
+    {
+      frames_.SetMaximumSize(size);
+    }
+
+    /**
+     * The decoded images are cached in a binary format: A 32-bit
+     * little-endian integer with the size of the Cornerstone metadata,
+     * followed by this metadata as JSON, followed by the compressed
+     * pixel data (JPEG or Deflate), without any base64 encoding.
+     **/
+    static void WriteBinaryImage(std::string& target,
+                                 const Json::Value& metadata,
+                                 const std::string& pixelData);
+
+    // Converts the binary format to the JSON answer of the
+    // "/web-viewer/instances/" route, with the pixel data in base64
+    static void ConvertBinaryImageToJson(std::string& target,
+                                         const std::string& binary);
+
+    /**
+     * Creates the factory of the "preview<N>-<instance>_<frame>"
+     * items, that are JPEG images downscaled so that their long edge
+     * has at most N pixels. The previews are stored in their own
+     * bundle, but share the decoded frames of this adapter, that
+     * must outlive the returned factory.
+     **/
+    ICacheFactory* CreatePreviewFactory();
+
+    /**
+     * Creates the factory of the series information, that adds the
+     * statistics about the pixel values of a sample of the slices
+     * (cf. "SeriesStatistics"). The sampled frames are decoded once,
+     * and shared with the encoding of the images.
+     **/
+    ICacheFactory* CreateSeriesInformationFactory();
+
+    /**
+     * Creates the factory of the tiles of very large frames, that are
+     * identified as "<level>/<x>/<y>/<instance>_<frame>". The level 0
+     * is the full resolution, and each level halves the resolution of
+     * the previous one, up to the level that fits in a single tile.
+     * The tiles are JPEG images of at most 512x512 pixels, in the
+     * binary format of the decoded images. Each tile is downscaled
+     * from the region of the frame it covers. Once a tile is created,
+     * its nearest neighbours in the same level are prefetched.
+     **/
+    ICacheFactory* CreateTileFactory();
+
+    // Number of levels of the pyramid of a frame, cf. "CreateTileFactory()"
+    static unsigned int GetTileLevelsCount(unsigned int width,
+                                           unsigned int height);
+
     virtual bool Create(std::string& content,
                         const std::string& uri) ORTHANC_OVERRIDE;
   };
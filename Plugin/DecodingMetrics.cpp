@@ -0,0 +1,324 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "DecodingMetrics.h"
+
+#include <OrthancException.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <list>
+#include <map>
+
+
+namespace OrthancPlugins
+{
+  const char* EnumerationToString(DecodingStage stage)
+  {
+    switch (stage)
+    {
+      case DecodingStage_Fetch:
+        return "Fetch";
+
+      case DecodingStage_Decode:
+        return "Decode";
+
+      case DecodingStage_MinMax:
+        return "MinMax";
+
+      case DecodingStage_Stretch:
+        return "Stretch";
+
+      case DecodingStage_Encode:
+        return "Encode";
+
+      case DecodingStage_Json:
+        return "Json";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  LatencyHistogram::LatencyHistogram() :
+    count_(0),
+    totalMicroseconds_(0),
+    maxMicroseconds_(0)
+  {
+    for (unsigned int i = 0; i < BUCKETS_COUNT; i++)
+    {
+      buckets_[i] = 0;
+    }
+  }
+
+
+  uint64_t LatencyHistogram::GetBucketBound(unsigned int bucket)
+  {
+    static const uint64_t BOUNDS[BUCKETS_COUNT] = {
+      1000, 2000, 5000, 10000, 20000, 50000, 100000,
+      200000, 500000, 1000000, 2000000, 5000000, 0 };
+
+    if (bucket >= BUCKETS_COUNT)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return BOUNDS[bucket];
+  }
+
+
+  void LatencyHistogram::Add(uint64_t microseconds)
+  {
+    count_++;
+    totalMicroseconds_ += microseconds;
+
+    if (microseconds > maxMicroseconds_)
+    {
+      maxMicroseconds_ = microseconds;
+    }
+
+    unsigned int bucket = 0;
+    while (bucket + 1 < BUCKETS_COUNT &&
+           microseconds > GetBucketBound(bucket))
+    {
+      bucket++;
+    }
+
+    buckets_[bucket]++;
+  }
+
+
+  uint64_t LatencyHistogram::GetBucket(unsigned int bucket) const
+  {
+    if (bucket >= BUCKETS_COUNT)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return buckets_[bucket];
+  }
+
+
+  void LatencyHistogram::Format(Json::Value& target) const
+  {
+    target = Json::objectValue;
+    target["Count"] = static_cast<Json::Value::UInt64>(count_);
+    target["TotalMs"] = static_cast<double>(totalMicroseconds_) / 1000.0;
+    target["MaxMs"] = static_cast<double>(maxMicroseconds_) / 1000.0;
+
+    Json::Value buckets = Json::objectValue;
+    uint64_t cumulated = 0;
+
+    for (unsigned int i = 0; i < BUCKETS_COUNT; i++)
+    {
+      cumulated += buckets_[i];
+
+      const uint64_t bound = GetBucketBound(i);
+      const std::string label = (bound == 0 ? "+Inf" : boost::lexical_cast<std::string>(bound / 1000));
+      buckets[label] = static_cast<Json::Value::UInt64>(cumulated);
+    }
+
+    target["BucketsMs"] = buckets;
+  }
+
+
+  static boost::mutex      stagesMutex_;
+  static LatencyHistogram  stages_[DECODING_STAGES_COUNT];
+
+  // The timings of the recent items, protected by "itemsMutex_"
+  typedef std::map<std::string, DecodingTimings>  ItemTimings;
+
+  static boost::mutex            itemsMutex_;
+  static size_t                  maxItems_ = 0;
+  static ItemTimings             items_;
+  static std::list<std::string>  itemsOrder_;  // Oldest first
+
+
+  // The timings of the scope of the current thread are not owned by
+  // the thread-specific pointer
+  static void DontDeleteTimings(DecodingTimings*)
+  {
+  }
+
+  static boost::thread_specific_ptr<DecodingTimings>  currentTimings_(DontDeleteTimings);
+
+
+  void RecordDecodingStage(DecodingStage stage,
+                           uint64_t microseconds)
+  {
+    if (static_cast<unsigned int>(stage) >= DECODING_STAGES_COUNT)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::mutex::scoped_lock lock(stagesMutex_);
+    stages_[stage].Add(microseconds);
+  }
+
+
+  void GetDecodingStageLatency(LatencyHistogram& target,
+                               DecodingStage stage)
+  {
+    if (static_cast<unsigned int>(stage) >= DECODING_STAGES_COUNT)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::mutex::scoped_lock lock(stagesMutex_);
+    target = stages_[stage];
+  }
+
+
+  DecodingTimings::DecodingTimings()
+  {
+    for (unsigned int i = 0; i < DECODING_STAGES_COUNT; i++)
+    {
+      microseconds_[i] = 0;
+    }
+  }
+
+
+  void DecodingTimings::Add(DecodingStage stage,
+                            uint64_t microseconds)
+  {
+    if (static_cast<unsigned int>(stage) >= DECODING_STAGES_COUNT)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    microseconds_[stage] += microseconds;
+  }
+
+
+  uint64_t DecodingTimings::GetMicroseconds(DecodingStage stage) const
+  {
+    if (static_cast<unsigned int>(stage) >= DECODING_STAGES_COUNT)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return microseconds_[stage];
+  }
+
+
+  DecodingTimingsScope::DecodingTimingsScope(DecodingTimings& timings) :
+    previous_(currentTimings_.get())
+  {
+    currentTimings_.reset(&timings);
+  }
+
+
+  DecodingTimingsScope::~DecodingTimingsScope()
+  {
+    currentTimings_.reset(previous_);
+  }
+
+
+  void SetMaxItemTimings(size_t maxItems)
+  {
+    boost::mutex::scoped_lock lock(itemsMutex_);
+
+    maxItems_ = maxItems;
+
+    while (itemsOrder_.size() > maxItems_)
+    {
+      items_.erase(itemsOrder_.front());
+      itemsOrder_.pop_front();
+    }
+  }
+
+
+  void StoreItemTimings(const std::string& item,
+                        const DecodingTimings& timings)
+  {
+    boost::mutex::scoped_lock lock(itemsMutex_);
+
+    if (maxItems_ == 0)
+    {
+      return;
+    }
+
+    ItemTimings::iterator found = items_.find(item);
+    if (found != items_.end())
+    {
+      // The item was generated again, keep its original place
+      found->second = timings;
+      return;
+    }
+
+    if (itemsOrder_.size() >= maxItems_)
+    {
+      items_.erase(itemsOrder_.front());
+      itemsOrder_.pop_front();
+    }
+
+    items_.insert(std::make_pair(item, timings));
+    itemsOrder_.push_back(item);
+  }
+
+
+  bool LookupItemTimings(DecodingTimings& target,
+                         const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(itemsMutex_);
+
+    ItemTimings::const_iterator found = items_.find(item);
+    if (found == items_.end())
+    {
+      return false;
+    }
+    else
+    {
+      target = found->second;
+      return true;
+    }
+  }
+
+
+  DecodingStageTimer::DecodingStageTimer(DecodingStage stage) :
+    stage_(stage),
+    start_(boost::posix_time::microsec_clock::universal_time())
+  {
+  }
+
+
+  DecodingStageTimer::~DecodingStageTimer()
+  {
+    const boost::posix_time::time_duration elapsed =
+      boost::posix_time::microsec_clock::universal_time() - start_;
+
+    const uint64_t microseconds = (elapsed.total_microseconds() > 0 ?
+                                   static_cast<uint64_t>(elapsed.total_microseconds()) : 0);
+
+    RecordDecodingStage(stage_, microseconds);
+
+    DecodingTimings* timings = currentTimings_.get();
+    if (timings != NULL)
+    {
+      timings->Add(stage_, microseconds);
+    }
+  }
+}
@@ -0,0 +1,165 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <json/value.h>
+#include <stdint.h>
+#include <string>
+
+namespace OrthancPlugins
+{
+  // The stages of the generation of a decoded image
+  enum DecodingStage
+  {
+    DecodingStage_Fetch = 0,    // Loading of the DICOM instance
+    DecodingStage_Decode = 1,   // Decoding of one frame
+    DecodingStage_MinMax = 2,   // Range of the pixel values
+    DecodingStage_Stretch = 3,  // Conversion to 8 bits per channel
+    DecodingStage_Encode = 4,   // JPEG or Deflate compression
+    DecodingStage_Json = 5      // Base64 and JSON of "/web-viewer/instances/"
+  };
+
+  static const unsigned int DECODING_STAGES_COUNT = 6;
+
+  const char* EnumerationToString(DecodingStage stage);
+
+
+  /**
+   * Histogram of durations, with fixed buckets from 1 ms to 5 s
+   * (1-2-5 progression), plus a last bucket for the longer durations.
+   **/
+  class LatencyHistogram
+  {
+  public:
+    static const unsigned int BUCKETS_COUNT = 13;
+
+  private:
+    uint64_t  count_;
+    uint64_t  totalMicroseconds_;
+    uint64_t  maxMicroseconds_;
+    uint64_t  buckets_[BUCKETS_COUNT];
+
+  public:
+    LatencyHistogram();
+
+    // The upper bound of the last bucket is infinite, and reported as 0
+    static uint64_t GetBucketBound(unsigned int bucket);  // In microseconds
+
+    void Add(uint64_t microseconds);
+
+    uint64_t GetCount() const
+    {
+      return count_;
+    }
+
+    uint64_t GetTotalMicroseconds() const
+    {
+      return totalMicroseconds_;
+    }
+
+    uint64_t GetMaxMicroseconds() const
+    {
+      return maxMicroseconds_;
+    }
+
+    uint64_t GetBucket(unsigned int bucket) const;
+
+    // The buckets are cumulative, as in Prometheus: Each of them
+    // counts the durations that are below its upper bound
+    void Format(Json::Value& target) const;
+  };
+
+
+  // The latencies are accumulated by all the threads since the startup
+  void RecordDecodingStage(DecodingStage stage,
+                           uint64_t microseconds);
+
+  void GetDecodingStageLatency(LatencyHistogram& target,
+                               DecodingStage stage);
+
+
+  // Durations of the stages of the generation of one item
+  class DecodingTimings
+  {
+  private:
+    uint64_t  microseconds_[DECODING_STAGES_COUNT];
+
+  public:
+    DecodingTimings();
+
+    void Add(DecodingStage stage,
+             uint64_t microseconds);
+
+    uint64_t GetMicroseconds(DecodingStage stage) const;
+  };
+
+
+  /**
+   * While an object of this class exists, the "DecodingStageTimer"
+   * of the current thread also accumulate their durations into
+   * "timings". This gives the breakdown of one request, whereas the
+   * histograms above are shared by all the requests.
+   **/
+  class DecodingTimingsScope : public boost::noncopyable
+  {
+  private:
+    DecodingTimings*  previous_;
+
+  public:
+    explicit DecodingTimingsScope(DecodingTimings& timings);
+
+    ~DecodingTimingsScope();
+  };
+
+
+  /**
+   * The timings of the most recently generated items are kept, so
+   * that the requests that waited for an item generated by another
+   * thread can report them. Disabled by default ("maxItems == 0").
+   **/
+  void SetMaxItemTimings(size_t maxItems);
+
+  void StoreItemTimings(const std::string& item,
+                        const DecodingTimings& timings);
+
+  bool LookupItemTimings(DecodingTimings& target,
+                         const std::string& item);
+
+
+  // Records the duration of the enclosing scope
+  class DecodingStageTimer : public boost::noncopyable
+  {
+  private:
+    DecodingStage             stage_;
+    boost::posix_time::ptime  start_;
+
+  public:
+    explicit DecodingStageTimer(DecodingStage stage);
+
+    ~DecodingStageTimer();
+  };
+}
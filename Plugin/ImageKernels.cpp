@@ -0,0 +1,1114 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ImageKernels.h"
+
+#include <cmath>
+#include <string.h>
+
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#  define ORTHANC_WEBVIEWER_HAS_SSE2  1
+#  include <emmintrin.h>
+#else
+#  define ORTHANC_WEBVIEWER_HAS_SSE2  0
+#endif
+
+// The AVX2 kernels are compiled using the "target" attribute, so that
+// the plugin still runs on the CPUs without AVX2
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1 && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#  define ORTHANC_WEBVIEWER_HAS_AVX2  1
+#  define ORTHANC_WEBVIEWER_AVX2  __attribute__((target("avx2")))
+#  include <immintrin.h>
+#else
+#  define ORTHANC_WEBVIEWER_HAS_AVX2  0
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define ORTHANC_WEBVIEWER_HAS_NEON  1
+#  include <arm_neon.h>
+#else
+#  define ORTHANC_WEBVIEWER_HAS_NEON  0
+#endif
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Scalar reference implementations
+   **/
+
+  template <typename SourceType>
+  static void GetMinMaxScalar(SourceType& minValue,
+                              SourceType& maxValue,
+                              const SourceType* source,
+                              size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      if (source[i] < minValue)
+      {
+        minValue = source[i];
+      }
+
+      if (source[i] > maxValue)
+      {
+        maxValue = source[i];
+      }
+    }
+  }
+
+
+  template <typename SourceType>
+  static void StretchScalar(uint8_t* target,
+                            const SourceType* source,
+                            size_t count,
+                            float scale,
+                            float offset)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      float v = (scale * static_cast<float>(source[i])) + offset;
+
+      if (v > 255.0f)
+      {
+        target[i] = 255;
+      }
+      else if (v < 0.0f)
+      {
+        target[i] = 0;
+      }
+      else
+      {
+        // http://stackoverflow.com/a/485546/881731
+        target[i] = static_cast<uint8_t>(floor(v + 0.5f));
+      }
+    }
+  }
+
+
+  template <typename TargetType, typename SourceType>
+  static void AccumulateRowScalar(TargetType* target,
+                                  const SourceType* source,
+                                  size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      target[i] += static_cast<TargetType>(source[i]);
+    }
+  }
+
+
+  static void EncodeDeltaPlanesScalar(uint8_t* lowPlane,
+                                      uint8_t* highPlane,
+                                      const uint16_t* source,
+                                      size_t count,
+                                      uint16_t previous)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      const uint16_t delta = static_cast<uint16_t>(source[i] - previous);
+      lowPlane[i] = static_cast<uint8_t>(delta & 0xff);
+      highPlane[i] = static_cast<uint8_t>(delta >> 8);
+      previous = source[i];
+    }
+  }
+
+
+  static void ConvertRGB48ToRGB24Scalar(uint8_t* target,
+                                        const uint16_t* source,
+                                        size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      target[i] = static_cast<uint8_t>(source[i] >> 8);
+    }
+  }
+
+
+
+  /**
+   * SSE2 implementations. The unsigned 16-bit integers are biased,
+   * as SSE2 only provides the signed comparisons.
+   **/
+
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1
+  static void GetMinMaxSSE2(int16_t& minValue,
+                            int16_t& maxValue,
+                            const int16_t* source,
+                            size_t count,
+                            int16_t bias)
+  {
+    const __m128i b = _mm_set1_epi16(bias);
+
+    __m128i low = _mm_set1_epi16(static_cast<int16_t>(minValue ^ bias));
+    __m128i high = _mm_set1_epi16(static_cast<int16_t>(maxValue ^ bias));
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i)), b);
+      low = _mm_min_epi16(low, v);
+      high = _mm_max_epi16(high, v);
+    }
+
+    int16_t l[8], h[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(l), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(h), high);
+
+    int16_t a = l[0], z = h[0];
+    for (unsigned int j = 1; j < 8; j++)
+    {
+      a = (l[j] < a ? l[j] : a);
+      z = (h[j] > z ? h[j] : z);
+    }
+
+    minValue = static_cast<int16_t>(a ^ bias);
+    maxValue = static_cast<int16_t>(z ^ bias);
+
+    if (bias == 0)
+    {
+      GetMinMaxScalar(minValue, maxValue, source + i, count - i);
+    }
+    else
+    {
+      uint16_t a2 = static_cast<uint16_t>(minValue);
+      uint16_t z2 = static_cast<uint16_t>(maxValue);
+      GetMinMaxScalar(a2, z2, reinterpret_cast<const uint16_t*>(source) + i, count - i);
+      minValue = static_cast<int16_t>(a2);
+      maxValue = static_cast<int16_t>(z2);
+    }
+  }
+
+
+  static inline __m128i StretchSSE2Block(__m128i values /* 4 x int32 */,
+                                         __m128 scale,
+                                         __m128 offset)
+  {
+    __m128 v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(values), scale), offset);
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+
+    // The value is positive after clamping: Truncation is "floor()"
+    return _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+  }
+
+
+  template <bool IsSigned>
+  static void StretchSSE2(uint8_t* target,
+                          const void* source,
+                          size_t count,
+                          float scale,
+                          float offset)
+  {
+    const __m128 s = _mm_set1_ps(scale);
+    const __m128 o = _mm_set1_ps(offset);
+    const __m128i zero = _mm_setzero_si128();
+
+    const __m128i* p = reinterpret_cast<const __m128i*>(source);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, p += 2)
+    {
+      __m128i a = _mm_loadu_si128(p);
+      __m128i b = _mm_loadu_si128(p + 1);
+
+      __m128i a0, a1, b0, b1;
+      if (IsSigned)
+      {
+        a0 = _mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16);
+        a1 = _mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16);
+        b0 = _mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16);
+        b1 = _mm_srai_epi32(_mm_unpackhi_epi16(b, b), 16);
+      }
+      else
+      {
+        a0 = _mm_unpacklo_epi16(a, zero);
+        a1 = _mm_unpackhi_epi16(a, zero);
+        b0 = _mm_unpacklo_epi16(b, zero);
+        b1 = _mm_unpackhi_epi16(b, zero);
+      }
+
+      __m128i ra = _mm_packs_epi32(StretchSSE2Block(a0, s, o), StretchSSE2Block(a1, s, o));
+      __m128i rb = _mm_packs_epi32(StretchSSE2Block(b0, s, o), StretchSSE2Block(b1, s, o));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_packus_epi16(ra, rb));
+    }
+
+    if (IsSigned)
+    {
+      StretchScalar(target + i, reinterpret_cast<const int16_t*>(source) + i, count - i, scale, offset);
+    }
+    else
+    {
+      StretchScalar(target + i, reinterpret_cast<const uint16_t*>(source) + i, count - i, scale, offset);
+    }
+  }
+
+
+  static inline void AddSSE2(void* target,
+                             __m128i values /* 4 x int32 */)
+  {
+    __m128i* p = reinterpret_cast<__m128i*>(target);
+    _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), values));
+  }
+
+
+  static void AccumulateRowSSE2(uint32_t* target,
+                                const uint8_t* source,
+                                size_t count)
+  {
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+      __m128i a = _mm_unpacklo_epi8(v, zero);
+      __m128i b = _mm_unpackhi_epi8(v, zero);
+      AddSSE2(target + i, _mm_unpacklo_epi16(a, zero));
+      AddSSE2(target + i + 4, _mm_unpackhi_epi16(a, zero));
+      AddSSE2(target + i + 8, _mm_unpacklo_epi16(b, zero));
+      AddSSE2(target + i + 12, _mm_unpackhi_epi16(b, zero));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  static void AccumulateRowSSE2(uint32_t* target,
+                                const uint16_t* source,
+                                size_t count)
+  {
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+      AddSSE2(target + i, _mm_unpacklo_epi16(v, zero));
+      AddSSE2(target + i + 4, _mm_unpackhi_epi16(v, zero));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  static void AccumulateRowSSE2(int32_t* target,
+                                const int16_t* source,
+                                size_t count)
+  {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+      AddSSE2(target + i, _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+      AddSSE2(target + i + 4, _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  // The first sample is predicted by "previous", the next ones are
+  // predicted by the unaligned load that is shifted by one sample
+  static void EncodeDeltaPlanesSSE2(uint8_t* lowPlane,
+                                    uint8_t* highPlane,
+                                    const uint16_t* source,
+                                    size_t count,
+                                    uint16_t previous)
+  {
+    const __m128i mask = _mm_set1_epi16(0xff);
+
+    EncodeDeltaPlanesScalar(lowPlane, highPlane, source, 1, previous);
+
+    size_t i = 1;
+    for (; i + 16 <= count; i += 16)
+    {
+      __m128i a = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i)),
+                                _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i - 1)));
+      __m128i b = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 8)),
+                                _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 7)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lowPlane + i),
+                       _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(highPlane + i),
+                       _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+
+    EncodeDeltaPlanesScalar(lowPlane + i, highPlane + i, source + i, count - i, source[i - 1]);
+  }
+
+
+  static void ConvertRGB48ToRGB24SSE2(uint8_t* target,
+                                      const uint16_t* source,
+                                      size_t count)
+  {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      __m128i a = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i)), 8);
+      __m128i b = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 8)), 8);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_packus_epi16(a, b));
+    }
+
+    ConvertRGB48ToRGB24Scalar(target + i, source + i, count - i);
+  }
+#endif
+
+
+
+  /**
+   * AVX2 implementations. The 256-bit pack instructions work on each
+   * 128-bit lane separately, hence the permutations.
+   **/
+
+#if ORTHANC_WEBVIEWER_HAS_AVX2 == 1
+  ORTHANC_WEBVIEWER_AVX2
+  static void GetMinMaxAVX2(uint16_t& minValue,
+                            uint16_t& maxValue,
+                            const uint16_t* source,
+                            size_t count)
+  {
+    __m256i low = _mm256_set1_epi16(static_cast<int16_t>(minValue));
+    __m256i high = _mm256_set1_epi16(static_cast<int16_t>(maxValue));
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+      low = _mm256_min_epu16(low, v);
+      high = _mm256_max_epu16(high, v);
+    }
+
+    uint16_t l[16], h[16];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(l), low);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(h), high);
+    GetMinMaxScalar(minValue, maxValue, l, 16);
+    GetMinMaxScalar(minValue, maxValue, h, 16);
+    GetMinMaxScalar(minValue, maxValue, source + i, count - i);
+  }
+
+
+  ORTHANC_WEBVIEWER_AVX2
+  static void GetMinMaxAVX2(int16_t& minValue,
+                            int16_t& maxValue,
+                            const int16_t* source,
+                            size_t count)
+  {
+    __m256i low = _mm256_set1_epi16(minValue);
+    __m256i high = _mm256_set1_epi16(maxValue);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+      low = _mm256_min_epi16(low, v);
+      high = _mm256_max_epi16(high, v);
+    }
+
+    int16_t l[16], h[16];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(l), low);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(h), high);
+    GetMinMaxScalar(minValue, maxValue, l, 16);
+    GetMinMaxScalar(minValue, maxValue, h, 16);
+    GetMinMaxScalar(minValue, maxValue, source + i, count - i);
+  }
+
+
+  ORTHANC_WEBVIEWER_AVX2
+  static inline __m256i StretchAVX2Block(__m256i values /* 8 x int32 */,
+                                         __m256 scale,
+                                         __m256 offset)
+  {
+    __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(values), scale), offset);
+    v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+    return _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_set1_ps(0.5f)));
+  }
+
+
+  template <bool IsSigned>
+  ORTHANC_WEBVIEWER_AVX2
+  static void StretchAVX2(uint8_t* target,
+                          const void* source,
+                          size_t count,
+                          float scale,
+                          float offset)
+  {
+    const __m256 s = _mm256_set1_ps(scale);
+    const __m256 o = _mm256_set1_ps(offset);
+
+    const __m128i* p = reinterpret_cast<const __m128i*>(source);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, p += 2)
+    {
+      __m128i a = _mm_loadu_si128(p);
+      __m128i b = _mm_loadu_si128(p + 1);
+
+      __m256i ra, rb;
+      if (IsSigned)
+      {
+        ra = StretchAVX2Block(_mm256_cvtepi16_epi32(a), s, o);
+        rb = StretchAVX2Block(_mm256_cvtepi16_epi32(b), s, o);
+      }
+      else
+      {
+        ra = StretchAVX2Block(_mm256_cvtepu16_epi32(a), s, o);
+        rb = StretchAVX2Block(_mm256_cvtepu16_epi32(b), s, o);
+      }
+
+      __m256i r = _mm256_permute4x64_epi64(_mm256_packs_epi32(ra, rb), 0xd8);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i),
+                       _mm_packus_epi16(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+    }
+
+    if (IsSigned)
+    {
+      StretchScalar(target + i, reinterpret_cast<const int16_t*>(source) + i, count - i, scale, offset);
+    }
+    else
+    {
+      StretchScalar(target + i, reinterpret_cast<const uint16_t*>(source) + i, count - i, scale, offset);
+    }
+  }
+
+
+  ORTHANC_WEBVIEWER_AVX2
+  static inline void AddAVX2(void* target,
+                             __m256i values /* 8 x int32 */)
+  {
+    __m256i* p = reinterpret_cast<__m256i*>(target);
+    _mm256_storeu_si256(p, _mm256_add_epi32(_mm256_loadu_si256(p), values));
+  }
+
+
+  ORTHANC_WEBVIEWER_AVX2
+  static void AccumulateRowAVX2(uint32_t* target,
+                                const uint8_t* source,
+                                size_t count)
+  {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      AddAVX2(target + i, _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(source + i))));
+      AddAVX2(target + i + 8, _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(source + i + 8))));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  ORTHANC_WEBVIEWER_AVX2
+  static void AccumulateRowAVX2(uint32_t* target,
+                                const uint16_t* source,
+                                size_t count)
+  {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      AddAVX2(target + i, _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i))));
+      AddAVX2(target + i + 8, _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 8))));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  ORTHANC_WEBVIEWER_AVX2
+  static void AccumulateRowAVX2(int32_t* target,
+                                const int16_t* source,
+                                size_t count)
+  {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      AddAVX2(target + i, _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i))));
+      AddAVX2(target + i + 8, _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 8))));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  ORTHANC_WEBVIEWER_AVX2
+  static void EncodeDeltaPlanesAVX2(uint8_t* lowPlane,
+                                    uint8_t* highPlane,
+                                    const uint16_t* source,
+                                    size_t count,
+                                    uint16_t previous)
+  {
+    const __m256i mask = _mm256_set1_epi16(0xff);
+
+    EncodeDeltaPlanesScalar(lowPlane, highPlane, source, 1, previous);
+
+    size_t i = 1;
+    for (; i + 32 <= count; i += 32)
+    {
+      __m256i a = _mm256_sub_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i)),
+                                   _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i - 1)));
+      __m256i b = _mm256_sub_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i + 16)),
+                                   _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i + 15)));
+      __m256i low = _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+      __m256i high = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lowPlane + i), _mm256_permute4x64_epi64(low, 0xd8));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(highPlane + i), _mm256_permute4x64_epi64(high, 0xd8));
+    }
+
+    EncodeDeltaPlanesScalar(lowPlane + i, highPlane + i, source + i, count - i, source[i - 1]);
+  }
+
+
+  ORTHANC_WEBVIEWER_AVX2
+  static void ConvertRGB48ToRGB24AVX2(uint8_t* target,
+                                      const uint16_t* source,
+                                      size_t count)
+  {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+      __m256i a = _mm256_srli_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i)), 8);
+      __m256i b = _mm256_srli_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i + 16)), 8);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i),
+                          _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+    }
+
+    ConvertRGB48ToRGB24Scalar(target + i, source + i, count - i);
+  }
+#endif
+
+
+
+  /**
+   * NEON implementations
+   **/
+
+#if ORTHANC_WEBVIEWER_HAS_NEON == 1
+  static void GetMinMaxNEON(uint16_t& minValue,
+                            uint16_t& maxValue,
+                            const uint16_t* source,
+                            size_t count)
+  {
+    uint16x8_t low = vdupq_n_u16(minValue);
+    uint16x8_t high = vdupq_n_u16(maxValue);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      uint16x8_t v = vld1q_u16(source + i);
+      low = vminq_u16(low, v);
+      high = vmaxq_u16(high, v);
+    }
+
+    uint16_t l[8], h[8];
+    vst1q_u16(l, low);
+    vst1q_u16(h, high);
+    GetMinMaxScalar(minValue, maxValue, l, 8);
+    GetMinMaxScalar(minValue, maxValue, h, 8);
+    GetMinMaxScalar(minValue, maxValue, source + i, count - i);
+  }
+
+
+  static void GetMinMaxNEON(int16_t& minValue,
+                            int16_t& maxValue,
+                            const int16_t* source,
+                            size_t count)
+  {
+    int16x8_t low = vdupq_n_s16(minValue);
+    int16x8_t high = vdupq_n_s16(maxValue);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      int16x8_t v = vld1q_s16(source + i);
+      low = vminq_s16(low, v);
+      high = vmaxq_s16(high, v);
+    }
+
+    int16_t l[8], h[8];
+    vst1q_s16(l, low);
+    vst1q_s16(h, high);
+    GetMinMaxScalar(minValue, maxValue, l, 8);
+    GetMinMaxScalar(minValue, maxValue, h, 8);
+    GetMinMaxScalar(minValue, maxValue, source + i, count - i);
+  }
+
+
+  static inline uint16x4_t StretchNEONBlock(float32x4_t values,
+                                            float32x4_t scale,
+                                            float32x4_t offset)
+  {
+    float32x4_t v = vaddq_f32(vmulq_f32(values, scale), offset);
+    v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(0.0f)), vdupq_n_f32(255.0f));
+    return vmovn_u32(vcvtq_u32_f32(vaddq_f32(v, vdupq_n_f32(0.5f))));
+  }
+
+
+  static void StretchNEON(uint8_t* target,
+                          const uint16_t* source,
+                          size_t count,
+                          float scale,
+                          float offset)
+  {
+    const float32x4_t s = vdupq_n_f32(scale);
+    const float32x4_t o = vdupq_n_f32(offset);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      uint16x8_t v = vld1q_u16(source + i);
+      uint16x4_t a = StretchNEONBlock(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), s, o);
+      uint16x4_t b = StretchNEONBlock(vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))), s, o);
+      vst1_u8(target + i, vmovn_u16(vcombine_u16(a, b)));
+    }
+
+    StretchScalar(target + i, source + i, count - i, scale, offset);
+  }
+
+
+  static void StretchNEON(uint8_t* target,
+                          const int16_t* source,
+                          size_t count,
+                          float scale,
+                          float offset)
+  {
+    const float32x4_t s = vdupq_n_f32(scale);
+    const float32x4_t o = vdupq_n_f32(offset);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      int16x8_t v = vld1q_s16(source + i);
+      uint16x4_t a = StretchNEONBlock(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), s, o);
+      uint16x4_t b = StretchNEONBlock(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), s, o);
+      vst1_u8(target + i, vmovn_u16(vcombine_u16(a, b)));
+    }
+
+    StretchScalar(target + i, source + i, count - i, scale, offset);
+  }
+
+
+  static void AccumulateRowNEON(uint32_t* target,
+                                const uint8_t* source,
+                                size_t count)
+  {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      uint16x8_t v = vmovl_u8(vld1_u8(source + i));
+      vst1q_u32(target + i, vaddw_u16(vld1q_u32(target + i), vget_low_u16(v)));
+      vst1q_u32(target + i + 4, vaddw_u16(vld1q_u32(target + i + 4), vget_high_u16(v)));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  static void AccumulateRowNEON(uint32_t* target,
+                                const uint16_t* source,
+                                size_t count)
+  {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      uint16x8_t v = vld1q_u16(source + i);
+      vst1q_u32(target + i, vaddw_u16(vld1q_u32(target + i), vget_low_u16(v)));
+      vst1q_u32(target + i + 4, vaddw_u16(vld1q_u32(target + i + 4), vget_high_u16(v)));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  static void AccumulateRowNEON(int32_t* target,
+                                const int16_t* source,
+                                size_t count)
+  {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      int16x8_t v = vld1q_s16(source + i);
+      vst1q_s32(target + i, vaddw_s16(vld1q_s32(target + i), vget_low_s16(v)));
+      vst1q_s32(target + i + 4, vaddw_s16(vld1q_s32(target + i + 4), vget_high_s16(v)));
+    }
+
+    AccumulateRowScalar(target + i, source + i, count - i);
+  }
+
+
+  static void EncodeDeltaPlanesNEON(uint8_t* lowPlane,
+                                    uint8_t* highPlane,
+                                    const uint16_t* source,
+                                    size_t count,
+                                    uint16_t previous)
+  {
+    EncodeDeltaPlanesScalar(lowPlane, highPlane, source, 1, previous);
+
+    size_t i = 1;
+    for (; i + 16 <= count; i += 16)
+    {
+      uint16x8_t a = vsubq_u16(vld1q_u16(source + i), vld1q_u16(source + i - 1));
+      uint16x8_t b = vsubq_u16(vld1q_u16(source + i + 8), vld1q_u16(source + i + 7));
+      vst1q_u8(lowPlane + i, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+      vst1q_u8(highPlane + i, vcombine_u8(vshrn_n_u16(a, 8), vshrn_n_u16(b, 8)));
+    }
+
+    EncodeDeltaPlanesScalar(lowPlane + i, highPlane + i, source + i, count - i, source[i - 1]);
+  }
+
+
+  static void ConvertRGB48ToRGB24NEON(uint8_t* target,
+                                      const uint16_t* source,
+                                      size_t count)
+  {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      uint8x8_t a = vshrn_n_u16(vld1q_u16(source + i), 8);
+      uint8x8_t b = vshrn_n_u16(vld1q_u16(source + i + 8), 8);
+      vst1q_u8(target + i, vcombine_u8(a, b));
+    }
+
+    ConvertRGB48ToRGB24Scalar(target + i, source + i, count - i);
+  }
+#endif
+
+
+
+  /**
+   * Dispatching
+   **/
+
+  static SimdLevel DetectSimdLevel()
+  {
+#if ORTHANC_WEBVIEWER_HAS_AVX2 == 1
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      return SimdLevel_AVX2;
+    }
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1
+    return SimdLevel_SSE2;
+#elif ORTHANC_WEBVIEWER_HAS_NEON == 1
+    return SimdLevel_NEON;
+#else
+    return SimdLevel_None;
+#endif
+  }
+
+
+  SimdLevel GetBestSimdLevel()
+  {
+    static const SimdLevel level = DetectSimdLevel();
+    return level;
+  }
+
+
+  const char* EnumerationToString(SimdLevel level)
+  {
+    switch (level)
+    {
+      case SimdLevel_SSE2:
+        return "SSE2";
+
+      case SimdLevel_AVX2:
+        return "AVX2";
+
+      case SimdLevel_NEON:
+        return "NEON";
+
+      default:
+        return "none";
+    }
+  }
+
+
+  void GetMinMaxValue(uint16_t& minValue,
+                      uint16_t& maxValue,
+                      const uint16_t* source,
+                      size_t count,
+                      SimdLevel level)
+  {
+    minValue = source[0];
+    maxValue = source[0];
+
+    switch (level)
+    {
+#if ORTHANC_WEBVIEWER_HAS_AVX2 == 1
+      case SimdLevel_AVX2:
+        GetMinMaxAVX2(minValue, maxValue, source, count);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1
+      case SimdLevel_SSE2:
+      {
+        int16_t a = static_cast<int16_t>(minValue);
+        int16_t b = static_cast<int16_t>(maxValue);
+        GetMinMaxSSE2(a, b, reinterpret_cast<const int16_t*>(source), count, static_cast<int16_t>(0x8000));
+        minValue = static_cast<uint16_t>(a);
+        maxValue = static_cast<uint16_t>(b);
+        return;
+      }
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_NEON == 1
+      case SimdLevel_NEON:
+        GetMinMaxNEON(minValue, maxValue, source, count);
+        return;
+#endif
+
+      default:
+        GetMinMaxScalar(minValue, maxValue, source, count);
+    }
+  }
+
+
+  void GetMinMaxValue(int16_t& minValue,
+                      int16_t& maxValue,
+                      const int16_t* source,
+                      size_t count,
+                      SimdLevel level)
+  {
+    minValue = source[0];
+    maxValue = source[0];
+
+    switch (level)
+    {
+#if ORTHANC_WEBVIEWER_HAS_AVX2 == 1
+      case SimdLevel_AVX2:
+        GetMinMaxAVX2(minValue, maxValue, source, count);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1
+      case SimdLevel_SSE2:
+        GetMinMaxSSE2(minValue, maxValue, source, count, 0);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_NEON == 1
+      case SimdLevel_NEON:
+        GetMinMaxNEON(minValue, maxValue, source, count);
+        return;
+#endif
+
+      default:
+        GetMinMaxScalar(minValue, maxValue, source, count);
+    }
+  }
+
+
+  template <bool IsSigned, typename SourceType>
+  static void StretchInternal(uint8_t* target,
+                              const SourceType* source,
+                              size_t count,
+                              int32_t low,
+                              int32_t high,
+                              SimdLevel level)
+  {
+    if (high <= low)
+    {
+      memset(target, 0, count);
+      return;
+    }
+
+    // Same arithmetic as in the scalar implementation, so that all
+    // the implementations give the same result
+    const float scale = 255.0f / static_cast<float>(high - low);
+    const float offset = -scale * static_cast<float>(low);
+
+    switch (level)
+    {
+#if ORTHANC_WEBVIEWER_HAS_AVX2 == 1
+      case SimdLevel_AVX2:
+        StretchAVX2<IsSigned>(target, source, count, scale, offset);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1
+      case SimdLevel_SSE2:
+        StretchSSE2<IsSigned>(target, source, count, scale, offset);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_NEON == 1
+      case SimdLevel_NEON:
+        StretchNEON(target, source, count, scale, offset);
+        return;
+#endif
+
+      default:
+        StretchScalar(target, source, count, scale, offset);
+    }
+  }
+
+
+  void StretchToGrayscale8(uint8_t* target,
+                           const uint16_t* source,
+                           size_t count,
+                           int32_t low,
+                           int32_t high,
+                           SimdLevel level)
+  {
+    StretchInternal<false>(target, source, count, low, high, level);
+  }
+
+
+  void StretchToGrayscale8(uint8_t* target,
+                           const int16_t* source,
+                           size_t count,
+                           int32_t low,
+                           int32_t high,
+                           SimdLevel level)
+  {
+    StretchInternal<true>(target, source, count, low, high, level);
+  }
+
+
+  template <typename TargetType, typename SourceType>
+  static void AccumulateRowInternal(TargetType* target,
+                                    const SourceType* source,
+                                    size_t count,
+                                    SimdLevel level)
+  {
+    switch (level)
+    {
+#if ORTHANC_WEBVIEWER_HAS_AVX2 == 1
+      case SimdLevel_AVX2:
+        AccumulateRowAVX2(target, source, count);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1
+      case SimdLevel_SSE2:
+        AccumulateRowSSE2(target, source, count);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_NEON == 1
+      case SimdLevel_NEON:
+        AccumulateRowNEON(target, source, count);
+        return;
+#endif
+
+      default:
+        AccumulateRowScalar(target, source, count);
+    }
+  }
+
+
+  void AccumulateRow(uint32_t* target,
+                     const uint8_t* source,
+                     size_t count,
+                     SimdLevel level)
+  {
+    AccumulateRowInternal(target, source, count, level);
+  }
+
+
+  void AccumulateRow(uint32_t* target,
+                     const uint16_t* source,
+                     size_t count,
+                     SimdLevel level)
+  {
+    AccumulateRowInternal(target, source, count, level);
+  }
+
+
+  void AccumulateRow(int32_t* target,
+                     const int16_t* source,
+                     size_t count,
+                     SimdLevel level)
+  {
+    AccumulateRowInternal(target, source, count, level);
+  }
+
+
+  void ConvertRGB48ToRGB24(uint8_t* target,
+                           const uint16_t* source,
+                           size_t count,
+                           SimdLevel level)
+  {
+    switch (level)
+    {
+#if ORTHANC_WEBVIEWER_HAS_AVX2 == 1
+      case SimdLevel_AVX2:
+        ConvertRGB48ToRGB24AVX2(target, source, count);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1
+      case SimdLevel_SSE2:
+        ConvertRGB48ToRGB24SSE2(target, source, count);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_NEON == 1
+      case SimdLevel_NEON:
+        ConvertRGB48ToRGB24NEON(target, source, count);
+        return;
+#endif
+
+      default:
+        ConvertRGB48ToRGB24Scalar(target, source, count);
+    }
+  }
+
+
+  void EncodeDeltaPlanes(uint8_t* lowPlane,
+                         uint8_t* highPlane,
+                         const uint16_t* source,
+                         size_t count,
+                         uint16_t previous,
+                         SimdLevel level)
+  {
+    if (count == 0)
+    {
+      return;
+    }
+
+    switch (level)
+    {
+#if ORTHANC_WEBVIEWER_HAS_AVX2 == 1
+      case SimdLevel_AVX2:
+        EncodeDeltaPlanesAVX2(lowPlane, highPlane, source, count, previous);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_SSE2 == 1
+      case SimdLevel_SSE2:
+        EncodeDeltaPlanesSSE2(lowPlane, highPlane, source, count, previous);
+        return;
+#endif
+
+#if ORTHANC_WEBVIEWER_HAS_NEON == 1
+      case SimdLevel_NEON:
+        EncodeDeltaPlanesNEON(lowPlane, highPlane, source, count, previous);
+        return;
+#endif
+
+      default:
+        EncodeDeltaPlanesScalar(lowPlane, highPlane, source, count, previous);
+    }
+  }
+}
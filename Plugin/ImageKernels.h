@@ -0,0 +1,124 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace OrthancPlugins
+{
+  /**
+   * Low-level kernels that are applied to the decoded frames before
+   * their compression. Each kernel has a scalar implementation, that
+   * is the reference, and vectorized implementations that produce
+   * the same results. The instruction set is chosen at runtime on
+   * x86 (SSE2 or AVX2), and at compile time on ARM (NEON).
+   **/
+  enum SimdLevel
+  {
+    SimdLevel_None,  // Scalar reference implementation
+    SimdLevel_SSE2,
+    SimdLevel_AVX2,
+    SimdLevel_NEON
+  };
+
+  // The most efficient instruction set that is supported by both
+  // this build and the CPU. A kernel must never be called with an
+  // instruction set that is not supported by the CPU.
+  SimdLevel GetBestSimdLevel();
+
+  const char* EnumerationToString(SimdLevel level);
+
+  void GetMinMaxValue(uint16_t& minValue,
+                      uint16_t& maxValue,
+                      const uint16_t* source,
+                      size_t count,  // Must be > 0
+                      SimdLevel level);
+
+  void GetMinMaxValue(int16_t& minValue,
+                      int16_t& maxValue,
+                      const int16_t* source,
+                      size_t count,  // Must be > 0
+                      SimdLevel level);
+
+  /**
+   * Linearly maps the range [low, high] of the source values onto
+   * [0, 255], rounding to the nearest integer and saturating the
+   * values outside of the range. If "high <= low", the target is
+   * filled with zeros.
+   **/
+  void StretchToGrayscale8(uint8_t* target,
+                           const uint16_t* source,
+                           size_t count,
+                           int32_t low,
+                           int32_t high,
+                           SimdLevel level);
+
+  void StretchToGrayscale8(uint8_t* target,
+                           const int16_t* source,
+                           size_t count,
+                           int32_t low,
+                           int32_t high,
+                           SimdLevel level);
+
+  // Adds the values of one row to an array of accumulators. This is
+  // the vertical pass of the box downscaling.
+  void AccumulateRow(uint32_t* target,
+                     const uint8_t* source,
+                     size_t count,
+                     SimdLevel level);
+
+  void AccumulateRow(uint32_t* target,
+                     const uint16_t* source,
+                     size_t count,
+                     SimdLevel level);
+
+  void AccumulateRow(int32_t* target,
+                     const int16_t* source,
+                     size_t count,
+                     SimdLevel level);
+
+  // Keeps the most significant byte of each channel. "count" is the
+  // number of channels, i.e. 3 times the number of RGB48 pixels.
+  void ConvertRGB48ToRGB24(uint8_t* target,
+                           const uint16_t* source,
+                           size_t count,
+                           SimdLevel level);
+
+  /**
+   * Lossless predictive transform of 16-bit samples, that makes them
+   * much more compressible by zlib. The difference between each
+   * sample and its predecessor (modulo 2^16, which also holds for
+   * the signed samples) is split into its least significant byte,
+   * that is written to "lowPlane", and its most significant byte,
+   * that is written to "highPlane". "previous" is the sample that
+   * precedes "source[0]".
+   **/
+  void EncodeDeltaPlanes(uint8_t* lowPlane,
+                         uint8_t* highPlane,
+                         const uint16_t* source,
+                         size_t count,
+                         uint16_t previous,
+                         SimdLevel level);
+}
@@ -23,16 +23,21 @@
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 #include "ViewerToolbox.h"
+#include "CachePrewarmer.h"
 #include "ViewerPrefetchPolicy.h"
 #include "DecodedImageAdapter.h"
-#include "SeriesInformationAdapter.h"
+#include "DecodingMetrics.h"
+#include "ImageKernels.h"
 
 #include <DicomFormat/DicomMap.h>
 #include <Logging.h>
+#include <MultiThreading/SharedMessageQueue.h>
 #include <OrthancException.h>
 #include <SystemToolbox.h>
 #include <Toolbox.h>
 
+#include <algorithm>
+#include <map>
 #include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
 #include <EmbeddedResources.h>
@@ -40,6 +45,9 @@
 
 #define ORTHANC_PLUGIN_NAME "web-viewer"
 
+// Must be changed whenever the format of the cached decoded images changes
+#define DECODED_IMAGE_FORMAT "binary-3"
+
 
 /**
  * We force the redefinition of the "ORTHANC_PLUGINS_API" macro, that
@@ -60,6 +68,17 @@
 
 
 
+/**
+ * During an acquisition, the instances of a series arrive in bursts.
+ * The information about the series is only updated once no instance
+ * has been received for "SERIES_UPDATE_DELAY", or at the latest
+ * after "SERIES_UPDATE_MAX_DELAY" if the acquisition goes on, instead
+ * of being invalidated for each instance.
+ **/
+static const unsigned int SERIES_UPDATE_DELAY = 2000;       // In milliseconds
+static const unsigned int SERIES_UPDATE_MAX_DELAY = 10000;  // In milliseconds
+
+
 class CacheContext
 {
 private:
@@ -84,13 +103,60 @@ private:
 
   std::unique_ptr<OrthancPlugins::CacheManager>  cache_;
   std::unique_ptr<OrthancPlugins::CacheScheduler>  scheduler_;
+  std::unique_ptr<OrthancPlugins::CachePrewarmer>  prewarmer_;
+  bool prewarmSeries_;
+  bool prewarmStudies_;
+
+  // Series that have received new instances, and whose information
+  // must be updated, together with their first and last arrivals
+  struct ModifiedSeries
+  {
+    boost::posix_time::ptime  first_;
+    boost::posix_time::ptime  last_;
+  };
+
+  typedef std::map<std::string, ModifiedSeries>  ModifiedSeriesMap;
 
   Orthanc::SharedMessageQueue  newInstances_;
   bool stop_;
   boost::thread newInstancesThread_;
 
+  void UpdateModifiedSeries(ModifiedSeriesMap& modified)
+  {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    ModifiedSeriesMap::iterator it = modified.begin();
+    while (it != modified.end())
+    {
+      if (now - it->second.last_ >= boost::posix_time::milliseconds(SERIES_UPDATE_DELAY) ||
+          now - it->second.first_ >= boost::posix_time::milliseconds(SERIES_UPDATE_MAX_DELAY))
+      {
+        if (GetScheduler().IsCached(OrthancPlugins::CacheBundle_SeriesInformation, it->first))
+        {
+          // Rebuild the information in the background, while the
+          // previous version keeps being served to the viewers
+          GetScheduler().Refresh(OrthancPlugins::CacheBundle_SeriesInformation, it->first);
+        }
+        else
+        {
+          // Nobody has looked at this series yet, or its information
+          // is being generated from obsolete data
+          GetScheduler().Invalidate(OrthancPlugins::CacheBundle_SeriesInformation, it->first);
+        }
+
+        modified.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
   static void NewInstancesThread(CacheContext* cache)
   {
+    ModifiedSeriesMap modified;
+
     while (!cache->stop_)
     {
       std::unique_ptr<Orthanc::IDynamicObject> obj(cache->newInstances_.Dequeue(100));
@@ -98,21 +164,59 @@ private:
       {
         const std::string& instanceId = dynamic_cast<DynamicString&>(*obj).GetValue();
 
-        // On the reception of a new instance, indalidate the parent series of the instance
+        // On the reception of a new instance, mark the parent series of the instance as modified
         std::string uri = "/instances/" + std::string(instanceId);
         Json::Value instance;
         if (OrthancPlugins::GetJsonFromOrthanc(instance, OrthancPlugins::GetGlobalContext(), uri))
         {
-          std::string seriesId = instance["ParentSeries"].asString();
-          cache->GetScheduler().Invalidate(OrthancPlugins::CacheBundle_SeriesInformation, seriesId);
+          const std::string seriesId = instance["ParentSeries"].asString();
+          const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+          ModifiedSeriesMap::iterator found = modified.find(seriesId);
+          if (found == modified.end())
+          {
+            ModifiedSeries& series = modified[seriesId];
+            series.first_ = now;
+            series.last_ = now;
+          }
+          else
+          {
+            found->second.last_ = now;
+          }
         }
       }
+
+      try
+      {
+        cache->UpdateModifiedSeries(modified);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot update the information about a series: " << e.What();
+      }
+    }
+
+    // Do not leave obsolete information in the cache on shutdown
+    try
+    {
+      for (ModifiedSeriesMap::const_iterator it = modified.begin(); it != modified.end(); ++it)
+      {
+        cache->GetScheduler().Invalidate(OrthancPlugins::CacheBundle_SeriesInformation, it->first);
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Cannot invalidate the information about a series: " << e.What();
     }
   }
 
 
 public:
-  explicit CacheContext(const std::string& path) : storage_(path), stop_(false)
+  explicit CacheContext(const std::string& path) :
+    storage_(path),
+    prewarmSeries_(false),
+    prewarmStudies_(false),
+    stop_(false)
   {
     boost::filesystem::path p(path);
     db_.Open((p / "cache.db").string());
@@ -120,7 +224,14 @@ public:
     cache_.reset(new OrthancPlugins::CacheManager(OrthancPlugins::GetGlobalContext(), db_, storage_));
     //cache_->SetSanityCheckEnabled(true);  // For debug
 
-    scheduler_.reset(new OrthancPlugins::CacheScheduler(*cache_, 100));
+    // The prefetch queue is shared by all the clients, and each access
+    // of a client queues up to about 200 jobs (its previews and its
+    // full-resolution slices). As this LIFO queue drops its oldest jobs
+    // once full, i.e. the lowest priorities of the least recent
+    // accesses, the former limit of 100 jobs dropped the prefetchings
+    // of the other clients. A queued job is only an index in the
+    // cache, hence the small memory cost.
+    scheduler_.reset(new OrthancPlugins::CacheScheduler(*cache_, 1000));
 
     newInstancesThread_ = boost::thread(NewInstancesThread, this);
   }
@@ -133,6 +244,7 @@ public:
       newInstancesThread_.join();
     }
 
+    prewarmer_.reset(NULL);
     scheduler_.reset(NULL);
     cache_.reset(NULL);
   }
@@ -146,12 +258,48 @@ public:
   {
     newInstances_.Enqueue(new DynamicString(instanceId));
   }
+
+  void EnablePrewarming(bool series,
+                        bool studies,
+                        unsigned int maxFramesPerSeries,
+                        unsigned int maxFramesPerHour)
+  {
+    if (series || studies)
+    {
+      prewarmSeries_ = series;
+      prewarmStudies_ = studies;
+      prewarmer_.reset(new OrthancPlugins::CachePrewarmer(OrthancPlugins::GetGlobalContext(), *scheduler_,
+                                                          maxFramesPerSeries, maxFramesPerHour));
+    }
+  }
+
+  void SignalStableSeries(const char* seriesId)
+  {
+    if (prewarmSeries_)
+    {
+      prewarmer_->SignalStableSeries(seriesId);
+    }
+  }
+
+  void SignalStableStudy(const char* studyId)
+  {
+    if (prewarmStudies_)
+    {
+      prewarmer_->SignalStableStudy(studyId);
+    }
+  }
 };
 
 
 
 static CacheContext* cache_ = NULL;
 
+// Whether the answers of the cache report their breakdown in a "Server-Timing" header
+static bool serverTiming_ = false;
+
+// Number of generated items whose timings are kept for "Server-Timing"
+static const size_t MAX_ITEM_TIMINGS = 1000;
+
 
 
 static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
@@ -165,6 +313,16 @@ static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeTyp
     {
       cache_->SignalNewInstance(resourceId);
     }
+    else if (changeType == OrthancPluginChangeType_StableSeries &&
+             resourceType == OrthancPluginResourceType_Series)
+    {
+      cache_->SignalStableSeries(resourceId);
+    }
+    else if (changeType == OrthancPluginChangeType_StableStudy &&
+             resourceType == OrthancPluginResourceType_Study)
+    {
+      cache_->SignalStableStudy(resourceId);
+    }
 
     return OrthancPluginErrorCode_Success;
   }
@@ -177,7 +335,277 @@ static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeTyp
 
 
 
-template <enum OrthancPlugins::CacheBundle bundle>
+// The bundles whose statistics are reported, with their name in the metrics
+static const struct
+{
+  OrthancPlugins::CacheBundle  bundle_;
+  const char*                  name_;
+  const char*                  metricsPrefix_;
+} METRICS_BUNDLES[] =
+{
+  { OrthancPlugins::CacheBundle_DecodedImage, "DecodedImages", "orthanc_webviewer_decoded" },
+  { OrthancPlugins::CacheBundle_SeriesInformation, "SeriesInformation", "orthanc_webviewer_series" },
+  { OrthancPlugins::CacheBundle_PreviewImage, "Previews", "orthanc_webviewer_previews" },
+  { OrthancPlugins::CacheBundle_Tile, "Tiles", "orthanc_webviewer_tiles" }
+};
+
+static const size_t METRICS_BUNDLES_COUNT = sizeof(METRICS_BUNDLES) / sizeof(METRICS_BUNDLES[0]);
+
+
+static void FormatQueueMetrics(Json::Value& target,
+                               OrthancPlugins::CacheScheduler::Priority priority)
+{
+  OrthancPlugins::CacheScheduler::QueueStatistics statistics;
+  cache_->GetScheduler().GetQueueStatistics(statistics, priority);
+
+  target = Json::objectValue;
+  target["Depth"] = static_cast<Json::Value::UInt64>(statistics.queueDepth);
+  target["Dequeued"] = static_cast<Json::Value::UInt64>(statistics.dequeuedCount);
+  target["TotalWaitMs"] = static_cast<double>(statistics.totalWaitMicroseconds) / 1000.0;
+  target["MaxWaitMs"] = static_cast<double>(statistics.maxWaitMicroseconds) / 1000.0;
+}
+
+
+// Counters since the startup, as answered by "/web-viewer/metrics"
+static void FormatMetrics(Json::Value& target)
+{
+  target = Json::objectValue;
+
+  Json::Value bundles = Json::objectValue;
+
+  for (size_t i = 0; i < METRICS_BUNDLES_COUNT; i++)
+  {
+    OrthancPlugins::CacheScheduler::AccessStatistics accesses;
+    cache_->GetScheduler().GetAccessStatistics(accesses, METRICS_BUNDLES[i].bundle_);
+
+    OrthancPlugins::CacheManager::BundleStatistics cached;
+    cache_->GetScheduler().GetBundleStatistics(cached, METRICS_BUNDLES[i].bundle_);
+
+    Json::Value bundle = Json::objectValue;
+    bundle["MemoryHits"] = static_cast<Json::Value::UInt64>(accesses.memoryHits);
+    bundle["DiskHits"] = static_cast<Json::Value::UInt64>(accesses.diskHits);
+    bundle["Misses"] = static_cast<Json::Value::UInt64>(accesses.misses);
+    bundle["Items"] = static_cast<Json::Value::UInt64>(cached.count);
+    bundle["Bytes"] = static_cast<Json::Value::UInt64>(cached.space);
+    bundle["Evictions"] = static_cast<Json::Value::UInt64>(cached.evictedCount);
+    bundle["Prefetched"] = static_cast<Json::Value::UInt64>(accesses.prefetchedCount);
+    bundle["PrefetchUsed"] = static_cast<Json::Value::UInt64>(accesses.prefetchUsed);
+    bundle["PrefetchWasted"] = static_cast<Json::Value::UInt64>(accesses.prefetchWasted);
+    bundle["PrefetchCancelled"] = static_cast<Json::Value::UInt64>(accesses.prefetchCancelled);
+    bundles[METRICS_BUNDLES[i].name_] = bundle;
+  }
+
+  target["Bundles"] = bundles;
+
+  Json::Value queues = Json::objectValue;
+  FormatQueueMetrics(queues["Interactive"], OrthancPlugins::CacheScheduler::Priority_Interactive);
+  FormatQueueMetrics(queues["Prefetch"], OrthancPlugins::CacheScheduler::Priority_Prefetch);
+  target["Queues"] = queues;
+
+  Json::Value stages = Json::objectValue;
+
+  for (unsigned int i = 0; i < OrthancPlugins::DECODING_STAGES_COUNT; i++)
+  {
+    const OrthancPlugins::DecodingStage stage = static_cast<OrthancPlugins::DecodingStage>(i);
+
+    OrthancPlugins::LatencyHistogram latency;
+    OrthancPlugins::GetDecodingStageLatency(latency, stage);
+    latency.Format(stages[OrthancPlugins::EnumerationToString(stage)]);
+  }
+
+  target["Stages"] = stages;
+}
+
+
+#if HAS_ORTHANC_PLUGIN_METRICS == 1
+static void PublishQueueMetrics(OrthancPlugins::CacheScheduler::Priority priority,
+                                const std::string& prefix,
+                                OrthancPlugins::CacheScheduler::QueueStatistics& previous)
+{
+  OrthancPlugins::CacheScheduler::QueueStatistics current;
+  cache_->GetScheduler().GetQueueStatistics(current, priority);
+
+  // The wait time is averaged over the jobs that were dequeued since
+  // the previous refresh of the metrics
+  float averageWait = 0;
+  if (current.dequeuedCount > previous.dequeuedCount)
+  {
+    averageWait = (static_cast<float>(current.totalWaitMicroseconds - previous.totalWaitMicroseconds) /
+                   static_cast<float>(current.dequeuedCount - previous.dequeuedCount) / 1000.0f);
+  }
+
+  OrthancPlugins::SetMetricsValue((prefix + "_depth").c_str(), static_cast<float>(current.queueDepth));
+  OrthancPlugins::SetMetricsValue((prefix + "_wait_ms").c_str(), averageWait);
+
+  previous = current;
+}
+
+
+static void PublishBundleMetrics(OrthancPlugins::CacheBundle bundle,
+                                 const std::string& prefix)
+{
+  OrthancPlugins::CacheScheduler::AccessStatistics accesses;
+  cache_->GetScheduler().GetAccessStatistics(accesses, bundle);
+
+  OrthancPlugins::CacheManager::BundleStatistics cached;
+  cache_->GetScheduler().GetBundleStatistics(cached, bundle);
+
+  OrthancPlugins::SetMetricsValue((prefix + "_memory_hits").c_str(), static_cast<float>(accesses.memoryHits));
+  OrthancPlugins::SetMetricsValue((prefix + "_disk_hits").c_str(), static_cast<float>(accesses.diskHits));
+  OrthancPlugins::SetMetricsValue((prefix + "_misses").c_str(), static_cast<float>(accesses.misses));
+  OrthancPlugins::SetMetricsValue((prefix + "_items").c_str(), static_cast<float>(cached.count));
+  OrthancPlugins::SetMetricsValue((prefix + "_size_mb").c_str(), static_cast<float>(cached.space) / (1024.0f * 1024.0f));
+  OrthancPlugins::SetMetricsValue((prefix + "_evictions").c_str(), static_cast<float>(cached.evictedCount));
+  OrthancPlugins::SetMetricsValue((prefix + "_prefetched").c_str(), static_cast<float>(accesses.prefetchedCount));
+  OrthancPlugins::SetMetricsValue((prefix + "_prefetch_used").c_str(), static_cast<float>(accesses.prefetchUsed));
+  OrthancPlugins::SetMetricsValue((prefix + "_prefetch_wasted").c_str(), static_cast<float>(accesses.prefetchWasted));
+  OrthancPlugins::SetMetricsValue((prefix + "_prefetch_cancelled").c_str(), static_cast<float>(accesses.prefetchCancelled));
+}
+
+
+static void PublishStageMetrics(OrthancPlugins::DecodingStage stage,
+                                OrthancPlugins::LatencyHistogram& previous)
+{
+  OrthancPlugins::LatencyHistogram current;
+  OrthancPlugins::GetDecodingStageLatency(current, stage);
+
+  std::string prefix = OrthancPlugins::EnumerationToString(stage);
+  Orthanc::Toolbox::ToLowerCase(prefix);
+  prefix = "orthanc_webviewer_stage_" + prefix;
+
+  // Same as the queues, the latency is averaged since the previous refresh
+  float average = 0;
+  if (current.GetCount() > previous.GetCount())
+  {
+    average = (static_cast<float>(current.GetTotalMicroseconds() - previous.GetTotalMicroseconds()) /
+               static_cast<float>(current.GetCount() - previous.GetCount()) / 1000.0f);
+  }
+
+  OrthancPlugins::SetMetricsValue((prefix + "_count").c_str(), static_cast<float>(current.GetCount()));
+  OrthancPlugins::SetMetricsValue((prefix + "_ms").c_str(), average);
+
+  previous = current;
+}
+
+
+static void RefreshMetrics()
+{
+  static OrthancPlugins::CacheScheduler::QueueStatistics interactive = { 0, 0, 0, 0 };
+  static OrthancPlugins::CacheScheduler::QueueStatistics prefetch = { 0, 0, 0, 0 };
+  static OrthancPlugins::LatencyHistogram stages[OrthancPlugins::DECODING_STAGES_COUNT];
+
+  if (cache_ != NULL)
+  {
+    PublishQueueMetrics(OrthancPlugins::CacheScheduler::Priority_Interactive,
+                        "orthanc_webviewer_queue_interactive", interactive);
+    PublishQueueMetrics(OrthancPlugins::CacheScheduler::Priority_Prefetch,
+                        "orthanc_webviewer_queue_prefetch", prefetch);
+
+    for (size_t i = 0; i < METRICS_BUNDLES_COUNT; i++)
+    {
+      PublishBundleMetrics(METRICS_BUNDLES[i].bundle_, METRICS_BUNDLES[i].metricsPrefix_);
+    }
+  }
+
+  for (unsigned int i = 0; i < OrthancPlugins::DECODING_STAGES_COUNT; i++)
+  {
+    PublishStageMetrics(static_cast<OrthancPlugins::DecodingStage>(i), stages[i]);
+  }
+}
+#endif
+
+
+
+enum CacheAnswer
+{
+  CacheAnswer_Json,          // The cached item is a JSON document
+  CacheAnswer_Binary,        // The cached item is a decoded image, sent in its binary format
+  CacheAnswer_BinaryToJson   // The cached item is a decoded image, converted to JSON
+};
+
+
+static std::string GetArgument(const OrthancPluginHttpRequest* request,
+                               const std::string& key,
+                               const std::string& defaultValue)
+{
+  for (uint32_t i = 0; i < request->getCount; i++)
+  {
+    if (key == request->getKeys[i])
+    {
+      return request->getValues[i];
+    }
+  }
+
+  return defaultValue;
+}
+
+
+static void AddServerTiming(std::string& target,
+                            const char* name,
+                            const char* description,
+                            uint64_t microseconds)
+{
+  char buffer[128];
+  sprintf(buffer, "%s;desc=\"%s\";dur=%.3f", name, description,
+          static_cast<double>(microseconds) / 1000.0);
+
+  if (!target.empty())
+  {
+    target += ", ";
+  }
+
+  target += buffer;
+}
+
+
+static void AddServerTiming(std::string& target,
+                            const OrthancPlugins::DecodingTimings& timings,
+                            OrthancPlugins::DecodingStage stage,
+                            const char* description)
+{
+  // The stages that were not run (e.g. the decoding of a frame that
+  // was still in memory) are not reported
+  if (timings.GetMicroseconds(stage) != 0)
+  {
+    std::string name = OrthancPlugins::EnumerationToString(stage);
+    Orthanc::Toolbox::ToLowerCase(name);
+    AddServerTiming(target, name.c_str(), description, timings.GetMicroseconds(stage));
+  }
+}
+
+
+// Formats the "Server-Timing" header, in milliseconds: The stages of
+// the decoding pool are only known if the item was missing
+static void FormatServerTiming(std::string& target,
+                               const OrthancPlugins::CacheScheduler::AccessTimings& access,
+                               const OrthancPlugins::DecodingTimings& serialization,
+                               const std::string& item)
+{
+  target.clear();
+
+  AddServerTiming(target, "cache", "Cache lookup", access.lookupMicroseconds);
+
+  if (access.isGenerated)
+  {
+    AddServerTiming(target, "wait", "Wait for the decoding pool", access.waitMicroseconds);
+
+    OrthancPlugins::DecodingTimings decoding;
+    if (OrthancPlugins::LookupItemTimings(decoding, item))
+    {
+      AddServerTiming(target, decoding, OrthancPlugins::DecodingStage_Fetch, "DICOM fetch");
+      AddServerTiming(target, decoding, OrthancPlugins::DecodingStage_Decode, "Decoding");
+      AddServerTiming(target, decoding, OrthancPlugins::DecodingStage_MinMax, "Pixel range");
+      AddServerTiming(target, decoding, OrthancPlugins::DecodingStage_Stretch, "Stretching");
+      AddServerTiming(target, decoding, OrthancPlugins::DecodingStage_Encode, "Encoding");
+    }
+  }
+
+  AddServerTiming(target, serialization, OrthancPlugins::DecodingStage_Json, "Serialization");
+}
+
+
+template <enum OrthancPlugins::CacheBundle bundle,
+          enum CacheAnswer answer>
 static OrthancPluginErrorCode ServeCache(OrthancPluginRestOutput* output,
                                          const char* url,
                                          const OrthancPluginHttpRequest* request)
@@ -193,9 +621,50 @@ static OrthancPluginErrorCode ServeCache(OrthancPluginRestOutput* output,
     const std::string id = request->groups[0];
     std::string content;
 
-    if (cache_->GetScheduler().Access(content, bundle, id))
+    // The viewers identify themselves, so that the prefetching can
+    // follow the scrolling of each of them
+    const std::string session = GetArgument(request, "session", "");
+
+    OrthancPlugins::CacheScheduler::AccessTimings timings;
+
+    if (cache_->GetScheduler().Access(content, timings, bundle, id, session))
     {
-      OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, content.c_str(), content.size(), "application/json");
+      const std::string* body = &content;
+      const char* mime = NULL;
+      std::string json;
+      OrthancPlugins::DecodingTimings serialization;
+
+      switch (answer)
+      {
+        case CacheAnswer_Json:
+          mime = "application/json";
+          break;
+
+        case CacheAnswer_Binary:
+          mime = "application/octet-stream";
+          break;
+
+        case CacheAnswer_BinaryToJson:
+        {
+          OrthancPlugins::DecodingTimingsScope scope(serialization);
+          OrthancPlugins::DecodedImageAdapter::ConvertBinaryImageToJson(json, content);
+          body = &json;
+          mime = "application/json";
+          break;
+        }
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      if (serverTiming_)
+      {
+        std::string header;
+        FormatServerTiming(header, timings, serialization, id);
+        OrthancPluginSetHttpHeader(OrthancPlugins::GetGlobalContext(), output, "Server-Timing", header.c_str());
+      }
+
+      OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, body->c_str(), body->size(), mime);
     }
     else
     {
@@ -339,10 +808,196 @@ static OrthancPluginErrorCode IsStableSeries(OrthancPluginRestOutput* output,
 }
 
 
+static OrthancPluginErrorCode CloseSession(OrthancPluginRestOutput* output,
+                                           const char* url,
+                                           const OrthancPluginHttpRequest* request)
+{
+  try
+  {
+    if (request->method != OrthancPluginHttpMethod_Delete)
+    {
+      OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "DELETE");
+      return OrthancPluginErrorCode_Success;
+    }
+
+    // The viewer has been closed: Its pending prefetching is useless
+    cache_->GetScheduler().CloseSession(request->groups[0]);
+
+    std::string answer = "{}";
+    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, answer.c_str(), answer.size(), "application/json");
+    return OrthancPluginErrorCode_Success;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(ERROR) << e.What();
+    return OrthancPluginErrorCode_Plugin;
+  }
+  catch (std::runtime_error& e)
+  {
+    LOG(ERROR) << e.what();
+    return OrthancPluginErrorCode_Plugin;
+  }
+}
+
+
+static OrthancPluginErrorCode ServeMetrics(OrthancPluginRestOutput* output,
+                                           const char* url,
+                                           const OrthancPluginHttpRequest* request)
+{
+  try
+  {
+    if (request->method != OrthancPluginHttpMethod_Get)
+    {
+      OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET");
+      return OrthancPluginErrorCode_Success;
+    }
+
+    Json::Value metrics;
+    FormatMetrics(metrics);
+
+    std::string answer;
+    Orthanc::Toolbox::WriteFastJson(answer, metrics);
+    OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, answer.c_str(), answer.size(), "application/json");
+    return OrthancPluginErrorCode_Success;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(ERROR) << e.What();
+    return OrthancPluginErrorCode_Plugin;
+  }
+  catch (std::runtime_error& e)
+  {
+    LOG(ERROR) << e.what();
+    return OrthancPluginErrorCode_Plugin;
+  }
+}
+
+
+
+class StackWriter : public OrthancPlugins::CacheScheduler::IBatchVisitor
+{
+private:
+  OrthancPluginRestOutput*  output_;
+
+public:
+  explicit StackWriter(OrthancPluginRestOutput* output) :
+    output_(output)
+  {
+  }
+
+  virtual void Visit(size_t index,
+                     const std::string& item,
+                     bool success,
+                     const std::string& content) ORTHANC_OVERRIDE
+  {
+    // A slice that cannot be decoded is sent as an empty part, so
+    // that the parts stay aligned with the requested slices
+    const size_t size = (success ? content.size() : 0);
+
+    if (OrthancPluginSendMultipartItem(OrthancPlugins::GetGlobalContext(), output_,
+                                       size == 0 ? NULL : content.c_str(), size) != OrthancPluginErrorCode_Success)
+    {
+      // The client has most probably closed the connection
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+    }
+  }
+};
+
+
+/**
+ * Streams the decoded images of a range of slices of a series, as a
+ * multipart answer whose parts follow the order of the slices. The
+ * optional GET arguments are "compression" (defaults to "jpeg95"),
+ * "first" (index of the first slice, defaults to 0) and "count"
+ * (defaults to all the remaining slices). The parts use the binary
+ * format of "/web-viewer/instances-binary/".
+ **/
+static OrthancPluginErrorCode ServeStack(OrthancPluginRestOutput* output,
+                                         const char* url,
+                                         const OrthancPluginHttpRequest* request)
+{
+  try
+  {
+    if (request->method != OrthancPluginHttpMethod_Get)
+    {
+      OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET");
+      return OrthancPluginErrorCode_Success;
+    }
+
+    const std::string seriesId = request->groups[0];
+    const std::string compression = GetArgument(request, "compression", "jpeg95");
+    const unsigned int first = boost::lexical_cast<unsigned int>(GetArgument(request, "first", "0"));
+    const std::string count = GetArgument(request, "count", "");
+
+    OrthancPlugins::CacheScheduler& scheduler = cache_->GetScheduler();
+
+    std::string content;
+    Json::Value series;
+    if (!scheduler.Access(content, OrthancPlugins::CacheBundle_SeriesInformation, seriesId) ||
+        !Orthanc::Toolbox::ReadJson(series, content) ||
+        !series.isMember("Slices") ||
+        series["Slices"].type() != Json::arrayValue)
+    {
+      OrthancPluginSendHttpStatusCode(OrthancPlugins::GetGlobalContext(), output, 404);
+      return OrthancPluginErrorCode_Success;
+    }
+
+    const Json::Value& slices = series["Slices"];
+
+    Json::Value::ArrayIndex end = slices.size();
+    if (!count.empty())
+    {
+      end = std::min(end, first + boost::lexical_cast<unsigned int>(count));
+    }
+
+    std::vector<std::string> items;
+    for (Json::Value::ArrayIndex i = first; i < end; i++)
+    {
+      items.push_back(compression + "-" + slices[i].asString());
+    }
+
+    if (OrthancPluginStartMultipartAnswer(OrthancPlugins::GetGlobalContext(), output,
+                                          "mixed", "application/octet-stream") != OrthancPluginErrorCode_Success)
+    {
+      return OrthancPluginErrorCode_Plugin;
+    }
+
+    StackWriter writer(output);
+    scheduler.AccessBatch(writer, OrthancPlugins::CacheBundle_DecodedImage, items);
+
+    return OrthancPluginErrorCode_Success;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(ERROR) << e.What();
+    return OrthancPluginErrorCode_Plugin;
+  }
+  catch (std::runtime_error& e)
+  {
+    LOG(ERROR) << e.what();
+    return OrthancPluginErrorCode_Plugin;
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    LOG(ERROR) << "Bad lexical cast";
+    return OrthancPluginErrorCode_Plugin;
+  }
+}
+
+
 
 void ParseConfiguration(int& decodingThreads,
                         boost::filesystem::path& cachePath,
-                        int& cacheSize)
+                        int& cacheSize,
+                        int& memoryCacheSize,
+                        int& decodedFrameCacheSize,
+                        int& previewCacheSize,
+                        int& tileCacheSize,
+                        bool& prewarmSeries,
+                        bool& prewarmStudies,
+                        int& prewarmFramesPerSeries,
+                        int& prewarmFramesPerHour,
+                        bool& serverTiming)
 {
   /* Read the configuration of the Web viewer */
   Json::Value configuration;
@@ -370,10 +1025,25 @@ void ParseConfiguration(int& decodingThreads,
     cachePath = OrthancPlugins::GetStringValue(configuration[CONFIG_WEB_VIEWER], key, cachePath.string());
     cacheSize = OrthancPlugins::GetIntegerValue(configuration[CONFIG_WEB_VIEWER], "CacheSize", cacheSize);
     decodingThreads = OrthancPlugins::GetIntegerValue(configuration[CONFIG_WEB_VIEWER], "Threads", decodingThreads);
+    memoryCacheSize = OrthancPlugins::GetIntegerValue(configuration[CONFIG_WEB_VIEWER], "MemoryCacheSize", memoryCacheSize);
+    decodedFrameCacheSize = OrthancPlugins::GetIntegerValue(configuration[CONFIG_WEB_VIEWER], "DecodedFrameCacheSize", decodedFrameCacheSize);
+    previewCacheSize = OrthancPlugins::GetIntegerValue(configuration[CONFIG_WEB_VIEWER], "PreviewCacheSize", previewCacheSize);
+    tileCacheSize = OrthancPlugins::GetIntegerValue(configuration[CONFIG_WEB_VIEWER], "TileCacheSize", tileCacheSize);
+    prewarmSeries = OrthancPlugins::GetBooleanValue(configuration[CONFIG_WEB_VIEWER], "PrewarmStableSeries", prewarmSeries);
+    prewarmStudies = OrthancPlugins::GetBooleanValue(configuration[CONFIG_WEB_VIEWER], "PrewarmStableStudies", prewarmStudies);
+    prewarmFramesPerSeries = OrthancPlugins::GetIntegerValue(configuration[CONFIG_WEB_VIEWER], "PrewarmFramesPerSeries", prewarmFramesPerSeries);
+    prewarmFramesPerHour = OrthancPlugins::GetIntegerValue(configuration[CONFIG_WEB_VIEWER], "PrewarmFramesPerHour", prewarmFramesPerHour);
+    serverTiming = OrthancPlugins::GetBooleanValue(configuration[CONFIG_WEB_VIEWER], "ServerTiming", serverTiming);
   }
 
   if (decodingThreads <= 0 ||
-      cacheSize <= 0)
+      cacheSize <= 0 ||
+      memoryCacheSize < 0 ||
+      decodedFrameCacheSize < 0 ||
+      previewCacheSize <= 0 ||
+      tileCacheSize <= 0 ||
+      prewarmFramesPerSeries < 0 ||
+      prewarmFramesPerHour < 0)
   {
     throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
   }
@@ -436,8 +1106,33 @@ extern "C"
       /* By default, a cache of 100 MB is used */
       int cacheSize = 100; 
 
+      /* By default, the 32 MB of the most recently served items are kept in RAM */
+      int memoryCacheSize = 32;
+
+      /* By default, the decoded frames are kept during a short time in 128 MB of RAM */
+      int decodedFrameCacheSize = 128;
+
+      /* By default, the low-resolution previews are cached in 50 MB */
+      int previewCacheSize = 50;
+
+      /* By default, the tiles of the very large images are cached in 200 MB */
+      int tileCacheSize = 200;
+
+      /* By default, the cache is not warmed up when a series or a study becomes stable */
+      bool prewarmSeries = false;
+      bool prewarmStudies = false;
+
+      /* By default, all the frames of the stable series are warmed up, up to 10000 frames per hour */
+      int prewarmFramesPerSeries = 0;
+      int prewarmFramesPerHour = 10000;
+
+      /* By default, the answers do not report their timings in a "Server-Timing" header */
+      bool serverTiming = false;
+
       boost::filesystem::path cachePath;
-      ParseConfiguration(decodingThreads, cachePath, cacheSize);
+      ParseConfiguration(decodingThreads, cachePath, cacheSize, memoryCacheSize, decodedFrameCacheSize,
+                         previewCacheSize, tileCacheSize, prewarmSeries, prewarmStudies,
+                         prewarmFramesPerSeries, prewarmFramesPerHour, serverTiming);
 
       LOG(WARNING) << "Web viewer using " << decodingThreads
                    << " threads for the decoding of the DICOM images";
@@ -471,6 +1166,16 @@ extern "C"
         clear = true;
       }
 
+      std::string decodedImageFormat("unknown");
+      if (!scheduler.LookupProperty(decodedImageFormat, CacheProperty_DecodedImageFormat) ||
+          decodedImageFormat != DECODED_IMAGE_FORMAT)
+      {
+        LOG(WARNING) << "The format of the decoded images has changed from \"" << decodedImageFormat
+                     << "\" to \"" << DECODED_IMAGE_FORMAT
+                     << "\": The cache of the Web viewer will be cleared";
+        clear = true;
+      }
+
 
       /* Clear the cache if needed */
       if (clear)
@@ -479,6 +1184,7 @@ extern "C"
         scheduler.Clear();
         scheduler.SetProperty(CacheProperty_OrthancVersion, context->orthancVersion);
         scheduler.SetProperty(CacheProperty_WebViewerVersion, ORTHANC_PLUGIN_VERSION);
+        scheduler.SetProperty(CacheProperty_DecodedImageFormat, DECODED_IMAGE_FORMAT);
       }
       else
       {
@@ -488,10 +1194,22 @@ extern "C"
 
       /* Configure the cache */
       scheduler.RegisterPolicy(new ViewerPrefetchPolicy(context));
-      scheduler.Register(CacheBundle_SeriesInformation, 
-                         new SeriesInformationAdapter(context, scheduler), 1);
-      scheduler.Register(CacheBundle_DecodedImage, 
-                         new DecodedImageAdapter(context), decodingThreads);
+
+      LOG(INFO) << "Web viewer using the SIMD instruction set: "
+                << OrthancPlugins::EnumerationToString(OrthancPlugins::GetBestSimdLevel());
+
+      /* The frames of a multi-frame instance are cached at once, up to a quarter of the cache */
+      std::unique_ptr<DecodedImageAdapter> decoder(new DecodedImageAdapter(context, scheduler));
+      decoder->SetMaxBatchSize(static_cast<uint64_t>(cacheSize) * 1024 * 1024 / 4);
+      decoder->SetDecodedFrameCacheSize(static_cast<uint64_t>(decodedFrameCacheSize) * 1024 * 1024);
+
+      /* The statistics of the series are computed on frames that are shared with the decoded images */
+      scheduler.Register(CacheBundle_SeriesInformation, decoder->CreateSeriesInformationFactory(), 1);
+
+      /* The previews share the decoding threads and the decoded frames of the full-resolution images */
+      scheduler.Register(CacheBundle_PreviewImage, decoder->CreatePreviewFactory(), 0);
+      scheduler.Register(CacheBundle_Tile, decoder->CreateTileFactory(), 0);
+      scheduler.Register(CacheBundle_DecodedImage, decoder.release(), decodingThreads);
 
 
       /* Set the quotas */
@@ -500,6 +1218,37 @@ extern "C"
       LOG(WARNING) << "Web viewer using a cache of " << cacheSize << " MB";
 
       scheduler.SetQuota(CacheBundle_DecodedImage, 0, static_cast<uint64_t>(cacheSize) * 1024 * 1024);
+      scheduler.SetQuota(CacheBundle_PreviewImage, 0, static_cast<uint64_t>(previewCacheSize) * 1024 * 1024);
+      scheduler.SetQuota(CacheBundle_Tile, 0, static_cast<uint64_t>(tileCacheSize) * 1024 * 1024);
+
+      LOG(WARNING) << "Web viewer using a memory cache of " << memoryCacheSize << " MB";
+
+      scheduler.SetMemoryCacheSize(static_cast<uint64_t>(memoryCacheSize) * 1024 * 1024);
+
+      /* Evict in background from 95% of the quotas down to 85% */
+      scheduler.SetEvictionWatermarks(95, 85);
+
+      /* Drop the prefetching jobs that have been waiting for more than one minute */
+      scheduler.SetMaxPrefetchAge(60);
+
+      /* Warm the cache up in the background with the stable series, if enabled */
+      if (prewarmSeries || prewarmStudies)
+      {
+        LOG(WARNING) << "Web viewer warming up its cache with the stable series, up to "
+                     << prewarmFramesPerHour << " frames per hour (0 means no limit)";
+      }
+
+      cache_->EnablePrewarming(prewarmSeries, prewarmStudies,
+                               static_cast<unsigned int>(prewarmFramesPerSeries),
+                               static_cast<unsigned int>(prewarmFramesPerHour));
+
+      /* Report the breakdown of the requests to the browsers, if enabled */
+      if (serverTiming)
+      {
+        LOG(WARNING) << "Web viewer reporting the timings of its answers in the Server-Timing header";
+        OrthancPlugins::SetMaxItemTimings(MAX_ITEM_TIMINGS);
+        serverTiming_ = true;
+      }
     }
     catch (std::runtime_error& e)
     {
@@ -521,9 +1270,15 @@ extern "C"
 
 
     /* Install the callbacks */
-    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/series/(.*)", ServeCache<CacheBundle_SeriesInformation>);
+    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/series/(.*)", ServeCache<CacheBundle_SeriesInformation, CacheAnswer_Json>);
     OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/is-stable-series/(.*)", IsStableSeries);
-    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/instances/(.*)", ServeCache<CacheBundle_DecodedImage>);
+    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/sessions/(.*)", CloseSession);
+    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/metrics", ServeMetrics);
+    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/instances/(.*)", ServeCache<CacheBundle_DecodedImage, CacheAnswer_BinaryToJson>);
+    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/instances-binary/(.*)", ServeCache<CacheBundle_DecodedImage, CacheAnswer_Binary>);
+    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/previews/(.*)", ServeCache<CacheBundle_PreviewImage, CacheAnswer_Binary>);
+    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/tiles/(.*)", ServeCache<CacheBundle_Tile, CacheAnswer_Binary>);
+    OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/stacks/(.*)", ServeStack);
     OrthancPluginRegisterRestCallbackNoLock(context, "/web-viewer/libs/(.*)", ServeEmbeddedFolder<Orthanc::EmbeddedResources::JAVASCRIPT_LIBS>);
 
 #if ORTHANC_STANDALONE == 1
@@ -534,6 +1289,10 @@ extern "C"
 
     OrthancPluginRegisterOnChangeCallback(context, OnChangeCallback);
 
+#if HAS_ORTHANC_PLUGIN_METRICS == 1
+    OrthancPluginRegisterRefreshMetricsCallback(context, RefreshMetrics);
+#endif
+
 
     /* Extend the default Orthanc Explorer with custom JavaScript */
     std::string explorer;
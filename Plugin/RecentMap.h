@@ -0,0 +1,108 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <list>
+#include <map>
+#include <string>
+
+namespace OrthancPlugins
+{
+  /**
+   * Map from strings to values that holds at most "maxSize" entries:
+   * Once it is full, creating an entry evicts the entry that was the
+   * least recently accessed. This class is not thread-safe.
+   **/
+  template <typename Value>
+  class RecentMap : public boost::noncopyable
+  {
+  private:
+    typedef std::list<std::string>  Recency;  // Most recent first
+
+    struct Entry
+    {
+      Value              value_;
+      Recency::iterator  recency_;
+    };
+
+    typedef std::map<std::string, Entry>  Content;
+
+    size_t   maxSize_;
+    Recency  recency_;
+    Content  content_;
+
+  public:
+    explicit RecentMap(size_t maxSize) :
+      maxSize_(maxSize)
+    {
+    }
+
+    // Returns the value of the key, which is default-constructed if
+    // need be, and marks it as the most recently accessed
+    Value& Access(const std::string& key)
+    {
+      typename Content::iterator found = content_.find(key);
+      if (found != content_.end())
+      {
+        recency_.splice(recency_.begin(), recency_, found->second.recency_);
+        return found->second.value_;
+      }
+
+      while (!recency_.empty() &&
+             content_.size() >= maxSize_)
+      {
+        content_.erase(recency_.back());
+        recency_.pop_back();
+      }
+
+      recency_.push_front(key);
+
+      Entry& entry = content_[key];
+      entry.recency_ = recency_.begin();
+      return entry.value_;
+    }
+
+    bool Contains(const std::string& key) const
+    {
+      return content_.find(key) != content_.end();
+    }
+
+    void Remove(const std::string& key)
+    {
+      typename Content::iterator found = content_.find(key);
+      if (found != content_.end())
+      {
+        recency_.erase(found->second.recency_);
+        content_.erase(found);
+      }
+    }
+
+    size_t GetSize() const
+    {
+      return content_.size();
+    }
+  };
+}
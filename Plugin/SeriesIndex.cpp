@@ -0,0 +1,177 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "SeriesIndex.h"
+
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+
+namespace OrthancPlugins
+{
+  static std::string GetInstanceId(const std::string& slice)
+  {
+    return slice.substr(0, slice.find('_'));
+  }
+
+
+  SeriesSlices::SeriesSlices(const std::string& seriesId,
+                             const Json::Value& slices) :
+    seriesId_(seriesId)
+  {
+    if (slices.type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    slices_.resize(slices.size());
+
+    for (Json::Value::ArrayIndex i = 0; i < slices.size(); i++)
+    {
+      if (slices[i].type() != Json::stringValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      slices_[i] = slices[i].asString();
+      positions_[slices_[i]] = i;
+    }
+  }
+
+
+  const std::string& SeriesSlices::GetSlice(size_t index) const
+  {
+    if (index >= slices_.size())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return slices_[index];
+  }
+
+
+  bool SeriesSlices::LookupPosition(unsigned int& position,
+                                    const std::string& slice) const
+  {
+    Positions::const_iterator found = positions_.find(slice);
+    if (found == positions_.end())
+    {
+      return false;
+    }
+    else
+    {
+      position = found->second;
+      return true;
+    }
+  }
+
+
+  SeriesIndex::SeriesIndex(size_t maxSeries) :
+    maxSeries_(maxSeries)
+  {
+    if (maxSeries == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  boost::shared_ptr<const SeriesSlices> SeriesIndex::Register(const std::string& seriesId,
+                                                              const std::string& seriesInformation)
+  {
+    // The parsing is done outside of the critical section
+    boost::shared_ptr<const SeriesSlices> slices;
+
+    Json::Value json;
+    if (!Orthanc::Toolbox::ReadJson(json, seriesInformation) ||
+        json.type() != Json::objectValue ||
+        !json.isMember("Slices") ||
+        json["Slices"].type() != Json::arrayValue)
+    {
+      return slices;
+    }
+
+    try
+    {
+      slices.reset(new SeriesSlices(seriesId, json["Slices"]));
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return slices;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (series_.size() >= maxSeries_ &&
+        series_.find(seriesId) == series_.end())
+    {
+      // Start over with an empty index
+      series_.clear();
+      instances_.clear();
+    }
+
+    series_[seriesId] = slices;
+
+    for (size_t i = 0; i < slices->GetSlicesCount(); i++)
+    {
+      instances_[GetInstanceId(slices->GetSlice(i))] = seriesId;
+    }
+
+    return slices;
+  }
+
+
+  boost::shared_ptr<const SeriesSlices> SeriesIndex::LookupSeries(const std::string& seriesId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Series::const_iterator found = series_.find(seriesId);
+    if (found == series_.end())
+    {
+      return boost::shared_ptr<const SeriesSlices>();
+    }
+    else
+    {
+      return found->second;
+    }
+  }
+
+
+  boost::shared_ptr<const SeriesSlices> SeriesIndex::LookupInstance(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Instances::const_iterator instance = instances_.find(instanceId);
+    if (instance != instances_.end())
+    {
+      Series::const_iterator series = series_.find(instance->second);
+      if (series != series_.end())
+      {
+        return series->second;
+      }
+    }
+
+    return boost::shared_ptr<const SeriesSlices>();
+  }
+}
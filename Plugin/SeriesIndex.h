@@ -0,0 +1,104 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <json/value.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * The ordered slices of one series ("<instance>_<frame>"), as
+   * listed in the "Slices" field of the series information, together
+   * with the position of each slice. This object is immutable once
+   * created, so that it can be shared between threads without locking.
+   **/
+  class SeriesSlices : public boost::noncopyable
+  {
+  private:
+    typedef std::map<std::string, unsigned int>  Positions;
+
+    std::string               seriesId_;
+    std::vector<std::string>  slices_;
+    Positions                 positions_;
+
+  public:
+    SeriesSlices(const std::string& seriesId,
+                 const Json::Value& slices);
+
+    const std::string& GetSeriesId() const
+    {
+      return seriesId_;
+    }
+
+    size_t GetSlicesCount() const
+    {
+      return slices_.size();
+    }
+
+    const std::string& GetSlice(size_t index) const;
+
+    bool LookupPosition(unsigned int& position,
+                        const std::string& slice) const;
+  };
+
+
+  /**
+   * In-memory index of the series that were recently accessed, that
+   * avoids asking the Orthanc core for the parent series of each
+   * accessed instance, and parsing the series information again to
+   * look for the position of the accessed slice.
+   **/
+  class SeriesIndex : public boost::noncopyable
+  {
+  private:
+    typedef std::map<std::string, boost::shared_ptr<const SeriesSlices> >  Series;
+    typedef std::map<std::string, std::string>  Instances;
+
+    boost::mutex  mutex_;
+    size_t        maxSeries_;
+    Series        series_;
+    Instances     instances_;  // The parent series of each indexed instance
+
+  public:
+    explicit SeriesIndex(size_t maxSeries);
+
+    // Indexes (or updates) a series from its cached information.
+    // Returns NULL if the information cannot be parsed.
+    boost::shared_ptr<const SeriesSlices> Register(const std::string& seriesId,
+                                                   const std::string& seriesInformation);
+
+    // Returns NULL if the series is not indexed
+    boost::shared_ptr<const SeriesSlices> LookupSeries(const std::string& seriesId);
+
+    // Returns NULL if the parent series of the instance is not indexed
+    boost::shared_ptr<const SeriesSlices> LookupInstance(const std::string& instanceId);
+  };
+}
@@ -0,0 +1,185 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "SeriesStatistics.h"
+
+#include <OrthancException.h>
+
+#include <cassert>
+
+
+static const int32_t HISTOGRAM_OFFSET = 32768;
+static const size_t HISTOGRAM_SIZE = 32768 + 65536;
+static const unsigned int COARSE_HISTOGRAM_BINS = 64;
+static const double ROBUST_LOW_PERCENTILE = 0.005;
+static const double ROBUST_HIGH_PERCENTILE = 0.995;
+
+
+namespace OrthancPlugins
+{
+  template <typename PixelType>
+  static void AccumulateHistogram(std::vector<uint32_t>& histogram,
+                                  const Orthanc::ImageAccessor& frame)
+  {
+    const unsigned int width = frame.GetWidth();
+    const unsigned int height = frame.GetHeight();
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      const PixelType* p = reinterpret_cast<const PixelType*>(frame.GetConstRow(y));
+
+      for (unsigned int x = 0; x < width; x++, p++)
+      {
+        histogram[static_cast<int32_t>(*p) + HISTOGRAM_OFFSET]++;
+      }
+    }
+  }
+
+
+  static void FormatWindow(Json::Value& target,
+                           int32_t low,
+                           int32_t high)
+  {
+    target["Center"] = static_cast<double>(low + high) / 2.0;
+    target["Width"] = (low == high ? 1 : high - low);
+  }
+
+
+  SeriesStatistics::SeriesStatistics() :
+    histogram_(HISTOGRAM_SIZE, 0),
+    count_(0),
+    framesCount_(0)
+  {
+  }
+
+
+  bool SeriesStatistics::AddFrame(const Orthanc::ImageAccessor& frame)
+  {
+    switch (frame.GetFormat())
+    {
+      case Orthanc::PixelFormat_Grayscale8:
+        AccumulateHistogram<uint8_t>(histogram_, frame);
+        break;
+
+      case Orthanc::PixelFormat_Grayscale16:
+        AccumulateHistogram<uint16_t>(histogram_, frame);
+        break;
+
+      case Orthanc::PixelFormat_SignedGrayscale16:
+        AccumulateHistogram<int16_t>(histogram_, frame);
+        break;
+
+      default:
+        return false;
+    }
+
+    count_ += static_cast<uint64_t>(frame.GetWidth()) * static_cast<uint64_t>(frame.GetHeight());
+    framesCount_++;
+    return true;
+  }
+
+
+  int32_t SeriesStatistics::GetPercentile(double percentile) const
+  {
+    assert(count_ > 0);
+
+    // Index of the sample, in the sorted order, that is looked for
+    const uint64_t target = static_cast<uint64_t>(percentile * static_cast<double>(count_ - 1));
+
+    uint64_t cumulated = 0;
+    for (size_t i = 0; i < histogram_.size(); i++)
+    {
+      cumulated += histogram_[i];
+      if (cumulated > target)
+      {
+        return static_cast<int32_t>(i) - HISTOGRAM_OFFSET;
+      }
+    }
+
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+
+
+  bool SeriesStatistics::Format(Json::Value& target) const
+  {
+    if (count_ == 0)
+    {
+      return false;
+    }
+
+    const int32_t minValue = GetPercentile(0);
+    const int32_t maxValue = GetPercentile(1);
+
+    Json::Value histogram = Json::arrayValue;
+    histogram.resize(COARSE_HISTOGRAM_BINS);
+
+    const int64_t range = static_cast<int64_t>(maxValue) - static_cast<int64_t>(minValue) + 1;
+    std::vector<uint64_t> bins(COARSE_HISTOGRAM_BINS, 0);
+
+    for (int32_t value = minValue; value <= maxValue; value++)
+    {
+      const int64_t bin = (static_cast<int64_t>(value - minValue) * COARSE_HISTOGRAM_BINS) / range;
+      bins[bin] += histogram_[value + HISTOGRAM_OFFSET];
+    }
+
+    for (unsigned int i = 0; i < COARSE_HISTOGRAM_BINS; i++)
+    {
+      histogram[i] = static_cast<Json::Value::UInt64>(bins[i]);
+    }
+
+    target = Json::objectValue;
+    target["MinValue"] = minValue;
+    target["MaxValue"] = maxValue;
+    target["Histogram"] = histogram;
+    target["SampledFrames"] = framesCount_;
+
+    FormatWindow(target["Windows"]["Full"], minValue, maxValue);
+    FormatWindow(target["Windows"]["Robust"],
+                 GetPercentile(ROBUST_LOW_PERCENTILE),
+                 GetPercentile(ROBUST_HIGH_PERCENTILE));
+
+    return true;
+  }
+
+
+  bool SeriesStatistics::GetRange(int64_t& minValue,
+                                  int64_t& maxValue,
+                                  const Json::Value& statistics)
+  {
+    if (statistics.type() == Json::objectValue &&
+        statistics.isMember("MinValue") &&
+        statistics.isMember("MaxValue") &&
+        statistics["MinValue"].isInt() &&
+        statistics["MaxValue"].isInt())
+    {
+      minValue = statistics["MinValue"].asInt();
+      maxValue = statistics["MaxValue"].asInt();
+      return minValue <= maxValue;
+    }
+    else
+    {
+      return false;
+    }
+  }
+}
@@ -0,0 +1,78 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <Images/ImageAccessor.h>
+
+#include <boost/noncopyable.hpp>
+#include <json/value.h>
+#include <stdint.h>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * Statistics about the stored pixel values (i.e. before the
+   * rescale slope and intercept) of the grayscale frames of a
+   * series. They are computed once on a sample of the slices, and
+   * cached in the "Statistics" field of the series information, so
+   * that all the slices of the series are stretched to the same
+   * range and the viewer gets consistent window presets.
+   **/
+  class SeriesStatistics : public boost::noncopyable
+  {
+  private:
+    // One bin per value, from -32768 (signed 16-bit) to 65535
+    // (unsigned 16-bit)
+    std::vector<uint32_t>  histogram_;
+    uint64_t               count_;
+    unsigned int           framesCount_;
+
+    int32_t GetPercentile(double percentile) const;
+
+  public:
+    SeriesStatistics();
+
+    // Returns "false" if the frame is not grayscale: Such frames are
+    // ignored
+    bool AddFrame(const Orthanc::ImageAccessor& frame);
+
+    unsigned int GetFramesCount() const
+    {
+      return framesCount_;
+    }
+
+    // Writes "MinValue", "MaxValue", a coarse "Histogram" over this
+    // range, and the "Full" and "Robust" (0.5% to 99.5% percentiles)
+    // window presets. Returns "false" if no grayscale frame was added.
+    bool Format(Json::Value& target) const;
+
+    // Reads the range from the "Statistics" field of the series
+    // information. Returns "false" if it is missing.
+    static bool GetRange(int64_t& minValue,
+                         int64_t& maxValue,
+                         const Json::Value& statistics);
+  };
+}
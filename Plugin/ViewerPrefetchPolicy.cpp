@@ -26,46 +26,251 @@
 #include "ViewerToolbox.h"
 #include "Cache/CacheScheduler.h"
 
-#include <Toolbox.h>
+#include <cmath>
 
 
-static const Json::Value::ArrayIndex PREFETCH_FORWARD = 10;
-static const Json::Value::ArrayIndex PREFETCH_BACKWARD = 3;
+static const unsigned int PREFETCH_AHEAD = 10;          // When the client is not scrolling
+static const unsigned int PREFETCH_AHEAD_MAX = 50;
+static const unsigned int PREFETCH_BEHIND = 3;          // When the client is not scrolling
+static const unsigned int PREFETCH_BEHIND_SCROLLING = 1;
+static const double PREFETCH_LOOKAHEAD = 1.0;           // Seconds of scrolling that are prefetched ahead
+static const double SCROLL_IDLE_TIME = 1.0;             // In seconds
+static const double SCROLL_MIN_ELAPSED = 0.01;          // In seconds
+static const double SCROLL_SMOOTHING = 0.5;
+static const unsigned int PREFETCH_PREVIEWS_AHEAD = 100;
+static const unsigned int PREFETCH_PREVIEWS_BEHIND = 20;
+static const size_t MAX_SERIES_COMPRESSIONS = 100;
+static const size_t MAX_SESSIONS = 100;
+static const size_t MAX_INDEXED_SERIES = 100;
+static const char* const PREVIEW_COMPRESSION = "preview256-";
 
 
 namespace OrthancPlugins
 {
+  void ScrollTracker::Update(const std::string& series,
+                             unsigned int position,
+                             const boost::posix_time::ptime& now)
+  {
+    if (series != series_ ||
+        time_.is_not_a_date_time())
+    {
+      // A new series is opened
+      series_ = series;
+      position_ = position;
+      time_ = now;
+      velocity_ = 0;
+      forward_ = true;
+      return;
+    }
+
+    if (position == position_)
+    {
+      // Same slice in another quality, or full-resolution image of
+      // a slice whose preview was accessed before
+      return;
+    }
+
+    const double delta = static_cast<double>(position) - static_cast<double>(position_);
+    const double elapsed = static_cast<double>((now - time_).total_microseconds()) / 1000000.0;
+
+    if (elapsed < 0 ||
+        elapsed > SCROLL_IDLE_TIME)
+    {
+      // The client had stopped scrolling
+      velocity_ = 0;
+    }
+    else
+    {
+      // Exponential smoothing of the instantaneous velocity
+      const double instantaneous = delta / std::max(elapsed, SCROLL_MIN_ELAPSED);
+      velocity_ = SCROLL_SMOOTHING * instantaneous + (1.0 - SCROLL_SMOOTHING) * velocity_;
+    }
+
+    if (velocity_ != 0)
+    {
+      forward_ = (velocity_ > 0);
+    }
+    else
+    {
+      forward_ = (delta > 0);
+    }
+
+    position_ = position;
+    time_ = now;
+  }
+
+
+  void ScrollTracker::GetWindow(unsigned int& ahead,
+                                unsigned int& behind) const
+  {
+    const double speed = std::fabs(velocity_);
+    const double window = static_cast<double>(PREFETCH_AHEAD) + speed * PREFETCH_LOOKAHEAD;
+
+    if (window >= static_cast<double>(PREFETCH_AHEAD_MAX))
+    {
+      ahead = PREFETCH_AHEAD_MAX;
+    }
+    else
+    {
+      ahead = static_cast<unsigned int>(window);
+    }
+
+    behind = (speed > 0 ? PREFETCH_BEHIND_SCROLLING : PREFETCH_BEHIND);
+  }
+
+
+  // "first" is the compression that is prefetched before the others
+  static void PrefetchSlice(std::list<CacheIndex>& toPrefetch,
+                            const std::set<std::string>& compressions,
+                            const std::string& first,
+                            const std::string& slice)
+  {
+    if (!first.empty())
+    {
+      toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, first + slice));
+    }
+
+    for (std::set<std::string>::const_iterator it = compressions.begin();
+         it != compressions.end(); ++it)
+    {
+      if (*it != first)
+      {
+        toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, *it + slice));
+      }
+    }
+  }
+
+
+  static void PrefetchPreview(std::list<CacheIndex>& toPrefetch,
+                              CacheScheduler& cache,
+                              const std::string& slice)
+  {
+    std::string item = PREVIEW_COMPRESSION + slice;
+    if (!cache.IsCached(CacheBundle_PreviewImage, item))
+    {
+      toPrefetch.push_back(CacheIndex(CacheBundle_PreviewImage, item));
+    }
+  }
+
+
+  /**
+   * The previews are prefetched in a window around the position of
+   * the client, rather than for the whole series at once: The
+   * prefetch queue is shared by all the clients, and drops its oldest
+   * jobs once full. The window moves with the scrolling.
+   **/
+  static void PrefetchPreviews(std::list<CacheIndex>& toPrefetch,
+                               CacheScheduler& cache,
+                               const SeriesSlices& slices,
+                               unsigned int position,
+                               bool forward)
+  {
+    const size_t count = slices.GetSlicesCount();
+
+    for (unsigned int i = 0; i < PREFETCH_PREVIEWS_AHEAD; i++)
+    {
+      if (forward ?
+          position + i >= count :
+          i > position)
+      {
+        break;
+      }
+
+      PrefetchPreview(toPrefetch, cache, slices.GetSlice(forward ? position + i : position - i));
+    }
+
+    for (unsigned int i = 1; i <= PREFETCH_PREVIEWS_BEHIND; i++)
+    {
+      if (forward ?
+          i > position :
+          position + i >= count)
+      {
+        break;
+      }
+
+      PrefetchPreview(toPrefetch, cache, slices.GetSlice(forward ? position - i : position + i));
+    }
+  }
+
+
+  ViewerPrefetchPolicy::ViewerPrefetchPolicy(OrthancPluginContext* context) :
+    context_(context),
+    index_(MAX_INDEXED_SERIES),
+    seriesCompressions_(MAX_SERIES_COMPRESSIONS),
+    sessions_(MAX_SESSIONS)
+  {
+  }
+
+
   void ViewerPrefetchPolicy::ApplySeries(std::list<CacheIndex>& toPrefetch,
                                          CacheScheduler& cache,
                                          const std::string& series,
                                          const std::string& content)
   {
-    Json::Value json;
-    if (!Orthanc::Toolbox::ReadJson(json, content) ||
-        !json.isMember("Slices"))
+    // Each access to the series information updates the index
+    boost::shared_ptr<const SeriesSlices> slices = index_.Register(series, content);
+    if (slices.get() == NULL)
     {
       return;
     }
 
-    const Json::Value& instances = json["Slices"];
-    if (instances.type() != Json::arrayValue)
-    {
-      return;
-    }
+    // The low-resolution previews of the first slices come first, so
+    // that scrolling through the series never shows a blank viewport
+    PrefetchPreviews(toPrefetch, cache, *slices, 0, true);
 
-    for (Json::Value::ArrayIndex i = 0; 
-         i < instances.size() && i < PREFETCH_FORWARD; 
+    for (size_t i = 0; 
+         i < slices->GetSlicesCount() && i < PREFETCH_AHEAD; 
          i++)
     {
-      std::string item = "jpeg95-" + instances[i].asString();
+      std::string item = "jpeg95-" + slices->GetSlice(i);
       toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, item));
     }
   }
 
 
+  boost::shared_ptr<const SeriesSlices> ViewerPrefetchPolicy::LookupSlices(CacheScheduler& cache,
+                                                                          const std::string& instanceId,
+                                                                          const std::string& session)
+  {
+    boost::shared_ptr<const SeriesSlices> slices = index_.LookupInstance(instanceId);
+    if (slices.get() != NULL)
+    {
+      return slices;
+    }
+
+    // The series of this instance was not accessed recently, or this
+    // is a new instance: Ask the Orthanc core for its parent series
+    Json::Value instance;
+    if (!GetJsonFromOrthanc(instance, context_, "/instances/" + instanceId) ||
+        !instance.isMember("ParentSeries"))
+    {
+      return slices;
+    }
+
+    const std::string seriesId = instance["ParentSeries"].asString();
+
+    std::string content;
+    if (cache.Lookup(content, CacheBundle_SeriesInformation, seriesId))
+    {
+      return index_.Register(seriesId, content);
+    }
+    else
+    {
+      // Never wait for the series information, as this would block
+      // the planning of all the clients. It is prefetched on behalf
+      // of the client (without applying the policy of the series),
+      // and the next accesses of the client will be planned.
+      cache.Prefetch(CacheBundle_SeriesInformation, seriesId, session);
+      return slices;
+    }
+  }
+
+
   void ViewerPrefetchPolicy::ApplyInstance(std::list<CacheIndex>& toPrefetch,
                                            CacheScheduler& cache,
-                                           const std::string& path)
+                                           const std::string& path,
+                                           const std::string& session,
+                                           bool isPreview)
   {
     size_t separator = path.find('-');
     if (separator == std::string::npos)
@@ -78,85 +283,117 @@ namespace OrthancPlugins
 
     std::string instanceId = instanceAndFrame.substr(0, instanceAndFrame.find('_'));
 
-    Json::Value instance;
-    if (!GetJsonFromOrthanc(instance, context_, "/instances/" + instanceId) ||
-        !instance.isMember("ParentSeries"))
+    boost::shared_ptr<const SeriesSlices> slices = LookupSlices(cache, instanceId, session);
+
+    unsigned int position;
+    if (slices.get() == NULL ||
+        !slices->LookupPosition(position, instanceAndFrame))
     {
       return;
     }
 
-    std::string tmp;
-    if (!cache.Access(tmp, CacheBundle_SeriesInformation, instance["ParentSeries"].asString()))
+    const std::string& seriesId = slices->GetSeriesId();
+
+    /**
+     * If the user switches between the qualities of a series, the
+     * next slices are prefetched in all of these qualities. As the
+     * decoded frames are shared by the compressions, each of these
+     * slices is only decoded once.
+     **/
+    std::set<std::string>& compressions = seriesCompressions_.Access(seriesId);
+
+    if (isPreview)
     {
-      return;
+      // The previews only serve to follow the scrolling of the
+      // client, and to move the window of the prefetched previews
+      compression.clear();
     }
-    
-    Json::Value series;
-    if (!Orthanc::Toolbox::ReadJson(series, tmp) ||
-        !series.isMember("Slices"))
+    else
     {
-      return;
+      compressions.insert(compression);
     }
 
-    const Json::Value& instances = series["Slices"];
+    // Once too many clients are tracked, the one that has been idle
+    // for the longest time is forgotten
+    ScrollTracker& tracker = sessions_.Access(session);
+    tracker.Update(seriesId, position, boost::posix_time::microsec_clock::universal_time());
 
-    if (instances.type() != Json::arrayValue)
-    {
-      return;
-    }
+    unsigned int ahead, behind;
+    tracker.GetWindow(ahead, behind);
+
+    const size_t count = slices->GetSlicesCount();
 
-    Json::Value::ArrayIndex position = 0;
-    while (position < instances.size())
+    // The slices in the direction of the scrolling come first,
+    // starting with the accessed slice in the other compressions
+    for (unsigned int i = 0; i < ahead; i++)
     {
-      if (instances[position] == instanceAndFrame)
+      if (tracker.IsForward() ?
+          position + i >= count :
+          i > position)
       {
         break;
       }
 
-      position++;
+      const size_t index = (tracker.IsForward() ? position + i : position - i);
+      PrefetchSlice(toPrefetch, compressions, compression, slices->GetSlice(index));
     }
 
-    if (position == instances.size())
+    for (unsigned int i = 1; i <= behind; i++)
     {
-      return;
-    }
+      if (tracker.IsForward() ?
+          i > position :
+          position + i >= count)
+      {
+        break;
+      }
 
-    for (Json::Value::ArrayIndex i = position;
-         i < instances.size() && i < position + PREFETCH_FORWARD; 
-         i++)
-    {
-      std::string item = compression + instances[i].asString();
-      toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, item));
+      const size_t index = (tracker.IsForward() ? position - i : position + i);
+      PrefetchSlice(toPrefetch, compressions, compression, slices->GetSlice(index));
     }
 
-    for (Json::Value::ArrayIndex i = position;
-         i >= 0 && i > position - PREFETCH_BACKWARD; )
-    {
-      i--;
-      std::string item = compression + instances[i].asString();
-      toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, item));
-    }
+    PrefetchPreviews(toPrefetch, cache, *slices, position, tracker.IsForward());
+  }
+
+
+  bool ViewerPrefetchPolicy::IsContentNeeded(int bundle) const
+  {
+    // Only the series information is parsed, the images are not
+    return (bundle == CacheBundle_SeriesInformation);
   }
 
 
   void ViewerPrefetchPolicy::Apply(std::list<CacheIndex>& toPrefetch,
                                    CacheScheduler& cache,
                                    const CacheIndex& accessed,
-                                   const std::string& content)
+                                   const std::string& content,
+                                   const std::string& session)
   {
     switch (accessed.GetBundle())
     {
       case CacheBundle_SeriesInformation:
+        // The client opens a series: Its prefetchings for the series
+        // it was previously looking at are not relevant anymore
+        cache.CancelPrefetch(session);
         ApplySeries(toPrefetch, cache, accessed.GetItem(), content);
         return;
 
       case CacheBundle_DecodedImage:
-        ApplyInstance(toPrefetch, cache, accessed.GetItem());
+        ApplyInstance(toPrefetch, cache, accessed.GetItem(), session, false);
+        return;
+
+      case CacheBundle_PreviewImage:
+        ApplyInstance(toPrefetch, cache, accessed.GetItem(), session, true);
         return;
 
       default:
         return;
     }
   }
+
+
+  void ViewerPrefetchPolicy::CloseSession(const std::string& session)
+  {
+    sessions_.Remove(session);
+  }
 }
 
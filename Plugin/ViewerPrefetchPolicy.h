@@ -24,36 +24,105 @@
 #pragma once
 
 #include "Cache/IPrefetchPolicy.h"
+#include "RecentMap.h"
+#include "SeriesIndex.h"
 
 #include <Compatibility.h>
 
 #include <orthanc/OrthancCPlugin.h>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <set>
+
 namespace OrthancPlugins
 {
+  /**
+   * Estimates the direction and the speed of the scrolling of one
+   * client through a series, from the positions of the slices it
+   * successively accesses. The prefetch window grows in the direction
+   * of travel with the speed, and shrinks back once the client stops.
+   **/
+  class ScrollTracker
+  {
+  private:
+    std::string               series_;
+    unsigned int              position_;
+    boost::posix_time::ptime  time_;
+    double                    velocity_;  // In slices per second, negative if scrolling backward
+    bool                      forward_;
+
+  public:
+    ScrollTracker() :
+      position_(0),
+      velocity_(0),
+      forward_(true)
+    {
+    }
+
+    void Update(const std::string& series,
+                unsigned int position,
+                const boost::posix_time::ptime& now);
+
+    double GetVelocity() const
+    {
+      return velocity_;
+    }
+
+    bool IsForward() const
+    {
+      return forward_;
+    }
+
+    // Number of slices to be prefetched in the direction of the
+    // scrolling ("ahead"), and in the opposite direction ("behind")
+    void GetWindow(unsigned int& ahead,
+                   unsigned int& behind) const;
+  };
+
+
   class ViewerPrefetchPolicy : public IPrefetchPolicy
   {
   private:
+    typedef RecentMap< std::set<std::string> >  SeriesCompressions;
+    typedef RecentMap<ScrollTracker>            Sessions;
+
     OrthancPluginContext* context_;
 
+    // The slices of the series that were recently accessed
+    SeriesIndex           index_;
+
+    // The compressions that were requested for each series
+    SeriesCompressions    seriesCompressions_;
+
+    // The scrolling of each client
+    Sessions              sessions_;
+
     void ApplySeries(std::list<CacheIndex>& toPrefetch,
                      CacheScheduler& cache,
                      const std::string& series,
                      const std::string& content);
 
+    boost::shared_ptr<const SeriesSlices> LookupSlices(CacheScheduler& cache,
+                                                       const std::string& instanceId,
+                                                       const std::string& session);
+
     void ApplyInstance(std::list<CacheIndex>& toPrefetch,
                        CacheScheduler& cache,
-                       const std::string& path);
+                       const std::string& path,
+                       const std::string& session,
+                       bool isPreview);
 
   public:
-    explicit ViewerPrefetchPolicy(OrthancPluginContext* context) :
-      context_(context)
-    {
-    }
+    explicit ViewerPrefetchPolicy(OrthancPluginContext* context);
+
+    virtual bool IsContentNeeded(int bundle) const ORTHANC_OVERRIDE;
 
     virtual void Apply(std::list<CacheIndex>& toPrefetch,
                        CacheScheduler& cache,
                        const CacheIndex& accessed,
-                       const std::string& content) ORTHANC_OVERRIDE;
+                       const std::string& content,
+                       const std::string& session) ORTHANC_OVERRIDE;
+
+    virtual void CloseSession(const std::string& session) ORTHANC_OVERRIDE;
   };
 }
@@ -271,6 +271,23 @@ namespace OrthancPlugins
   }
 
 
+  bool GetBooleanValue(const Json::Value& configuration,
+                       const std::string& key,
+                       bool defaultValue)
+  {
+    if (configuration.type() != Json::objectValue ||
+        !configuration.isMember(key) ||
+        configuration[key].type() != Json::booleanValue)
+    {
+      return defaultValue;
+    }
+    else
+    {
+      return configuration[key].asBool();
+    }
+  }
+
+
   OrthancPluginPixelFormat Convert(Orthanc::PixelFormat format)
   {
     switch (format)
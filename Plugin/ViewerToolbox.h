@@ -35,7 +35,9 @@ namespace OrthancPlugins
   {
     CacheBundle_DecodedImage = 1,
     CacheBundle_InstanceInformation = 2,
-    CacheBundle_SeriesInformation = 3
+    CacheBundle_SeriesInformation = 3,
+    CacheBundle_PreviewImage = 4,
+    CacheBundle_Tile = 5
   };
 
   bool GetStringFromOrthanc(std::string& content,
@@ -68,6 +70,10 @@ namespace OrthancPlugins
                       const std::string& key,
                       int defaultValue);
 
+  bool GetBooleanValue(const Json::Value& configuration,
+                       const std::string& key,
+                       bool defaultValue);
+
 
 
   OrthancPluginPixelFormat Convert(Orthanc::PixelFormat format);
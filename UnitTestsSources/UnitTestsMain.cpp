@@ -29,10 +29,24 @@ static char** argv_;
 
 #include "../Plugin/Cache/CacheManager.h"
 #include "../Plugin/Cache/CacheScheduler.h"
+#include "../Plugin/Cache/DecodedFrameCache.h"
 #include "../Plugin/Cache/ICacheFactory.h"
 #include "../Plugin/Cache/ICacheFactory.h"
+#include "../Plugin/Cache/MemoryCache.h"
+#include "../Plugin/CachePrewarmer.h"
+#include "../Plugin/DecodingMetrics.h"
+#include "../Plugin/ImageKernels.h"
+#include "../Plugin/RecentMap.h"
+#include "../Plugin/SeriesIndex.h"
+#include "../Plugin/SeriesStatistics.h"
+#include "../Plugin/ViewerPrefetchPolicy.h"
 
 #include <Compatibility.h>
+#include <Images/Image.h>
+#if ORTHANC_ENABLE_ZLIB == 1
+#  include <Compression/ZlibCompressor.h>
+#endif
+
 #include <Logging.h>
 #include <OrthancException.h>
 #include <SystemToolbox.h>
@@ -77,6 +91,11 @@ public:
   {
     return *storage_;
   }
+
+  Orthanc::SQLite::Connection& GetDatabase() 
+  {
+    return *db_;
+  }
 };
 
 
@@ -192,6 +211,1779 @@ TEST_F(CacheManagerTest, Invalidate)
 
 
 
+TEST_F(CacheManagerTest, Pinning)
+{
+  GetCache().SetDefaultQuota(2, 0);
+  GetCache().Store(0, "a", "Test a");
+
+  std::string uuid1, uuid2;
+  uint64_t size;
+  ASSERT_FALSE(GetCache().Acquire(uuid1, size, 0, "nope"));
+  ASSERT_TRUE(GetCache().Acquire(uuid1, size, 0, "a"));
+  ASSERT_EQ(6u, size);
+  ASSERT_TRUE(GetCache().Acquire(uuid2, size, 0, "a"));
+  ASSERT_EQ(uuid1, uuid2);
+
+  // Evict the pinned file: It must stay on the disk until released
+  GetCache().Store(0, "b", "Test b");
+  GetCache().Store(0, "c", "Test c");
+  ASSERT_FALSE(GetCache().IsCached(0, "a"));
+
+  std::set<std::string> f;
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(3u, f.size());
+
+  std::string s;
+  GetCache().ReadFile(s, uuid1, size);
+  ASSERT_EQ("Test a", s);
+
+  GetCache().Release(uuid1);
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(3u, f.size());
+
+  GetCache().Release(uuid2);
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(2u, f.size());
+
+  // Releasing a file that is not pinned is an error
+  ASSERT_THROW(GetCache().Release(uuid1), std::runtime_error);
+
+  // Invalidating a pinned file
+  ASSERT_TRUE(GetCache().Acquire(uuid1, size, 0, "b"));
+  GetCache().Invalidate(0, "b");
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(2u, f.size());
+  GetCache().Release(uuid1);
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(1u, f.size());
+}
+
+
+
+TEST_F(CacheManagerTest, BatchEviction)
+{
+  for (unsigned int i = 0; i < 100; i++)
+  {
+    std::string s = boost::lexical_cast<std::string>(i);
+    GetCache().Store(0, s, "0123456789");
+    GetCache().Store(1, s, "0123456789");
+  }
+
+  // Shrinking the quota evicts many items at once
+  GetCache().SetBundleQuota(0, 0, 255);
+
+  std::set<std::string> f;
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(125u, f.size());
+
+  for (unsigned int i = 0; i < 100; i++)
+  {
+    std::string s = boost::lexical_cast<std::string>(i);
+    ASSERT_EQ(i >= 75, GetCache().IsCached(0, s));
+    ASSERT_TRUE(GetCache().IsCached(1, s));
+  }
+
+  // Storing a large item evicts several smaller ones
+  GetCache().Store(0, "large", std::string(100, 'x'));
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(116u, f.size());
+  ASSERT_FALSE(GetCache().IsCached(0, "84"));
+  ASSERT_TRUE(GetCache().IsCached(0, "85"));
+  ASSERT_TRUE(GetCache().IsCached(0, "large"));
+}
+
+
+static std::string GetLruOrder(Orthanc::SQLite::Connection& db)
+{
+  std::string order;
+
+  Orthanc::SQLite::Statement s(db, "SELECT item FROM Cache ORDER BY seq");
+  while (s.Step())
+  {
+    order += s.ColumnString(0);
+  }
+
+  return order;
+}
+
+
+TEST_F(CacheManagerTest, LazyRecency)
+{
+  GetCache().SetDefaultQuota(3, 0);
+  GetCache().Store(0, "a", "Test a");
+  GetCache().Store(0, "b", "Test b");
+  GetCache().Store(0, "c", "Test c");
+
+  // Cache hits are not written to SQLite
+  std::string s;
+  ASSERT_TRUE(GetCache().Access(s, 0, "a"));
+  ASSERT_TRUE(GetCache().IsCached(0, "b"));
+  ASSERT_TRUE(GetCache().Access(s, 0, "a"));
+  ASSERT_EQ("abc", GetLruOrder(GetDatabase()));
+
+  GetCache().FlushTouches();
+  ASSERT_EQ("cba", GetLruOrder(GetDatabase()));
+
+  // The pending touches are taken into account by the eviction
+  ASSERT_TRUE(GetCache().Access(s, 0, "c"));
+  GetCache().Store(0, "d", "Test d");
+  ASSERT_FALSE(GetCache().IsCached(0, "b"));
+  ASSERT_EQ("acd", GetLruOrder(GetDatabase()));
+
+  // Touches of invalidated items are forgotten
+  ASSERT_TRUE(GetCache().Access(s, 0, "a"));
+  GetCache().Invalidate(0, "a");
+  GetCache().FlushTouches();
+  ASSERT_EQ("cd", GetLruOrder(GetDatabase()));
+}
+
+
+
+TEST_F(CacheManagerTest, Watermarks)
+{
+  ASSERT_THROW(GetCache().SetEvictionWatermarks(50, 80), Orthanc::OrthancException);
+
+  GetCache().SetDefaultQuota(10, 0);
+  GetCache().SetEvictionWatermarks(80, 50);
+  GetCache().SetAsynchronousRemoval(true);
+
+  for (unsigned int i = 0; i < 9; i++)
+  {
+    ASSERT_FALSE(GetCache().IsAboveHighWatermark());
+    std::string s = boost::lexical_cast<std::string>(i);
+    GetCache().Store(0, s, "Test " + s);
+  }
+
+  ASSERT_TRUE(GetCache().IsAboveHighWatermark());
+  GetCache().Reclaim();
+  ASSERT_FALSE(GetCache().IsAboveHighWatermark());
+
+  for (unsigned int i = 0; i < 9; i++)
+  {
+    ASSERT_EQ(i >= 4, GetCache().IsCached(0, boost::lexical_cast<std::string>(i)));
+  }
+
+  // The evicted files are only unlinked by the reclaimer
+  std::set<std::string> f;
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(9u, f.size());
+
+  std::list<std::string> toRemove;
+  GetCache().TakePendingRemovals(toRemove);
+  ASSERT_EQ(4u, toRemove.size());
+  GetCache().RemoveFiles(toRemove);
+  GetStorage().ListAllFiles(f);
+  ASSERT_EQ(5u, f.size());
+
+  GetCache().TakePendingRemovals(toRemove);
+  ASSERT_TRUE(toRemove.empty());
+}
+
+
+
+class SlowFactory : public ICacheFactory
+{
+private:
+  boost::mutex  mutex_;
+  unsigned int  count_;
+
+public:
+  SlowFactory() : count_(0)
+  {
+  }
+
+  virtual bool Create(std::string& content,
+                      const std::string& key) ORTHANC_OVERRIDE
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      count_++;
+    }
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    content = "Item " + key;
+    return true;
+  }
+
+  unsigned int GetCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return count_;
+  }
+};
+
+
+static void AccessWorker(CacheScheduler* scheduler,
+                         std::string* target)
+{
+  scheduler->Access(*target, 0, "hello");
+}
+
+
+TEST_F(CacheManagerTest, SingleFlight)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+
+  SlowFactory* factory = new SlowFactory;
+  scheduler.Register(0, factory, 1);
+
+  std::vector<std::string> results(4);
+  boost::thread_group threads;
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    threads.create_thread(boost::bind(AccessWorker, &scheduler, &results[i]));
+  }
+
+  threads.join_all();
+
+  ASSERT_EQ(1u, factory->GetCount());
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    ASSERT_EQ("Item hello", results[i]);
+  }
+
+  ASSERT_TRUE(GetCache().IsCached(0, "hello"));
+}
+
+
+
+class RecordingFactory : public ICacheFactory
+{
+private:
+  boost::mutex              mutex_;
+  std::vector<std::string>  calls_;
+
+public:
+  virtual bool Create(std::string& content,
+                      const std::string& key) ORTHANC_OVERRIDE
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      calls_.push_back(key);
+    }
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    content = "Item " + key;
+    return true;
+  }
+
+  std::vector<std::string> GetCalls()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return calls_;
+  }
+};
+
+
+static void AccessItemWorker(CacheScheduler* scheduler,
+                             const char* item,
+                             std::string* target)
+{
+  scheduler->Access(*target, 0, item);
+}
+
+
+TEST_F(CacheManagerTest, InteractivePriority)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+
+  RecordingFactory* factory = new RecordingFactory;
+  scheduler.Register(0, factory, 1);
+
+  // Keep the single worker busy, then queue some prefetching
+  scheduler.Prefetch(0, "busy");
+  boost::this_thread::sleep(boost::posix_time::milliseconds(30));
+  scheduler.Prefetch(0, "p1");
+  scheduler.Prefetch(0, "p2");
+  scheduler.Prefetch(0, "p3");
+
+  CacheScheduler::QueueStatistics s;
+  scheduler.GetQueueStatistics(s, CacheScheduler::Priority_Prefetch);
+  ASSERT_EQ(3u, s.queueDepth);
+
+  // The interactive requests go before the queued prefetching, and
+  // a request for a queued prefetch promotes it
+  std::string hello, p1;
+  boost::thread_group threads;
+  threads.create_thread(boost::bind(AccessItemWorker, &scheduler, "hello", &hello));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+  threads.create_thread(boost::bind(AccessItemWorker, &scheduler, "p1", &p1));
+  threads.join_all();
+
+  ASSERT_EQ("Item hello", hello);
+  ASSERT_EQ("Item p1", p1);
+
+  while (factory->GetCalls().size() < 5)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  std::vector<std::string> calls = factory->GetCalls();
+  ASSERT_EQ(5u, calls.size());
+  ASSERT_EQ("busy", calls[0]);
+  ASSERT_EQ("hello", calls[1]);
+  ASSERT_EQ("p1", calls[2]);
+  ASSERT_EQ("p3", calls[3]);  // Prefetching is LIFO
+  ASSERT_EQ("p2", calls[4]);
+
+  scheduler.GetQueueStatistics(s, CacheScheduler::Priority_Interactive);
+  ASSERT_EQ(0u, s.queueDepth);
+  ASSERT_EQ(2u, s.dequeuedCount);
+  ASSERT_GT(s.maxWaitMicroseconds, 0u);
+}
+
+
+
+class BatchFactory : public ICacheFactory
+{
+private:
+  CacheScheduler*  scheduler_;
+
+public:
+  BatchFactory() : scheduler_(NULL)
+  {
+  }
+
+  void SetScheduler(CacheScheduler& scheduler)
+  {
+    scheduler_ = &scheduler;
+  }
+
+  virtual bool Create(std::string& content,
+                      const std::string& key) ORTHANC_OVERRIDE
+  {
+    // Publish the requested item, then spend time on other items
+    content = "Item " + key;
+    scheduler_->Store(0, key + "-other", "Other");
+    scheduler_->Store(0, key, content);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(500));
+    return true;
+  }
+};
+
+
+static void BackgroundAccessWorker(CacheScheduler* scheduler,
+                                   std::string item,
+                                   bool* success,
+                                   std::string* target)
+{
+  *success = scheduler->AccessInBackground(*target, 0, item);
+}
+
+
+TEST_F(CacheManagerTest, AccessInBackground)
+{
+  CacheScheduler scheduler(GetCache(), 2);
+
+  RecordingFactory* factory = new RecordingFactory;
+  scheduler.Register(0, factory, 1);
+
+  scheduler.Prefetch(0, "busy");
+  boost::this_thread::sleep(boost::posix_time::milliseconds(30));
+
+  // A background access waits with the prefetch priority, after the
+  // interactive requests
+  bool success1, success2;
+  std::string background, dropped, hello;
+  boost::thread_group threads;
+  threads.create_thread(boost::bind(BackgroundAccessWorker, &scheduler, "dropped", &success1, &dropped));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  threads.create_thread(boost::bind(BackgroundAccessWorker, &scheduler, "background", &success2, &background));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  threads.create_thread(boost::bind(AccessItemWorker, &scheduler, "hello", &hello));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+  // Overflow the prefetch queue: The oldest background access is
+  // dropped, and is not left waiting forever
+  scheduler.Prefetch(0, "p1");
+  threads.join_all();
+
+  ASSERT_FALSE(success1);
+  ASSERT_TRUE(success2);
+  ASSERT_EQ("Item background", background);
+  ASSERT_EQ("Item hello", hello);
+
+  std::vector<std::string> calls = factory->GetCalls();
+  ASSERT_LE(3u, calls.size());
+  ASSERT_EQ("busy", calls[0]);
+  ASSERT_EQ("hello", calls[1]);
+
+  ASSERT_TRUE(scheduler.AccessInBackground(background, 0, "background"));
+  ASSERT_EQ("Item background", background);
+
+  CacheScheduler::AccessStatistics statistics;
+  scheduler.GetAccessStatistics(statistics, 0);
+  ASSERT_EQ(1u, statistics.misses);  // Only "hello"
+  ASSERT_EQ(0u, statistics.diskHits);
+}
+
+
+TEST_F(CacheManagerTest, EarlyStore)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+
+  BatchFactory* factory = new BatchFactory;
+  factory->SetScheduler(scheduler);
+  scheduler.Register(0, factory, 1);
+
+  // The item is answered before the factory returns
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+  std::string content;
+  ASSERT_TRUE(scheduler.Access(content, 0, "hello"));
+  ASSERT_EQ("Item hello", content);
+  ASSERT_LT((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds(), 400);
+
+  // The worker is still busy: Queue a prefetch that is stored in the meantime
+  scheduler.Prefetch(0, "world");
+  scheduler.Store(0, "world", "Stored");
+
+  CacheScheduler::QueueStatistics s;
+  scheduler.GetQueueStatistics(s, CacheScheduler::Priority_Prefetch);
+  ASSERT_EQ(0u, s.queueDepth);
+
+  ASSERT_TRUE(scheduler.IsCached(0, "hello-other"));
+  ASSERT_FALSE(scheduler.IsCached(0, "nope"));
+  ASSERT_TRUE(scheduler.Lookup(content, 0, "world"));
+  ASSERT_EQ("Stored", content);
+  ASSERT_FALSE(scheduler.Lookup(content, 0, "nope"));
+}
+
+
+
+class RecordingVisitor : public CacheScheduler::IBatchVisitor
+{
+public:
+  std::vector<std::string>  items_;
+  std::vector<std::string>  contents_;
+
+  virtual void Visit(size_t index,
+                     const std::string& item,
+                     bool success,
+                     const std::string& content) ORTHANC_OVERRIDE
+  {
+    ASSERT_EQ(items_.size(), index);
+    items_.push_back(item);
+    contents_.push_back(success ? content : "failure");
+  }
+};
+
+
+class FailingFactory : public SlowFactory
+{
+public:
+  virtual bool Create(std::string& content,
+                      const std::string& key) ORTHANC_OVERRIDE
+  {
+    if (key == "throw")
+    {
+      throw std::runtime_error("Cannot decode");
+    }
+
+    return (key != "bad" &&
+            SlowFactory::Create(content, key));
+  }
+};
+
+
+class AbortingVisitor : public CacheScheduler::IBatchVisitor
+{
+public:
+  virtual void Visit(size_t index,
+                     const std::string& item,
+                     bool success,
+                     const std::string& content) ORTHANC_OVERRIDE
+  {
+    // Emulates a client that has closed the connection
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
+};
+
+
+TEST_F(CacheManagerTest, AccessBatch)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+
+  FailingFactory* factory = new FailingFactory;
+  scheduler.Register(0, factory, 5);
+
+  scheduler.Store(0, "b", "Cached b");
+
+  std::vector<std::string> items;
+  items.push_back("a");
+  items.push_back("b");
+  items.push_back("bad");
+  items.push_back("c");
+  items.push_back("d");
+  items.push_back("e");
+
+  // The 4 missing items are generated in parallel
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+  RecordingVisitor visitor;
+  scheduler.AccessBatch(visitor, 0, items);
+  ASSERT_LT((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds(), 300);
+
+  ASSERT_EQ(items, visitor.items_);
+  ASSERT_EQ("Item a", visitor.contents_[0]);
+  ASSERT_EQ("Cached b", visitor.contents_[1]);
+  ASSERT_EQ("failure", visitor.contents_[2]);
+  ASSERT_EQ("Item c", visitor.contents_[3]);
+  ASSERT_EQ("Item d", visitor.contents_[4]);
+  ASSERT_EQ("Item e", visitor.contents_[5]);
+  ASSERT_EQ(4u, factory->GetCount());
+
+  ASSERT_TRUE(scheduler.IsCached(0, "e"));
+  ASSERT_FALSE(scheduler.IsCached(0, "bad"));
+}
+
+
+TEST_F(CacheManagerTest, AccessBatchLookAhead)
+{
+  CacheScheduler scheduler(GetCache(), 100);
+
+  FailingFactory* factory = new FailingFactory;
+  scheduler.Register(0, factory, 2);
+
+  std::vector<std::string> items;
+  items.push_back("throw");
+  for (unsigned int i = 0; i < 20; i++)
+  {
+    items.push_back("item" + boost::lexical_cast<std::string>(i));
+  }
+
+  // Only the window that follows the current item is queued, and
+  // with the prefetch priority
+  AbortingVisitor visitor;
+  ASSERT_THROW(scheduler.AccessBatch(visitor, 0, items), Orthanc::OrthancException);
+
+  // The exception of the factory is given to the visitor as a
+  // failure, and the look-ahead is cancelled once the client is gone
+  CacheScheduler::QueueStatistics statistics;
+  scheduler.GetQueueStatistics(statistics, CacheScheduler::Priority_Interactive);
+  ASSERT_EQ(0u, statistics.queueDepth);
+  scheduler.GetQueueStatistics(statistics, CacheScheduler::Priority_Prefetch);
+  ASSERT_EQ(0u, statistics.queueDepth);
+
+  boost::this_thread::sleep(boost::posix_time::milliseconds(300));
+  ASSERT_LE(factory->GetCount(), 2u);
+}
+
+
+
+class VersionedFactory : public ICacheFactory
+{
+private:
+  boost::mutex  mutex_;
+  unsigned int  version_;
+
+public:
+  VersionedFactory() : version_(1)
+  {
+  }
+
+  virtual bool Create(std::string& content,
+                      const std::string& key) ORTHANC_OVERRIDE
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+
+    boost::mutex::scoped_lock lock(mutex_);
+    content = key + " v" + boost::lexical_cast<std::string>(version_);
+    return true;
+  }
+
+  void SetVersion(unsigned int version)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    version_ = version;
+  }
+};
+
+
+TEST_F(CacheManagerTest, Refresh)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+  scheduler.SetMemoryCacheSize(1000);
+
+  VersionedFactory* factory = new VersionedFactory;
+  scheduler.Register(0, factory, 1);
+
+  std::string s;
+  ASSERT_TRUE(scheduler.Access(s, 0, "a"));
+  ASSERT_EQ("a v1", s);
+
+  // The previous value is served while the item is regenerated
+  factory->SetVersion(2);
+  scheduler.Refresh(0, "a");
+  ASSERT_TRUE(scheduler.Access(s, 0, "a"));
+  ASSERT_EQ("a v1", s);
+
+  for (unsigned int i = 0; i < 100 && s != "a v2"; i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    ASSERT_TRUE(scheduler.Lookup(s, 0, "a"));
+  }
+
+  ASSERT_EQ("a v2", s);
+  ASSERT_TRUE(scheduler.Access(s, 0, "a"));
+  ASSERT_EQ("a v2", s);
+
+  // Refreshing an item that is not cached generates it
+  scheduler.Refresh(0, "b");
+  ASSERT_TRUE(scheduler.Access(s, 0, "b"));
+  ASSERT_EQ("b v2", s);
+}
+
+
+
+TEST_F(CacheManagerTest, RefreshNotDropped)
+{
+  // The prefetch queue can only hold 2 jobs
+  CacheScheduler scheduler(GetCache(), 2);
+
+  VersionedFactory* factory = new VersionedFactory;
+  scheduler.Register(0, factory, 1);
+
+  std::string s;
+  ASSERT_TRUE(scheduler.Access(s, 0, "a"));
+  ASSERT_EQ("a v1", s);
+
+  // Keep the single worker busy, then overflow the prefetch queue
+  factory->SetVersion(2);
+  scheduler.Prefetch(0, "x");
+  boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+  scheduler.Refresh(0, "a");
+  scheduler.Prefetch(0, "b");
+  scheduler.Prefetch(0, "c");
+  scheduler.Prefetch(0, "d");
+
+  // The oldest prefetchings are dropped, but not the refresh
+  for (unsigned int i = 0; i < 100 && s != "a v2"; i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    ASSERT_TRUE(scheduler.Lookup(s, 0, "a"));
+  }
+
+  ASSERT_EQ("a v2", s);
+
+  CacheScheduler::AccessStatistics statistics;
+  scheduler.GetAccessStatistics(statistics, 0);
+  ASSERT_EQ(2u, statistics.prefetchCancelled);
+}
+
+
+static void VersionedAccessWorker(CacheScheduler* scheduler,
+                                  std::string* target)
+{
+  scheduler->Access(*target, 0, "a");
+}
+
+
+TEST_F(CacheManagerTest, InvalidateDuringGeneration)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+  scheduler.SetMemoryCacheSize(1000);
+
+  VersionedFactory* factory = new VersionedFactory;
+  scheduler.Register(0, factory, 1);
+
+  // The item is invalidated while it is being generated: The obsolete
+  // value is given to the waiting requests, including the one that
+  // arrives after the invalidation, but must not be promoted into
+  // the memory cache
+  std::string obsolete1, obsolete2;
+  boost::thread thread1(VersionedAccessWorker, &scheduler, &obsolete1);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(30));
+  scheduler.Invalidate(0, "a");
+  boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+  boost::thread thread2(VersionedAccessWorker, &scheduler, &obsolete2);
+  thread1.join();
+  thread2.join();
+  ASSERT_EQ("a v1", obsolete1);
+  ASSERT_EQ("a v1", obsolete2);
+
+  factory->SetVersion(2);
+
+  std::string s;
+  ASSERT_TRUE(scheduler.Access(s, 0, "a"));
+  ASSERT_EQ("a v2", s);
+}
+
+
+
+class RecordingPolicy : public IPrefetchPolicy
+{
+private:
+  boost::mutex              mutex_;
+  std::vector<std::string>  calls_;
+
+public:
+  virtual bool IsContentNeeded(int bundle) const ORTHANC_OVERRIDE
+  {
+    return (bundle == 1);
+  }
+
+  virtual void Apply(std::list<CacheIndex>& toPrefetch,
+                     CacheScheduler& cache,
+                     const CacheIndex& index,
+                     const std::string& content,
+                     const std::string& session) ORTHANC_OVERRIDE
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      calls_.push_back(session + ":" + index.GetItem() + (content.empty() ? "" : "=" + content));
+    }
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  }
+
+  virtual void CloseSession(const std::string& session) ORTHANC_OVERRIDE
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    calls_.push_back("close " + session);
+  }
+
+  std::vector<std::string> WaitCalls(size_t count)
+  {
+    for (unsigned int i = 0; i < 100; i++)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (calls_.size() >= count)
+        {
+          return calls_;
+        }
+      }
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    return calls_;
+  }
+};
+
+
+TEST_F(CacheManagerTest, AsynchronousPolicy)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+
+  RecordingPolicy* policy = new RecordingPolicy;
+  scheduler.RegisterPolicy(policy);
+  scheduler.Register(0, new SlowFactory, 1);
+
+  for (unsigned int i = 0; i < 6; i++)
+  {
+    scheduler.Store(0, boost::lexical_cast<std::string>(i), "Test");
+  }
+
+  // The accesses do not wait for the policy
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  std::string s;
+  ASSERT_TRUE(scheduler.Access(s, 0, "0", "s1"));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+
+  // While the first access is planned, the next accesses of the
+  // same session are merged into the most recent one
+  ASSERT_TRUE(scheduler.Access(s, 0, "1", "s1"));
+  ASSERT_TRUE(scheduler.Access(s, 0, "2", "s2"));
+  ASSERT_TRUE(scheduler.Access(s, 0, "3", "s1"));
+  ASSERT_TRUE(scheduler.Access(s, 0, "4", "s1"));
+  ASSERT_TRUE(scheduler.Access(s, 0, "5"));
+  ASSERT_LT((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds(), 150);
+
+  std::vector<std::string> calls = policy->WaitCalls(4);
+  ASSERT_EQ(4u, calls.size());
+  ASSERT_EQ("s1:0", calls[0]);
+  ASSERT_EQ("s1:4", calls[1]);
+  ASSERT_EQ("s2:2", calls[2]);
+  ASSERT_EQ(":5", calls[3]);
+
+  // The content is only given for the bundles that the policy reads
+  scheduler.Register(1, new SlowFactory, 0);
+  scheduler.Store(1, "a", "Info");
+  ASSERT_TRUE(scheduler.Access(s, 1, "a", "s3"));
+
+  calls = policy->WaitCalls(5);
+  ASSERT_EQ(5u, calls.size());
+  ASSERT_EQ("s3:a=Info", calls[4]);
+
+  // The policy is notified of the clients that leave
+  scheduler.CloseSession("s3");
+  calls = policy->WaitCalls(6);
+  ASSERT_EQ(6u, calls.size());
+  ASSERT_EQ("close s3", calls[5]);
+}
+
+
+
+TEST_F(CacheManagerTest, CancelPrefetch)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+
+  RecordingFactory* factory = new RecordingFactory;
+  scheduler.Register(0, factory, 1);
+
+  // Keep the single worker busy, then queue the prefetching of two sessions
+  scheduler.Prefetch(0, "busy");
+  boost::this_thread::sleep(boost::posix_time::milliseconds(30));
+  scheduler.Prefetch(0, "a1", "a");
+  scheduler.Prefetch(0, "b1", "b");
+  scheduler.Prefetch(0, "a2", "a");
+  scheduler.Prefetch(0, "c");
+
+  ASSERT_EQ(0u, scheduler.CancelPrefetch(""));
+  ASSERT_EQ(0u, scheduler.CancelPrefetch("nope"));
+  ASSERT_EQ(2u, scheduler.CancelPrefetch("a"));
+  ASSERT_EQ(0u, scheduler.CancelPrefetch("a"));
+
+  CacheScheduler::QueueStatistics s;
+  scheduler.GetQueueStatistics(s, CacheScheduler::Priority_Prefetch);
+  ASSERT_EQ(2u, s.queueDepth);
+
+  while (factory->GetCalls().size() < 3)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  boost::this_thread::sleep(boost::posix_time::milliseconds(150));
+
+  std::vector<std::string> calls = factory->GetCalls();
+  ASSERT_EQ(3u, calls.size());
+  ASSERT_EQ("busy", calls[0]);
+  ASSERT_EQ("c", calls[1]);
+  ASSERT_EQ("b1", calls[2]);
+  ASSERT_FALSE(scheduler.IsCached(0, "a1"));
+  ASSERT_FALSE(scheduler.IsCached(0, "a2"));
+
+  // A cancelled item can still be accessed
+  std::string a1;
+  ASSERT_TRUE(scheduler.Access(a1, 0, "a1"));
+  ASSERT_EQ("Item a1", a1);
+}
+
+
+class SessionFactory : public ICacheFactory
+{
+private:
+  boost::mutex                        mutex_;
+  std::map<std::string, std::string>  sessions_;
+
+public:
+  virtual bool Create(std::string& content,
+                      const std::string& key) ORTHANC_OVERRIDE
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    sessions_[key] = CacheScheduler::GetCurrentSession();
+    content = key;
+    return true;
+  }
+
+  std::string GetSession(const std::string& key)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return sessions_[key];
+  }
+};
+
+
+TEST_F(CacheManagerTest, CurrentSession)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+
+  SessionFactory* factory = new SessionFactory;
+  scheduler.Register(0, factory, 1);
+
+  ASSERT_EQ("", CacheScheduler::GetCurrentSession());
+
+  std::string s;
+  ASSERT_TRUE(scheduler.Access(s, 0, "a", "s1"));
+  ASSERT_TRUE(scheduler.Access(s, 0, "b"));
+  scheduler.Prefetch(0, "c", "s2");
+
+  for (unsigned int i = 0; i < 100 && !scheduler.IsCached(0, "c"); i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  // The factory knows on behalf of which client it works
+  ASSERT_EQ("s1", factory->GetSession("a"));
+  ASSERT_EQ("", factory->GetSession("b"));
+  ASSERT_EQ("s2", factory->GetSession("c"));
+}
+
+
+class DiscardingFactory : public ICacheFactory
+{
+private:
+  boost::mutex  mutex_;
+  unsigned int  count_;
+
+public:
+  DiscardingFactory() : count_(0)
+  {
+  }
+
+  virtual bool Create(std::string& content,
+                      const std::string& key) ORTHANC_OVERRIDE
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      count_++;
+    }
+
+    if (key == "incomplete")
+    {
+      CacheScheduler::DiscardCurrentItem();
+    }
+
+    content = "Item " + key;
+    return true;
+  }
+
+  unsigned int GetCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return count_;
+  }
+};
+
+
+TEST_F(CacheManagerTest, DiscardCurrentItem)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+
+  DiscardingFactory* factory = new DiscardingFactory;
+  scheduler.Register(0, factory, 1);
+
+  // Calling this method outside of a factory has no effect
+  CacheScheduler::DiscardCurrentItem();
+
+  std::string s;
+  ASSERT_TRUE(scheduler.Access(s, 0, "incomplete"));
+  ASSERT_EQ("Item incomplete", s);
+  ASSERT_FALSE(scheduler.IsCached(0, "incomplete"));
+  ASSERT_FALSE(scheduler.Lookup(s, 0, "incomplete"));
+
+  // The next access generates the item again
+  ASSERT_TRUE(scheduler.Access(s, 0, "incomplete"));
+  ASSERT_EQ(2u, factory->GetCount());
+
+  // The flag does not leak to the next job of the same worker
+  ASSERT_TRUE(scheduler.Access(s, 0, "complete"));
+  ASSERT_TRUE(scheduler.IsCached(0, "complete"));
+  ASSERT_TRUE(scheduler.Access(s, 0, "complete"));
+  ASSERT_EQ(3u, factory->GetCount());
+}
+
+
+TEST_F(CacheManagerTest, AccessStatistics)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+  scheduler.Register(0, new SlowFactory, 1);
+  scheduler.SetQuota(0, 3, 0);
+
+  std::string s;
+  CacheScheduler::AccessTimings timings;
+  ASSERT_TRUE(scheduler.Access(s, timings, 0, "a", ""));
+  ASSERT_TRUE(timings.isGenerated);
+  ASSERT_GE(timings.waitMicroseconds, 100000u);  // Duration of "SlowFactory"
+
+  ASSERT_TRUE(scheduler.Access(s, timings, 0, "a", ""));
+  ASSERT_FALSE(timings.isGenerated);
+  ASSERT_EQ(0u, timings.waitMicroseconds);
+
+  CacheScheduler::AccessStatistics a;
+  scheduler.GetAccessStatistics(a, 0);
+  ASSERT_EQ(1u, a.misses);
+  ASSERT_EQ(1u, a.diskHits);
+  ASSERT_EQ(0u, a.memoryHits);
+  ASSERT_EQ(0u, a.prefetchedCount);
+
+  scheduler.Prefetch(0, "p1");
+  scheduler.Prefetch(0, "p2");
+
+  while (!scheduler.IsCached(0, "p1") ||
+         !scheduler.IsCached(0, "p2"))
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_TRUE(scheduler.Access(s, 0, "a"));
+  ASSERT_TRUE(scheduler.Access(s, 0, "p1"));
+
+  // "p2" is now the least recently used item, and is evicted to make
+  // room for "b" without having been used
+  ASSERT_TRUE(scheduler.Access(s, 0, "b"));
+  ASSERT_FALSE(scheduler.IsCached(0, "p2"));
+
+  // Only the first access to a prefetched item uses it
+  scheduler.SetMemoryCacheSize(1024 * 1024);
+  ASSERT_TRUE(scheduler.Access(s, 0, "p1"));
+  ASSERT_TRUE(scheduler.Access(s, 0, "p1"));
+
+  // An invalidated prefetched item is also wasted
+  scheduler.Prefetch(0, "p3");
+  while (!scheduler.IsCached(0, "p3"))
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  scheduler.Invalidate(0, "p3");
+
+  scheduler.GetAccessStatistics(a, 0);
+  ASSERT_EQ(2u, a.misses);
+  ASSERT_EQ(4u, a.diskHits);
+  ASSERT_EQ(1u, a.memoryHits);
+  ASSERT_EQ(3u, a.prefetchedCount);
+  ASSERT_EQ(1u, a.prefetchUsed);
+  ASSERT_EQ(2u, a.prefetchWasted);
+  ASSERT_EQ(0u, a.prefetchCancelled);
+
+  CacheManager::BundleStatistics b;
+  scheduler.GetBundleStatistics(b, 0);
+  ASSERT_EQ(2u, b.count);  // "p1" and "b"
+  ASSERT_EQ(std::string("Item p1").size() + std::string("Item b").size(), b.space);
+  ASSERT_EQ(2u, b.evictedCount);  // "p2" and "a"
+
+  scheduler.GetAccessStatistics(a, 1);
+  ASSERT_EQ(0u, a.misses);
+}
+
+
+TEST_F(CacheManagerTest, BackgroundEviction)
+{
+  CacheScheduler scheduler(GetCache(), 10);
+  scheduler.SetQuota(0, 10, 0);
+  scheduler.SetEvictionWatermarks(80, 50);
+
+  for (unsigned int i = 0; i < 9; i++)
+  {
+    std::string s = boost::lexical_cast<std::string>(i);
+    scheduler.Store(0, s, "Test " + s);
+  }
+
+  std::set<std::string> f;
+  for (unsigned int i = 0; i < 100; i++)
+  {
+    GetStorage().ListAllFiles(f);
+    if (f.size() == 5u)
+    {
+      break;
+    }
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_EQ(5u, f.size());
+  ASSERT_FALSE(scheduler.IsCached(0, "3"));
+  ASSERT_TRUE(scheduler.IsCached(0, "4"));
+}
+
+
+
+TEST(MemoryCache, Basic)
+{
+  MemoryCache cache(10);
+
+  std::string s;
+  ASSERT_FALSE(cache.Access(s, 0, "a"));
+
+  cache.Store(0, "a", "aaaa");
+  cache.Store(0, "b", "bbbb");
+  cache.Store(1, "a", "cc");
+  ASSERT_EQ(3u, cache.GetItemsCount());
+  ASSERT_EQ(10u, cache.GetCurrentSize());
+
+  ASSERT_TRUE(cache.Access(s, 0, "a"));  ASSERT_EQ("aaaa", s);
+  ASSERT_TRUE(cache.Access(s, 1, "a"));  ASSERT_EQ("cc", s);
+
+  // "0/b" is the least recently used item
+  cache.Store(0, "c", "d");
+  ASSERT_EQ(3u, cache.GetItemsCount());
+  ASSERT_EQ(7u, cache.GetCurrentSize());
+  ASSERT_FALSE(cache.Access(s, 0, "b"));
+  ASSERT_TRUE(cache.Access(s, 0, "c"));  ASSERT_EQ("d", s);
+
+  // Replacing an item
+  cache.Store(0, "a", "e");
+  ASSERT_EQ(4u, cache.GetCurrentSize());
+  ASSERT_TRUE(cache.Access(s, 0, "a"));  ASSERT_EQ("e", s);
+
+  // Items that are larger than the cache are ignored
+  cache.Store(0, "f", "01234567890");
+  ASSERT_FALSE(cache.Access(s, 0, "f"));
+  ASSERT_EQ(3u, cache.GetItemsCount());
+
+  cache.Invalidate(0, "a");
+  ASSERT_FALSE(cache.Access(s, 0, "a"));
+  ASSERT_EQ(3u, cache.GetCurrentSize());
+
+  // "1/a" is now the least recently used item
+  cache.SetMaximumSize(2);
+  ASSERT_EQ(1u, cache.GetItemsCount());
+  ASSERT_FALSE(cache.Access(s, 1, "a"));
+  ASSERT_TRUE(cache.Access(s, 0, "c"));  ASSERT_EQ("d", s);
+
+  cache.SetMaximumSize(0);
+  ASSERT_EQ(0u, cache.GetItemsCount());
+  ASSERT_EQ(0u, cache.GetCurrentSize());
+  cache.Store(0, "a", "a");
+  ASSERT_FALSE(cache.Access(s, 0, "a"));
+
+  cache.SetMaximumSize(10);
+  cache.Store(0, "a", "a");
+  cache.Clear();
+  ASSERT_EQ(0u, cache.GetItemsCount());
+  ASSERT_FALSE(cache.Access(s, 0, "a"));
+
+  // An item that is invalidated after its generation was read is not
+  // promoted, whereas the other items are
+  uint64_t generation = cache.GetGeneration(0, "a");
+  ASSERT_TRUE(cache.Store(0, "a", "a", generation));
+  ASSERT_TRUE(cache.Access(s, 0, "a"));  ASSERT_EQ("a", s);
+
+  generation = cache.GetGeneration(0, "a");
+  cache.Invalidate(0, "a");
+  ASSERT_FALSE(cache.Store(0, "a", "b", generation));
+  ASSERT_FALSE(cache.Access(s, 0, "a"));
+  ASSERT_TRUE(cache.Store(0, "a", "c", cache.GetGeneration(0, "a")));
+  ASSERT_TRUE(cache.Access(s, 0, "a"));  ASSERT_EQ("c", s);
+
+  generation = cache.GetGeneration(0, "a");
+  cache.Clear();
+  ASSERT_FALSE(cache.Store(0, "a", "d", generation));
+}
+
+
+
+class TestFrame : public DecodedFrameCache::IFrame
+{
+private:
+  uint64_t  size_;
+
+public:
+  explicit TestFrame(uint64_t size) : size_(size)
+  {
+  }
+
+  virtual uint64_t GetMemorySize() const ORTHANC_OVERRIDE
+  {
+    return size_;
+  }
+};
+
+
+TEST(DecodedFrameCache, Basic)
+{
+  DecodedFrameCache cache(10);
+
+  ASSERT_TRUE(cache.Lookup("a", 0).get() == NULL);
+
+  boost::shared_ptr<DecodedFrameCache::IFrame> a0(new TestFrame(4));
+  cache.Store("a", 0, a0);
+  cache.Store("a", 1, boost::shared_ptr<DecodedFrameCache::IFrame>(new TestFrame(4)));
+  cache.Store("b", 0, boost::shared_ptr<DecodedFrameCache::IFrame>(new TestFrame(2)));
+  ASSERT_EQ(3u, cache.GetFramesCount());
+  ASSERT_EQ(10u, cache.GetCurrentSize());
+  ASSERT_TRUE(cache.Lookup("a", 0) == a0);
+
+  // "a/1" is the least recently used frame
+  cache.Store("c", 0, boost::shared_ptr<DecodedFrameCache::IFrame>(new TestFrame(3)));
+  ASSERT_EQ(3u, cache.GetFramesCount());
+  ASSERT_EQ(9u, cache.GetCurrentSize());
+  ASSERT_TRUE(cache.Lookup("a", 1).get() == NULL);
+
+  // Frames that are larger than the cache are ignored
+  cache.Store("d", 0, boost::shared_ptr<DecodedFrameCache::IFrame>(new TestFrame(11)));
+  ASSERT_TRUE(cache.Lookup("d", 0).get() == NULL);
+  ASSERT_EQ(3u, cache.GetFramesCount());
+
+  cache.Store("a", 1, boost::shared_ptr<DecodedFrameCache::IFrame>(new TestFrame(1)));
+  cache.Invalidate("a");
+  ASSERT_TRUE(cache.Lookup("a", 0).get() == NULL);
+  ASSERT_TRUE(cache.Lookup("a", 1).get() == NULL);
+  ASSERT_EQ(2u, cache.GetFramesCount());
+  ASSERT_EQ(5u, cache.GetCurrentSize());
+
+  // The evicted frames stay valid for their users
+  ASSERT_EQ(4u, a0->GetMemorySize());
+
+  cache.SetMaximumSize(0);
+  ASSERT_EQ(0u, cache.GetFramesCount());
+  ASSERT_EQ(0u, cache.GetCurrentSize());
+}
+
+
+
+static std::vector<SimdLevel> GetSupportedSimdLevels()
+{
+  std::vector<SimdLevel> levels;
+  levels.push_back(GetBestSimdLevel());
+
+  if (GetBestSimdLevel() == SimdLevel_AVX2)
+  {
+    levels.push_back(SimdLevel_SSE2);
+  }
+
+  return levels;
+}
+
+
+TEST(ImageKernels, MinMax)
+{
+  std::vector<uint16_t> u(1000);
+  std::vector<int16_t> s(1000);
+  for (size_t i = 0; i < u.size(); i++)
+  {
+    u[i] = static_cast<uint16_t>((i * 7919) % 65536);
+    s[i] = static_cast<int16_t>(u[i]);
+  }
+
+  const std::vector<SimdLevel> levels = GetSupportedSimdLevels();
+
+  // Check all the lengths, to cover the scalar tails of the kernels
+  for (size_t count = 1; count < 100; count++)
+  {
+    for (size_t offset = 0; offset < 3; offset++)
+    {
+      uint16_t ua, ub;
+      int16_t sa, sb;
+      GetMinMaxValue(ua, ub, &u[offset], count, SimdLevel_None);
+      GetMinMaxValue(sa, sb, &s[offset], count, SimdLevel_None);
+
+      for (size_t i = 0; i < levels.size(); i++)
+      {
+        uint16_t ua2, ub2;
+        int16_t sa2, sb2;
+        GetMinMaxValue(ua2, ub2, &u[offset], count, levels[i]);
+        GetMinMaxValue(sa2, sb2, &s[offset], count, levels[i]);
+        ASSERT_EQ(ua, ua2);
+        ASSERT_EQ(ub, ub2);
+        ASSERT_EQ(sa, sa2);
+        ASSERT_EQ(sb, sb2);
+      }
+    }
+  }
+
+  uint16_t a, b;
+  GetMinMaxValue(a, b, &u[0], u.size(), GetBestSimdLevel());
+  ASSERT_EQ(0u, a);
+  ASSERT_GT(b, 60000u);
+}
+
+
+TEST(ImageKernels, Stretch)
+{
+  std::vector<uint16_t> u(1000);
+  std::vector<int16_t> s(1000);
+  for (size_t i = 0; i < u.size(); i++)
+  {
+    u[i] = static_cast<uint16_t>((i * 7919) % 4096);
+    s[i] = static_cast<int16_t>(u[i]) - 2048;
+  }
+
+  std::vector<uint8_t> expected(u.size()), actual(u.size());
+
+  StretchToGrayscale8(&expected[0], &u[0], 4, 0, 4095, SimdLevel_None);
+  ASSERT_EQ(0, expected[0]);     // 0
+  ASSERT_EQ(238, expected[1]);   // 3823
+  ASSERT_EQ(221, expected[2]);   // 3550
+  ASSERT_EQ(204, expected[3]);   // 3277
+
+  // Flat images
+  StretchToGrayscale8(&expected[0], &u[0], u.size(), 100, 100, GetBestSimdLevel());
+  for (size_t i = 0; i < u.size(); i++)
+  {
+    ASSERT_EQ(0, expected[i]);
+  }
+
+  const std::vector<SimdLevel> levels = GetSupportedSimdLevels();
+
+  for (size_t i = 0; i < levels.size(); i++)
+  {
+    for (size_t count = 1; count < 100; count++)
+    {
+      // Including saturated values
+      StretchToGrayscale8(&expected[0], &u[0], count, 100, 3000, SimdLevel_None);
+      StretchToGrayscale8(&actual[0], &u[0], count, 100, 3000, levels[i]);
+
+      for (size_t j = 0; j < count; j++)
+      {
+        // Fused multiply-add instructions might round differently
+        ASSERT_LE(abs(static_cast<int>(expected[j]) - static_cast<int>(actual[j])), 1);
+      }
+
+      StretchToGrayscale8(&expected[0], &s[0], count, -1000, 1000, SimdLevel_None);
+      StretchToGrayscale8(&actual[0], &s[0], count, -1000, 1000, levels[i]);
+
+      for (size_t j = 0; j < count; j++)
+      {
+        ASSERT_LE(abs(static_cast<int>(expected[j]) - static_cast<int>(actual[j])), 1);
+      }
+    }
+  }
+}
+
+
+TEST(ImageKernels, RGB48)
+{
+  std::vector<uint16_t> source(300);
+  for (size_t i = 0; i < source.size(); i++)
+  {
+    source[i] = static_cast<uint16_t>(i * 211);
+  }
+
+  std::vector<uint8_t> expected(source.size()), actual(source.size());
+
+  const std::vector<SimdLevel> levels = GetSupportedSimdLevels();
+
+  for (size_t count = 3; count < source.size(); count += 3)
+  {
+    ConvertRGB48ToRGB24(&expected[0], &source[0], count, SimdLevel_None);
+
+    for (size_t i = 0; i < count; i++)
+    {
+      ASSERT_EQ(source[i] >> 8, expected[i]);
+    }
+
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+      ConvertRGB48ToRGB24(&actual[0], &source[0], count, levels[i]);
+      ASSERT_TRUE(std::equal(expected.begin(), expected.begin() + count, actual.begin()));
+    }
+  }
+}
+
+
+
+TEST(ImageKernels, AccumulateRow)
+{
+  std::vector<uint16_t> source(300);
+  std::vector<int16_t> signedSource(source.size());
+  for (size_t i = 0; i < source.size(); i++)
+  {
+    source[i] = static_cast<uint16_t>(65535 - i * 211);
+    signedSource[i] = static_cast<int16_t>(-32768 + static_cast<int>(i * 211));
+  }
+
+  const std::vector<SimdLevel> levels = GetSupportedSimdLevels();
+
+  for (size_t count = 1; count < source.size(); count++)
+  {
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+      // Start from non-zero accumulators, as after a first row
+      std::vector<uint32_t> sums(count, 100000);
+      std::vector<int32_t> signedSums(count, -100000);
+
+      AccumulateRow(&sums[0], &source[0], count, levels[i]);
+      AccumulateRow(&sums[0], &source[0], count, levels[i]);
+      AccumulateRow(&signedSums[0], &signedSource[0], count, levels[i]);
+      AccumulateRow(&signedSums[0], &signedSource[0], count, levels[i]);
+
+      std::vector<uint32_t> sums8(count, 7);
+      AccumulateRow(&sums8[0], reinterpret_cast<const uint8_t*>(&source[0]), count, levels[i]);
+
+      for (size_t j = 0; j < count; j++)
+      {
+        ASSERT_EQ(100000u + 2u * source[j], sums[j]);
+        ASSERT_EQ(-100000 + 2 * signedSource[j], signedSums[j]);
+        ASSERT_EQ(7u + reinterpret_cast<const uint8_t*>(&source[0])[j], sums8[j]);
+      }
+    }
+  }
+}
+
+
+TEST(ImageKernels, DeltaPlanes)
+{
+  std::vector<uint16_t> source(300);
+  for (size_t i = 0; i < source.size(); i++)
+  {
+    // Both small and wrapping differences
+    source[i] = static_cast<uint16_t>(i % 7 == 0 ? i * 4001 : 1000 + i);
+  }
+
+  std::vector<uint8_t> expectedLow(source.size()), expectedHigh(source.size());
+  std::vector<uint8_t> actualLow(source.size()), actualHigh(source.size());
+
+  const std::vector<SimdLevel> levels = GetSupportedSimdLevels();
+
+  for (size_t count = 1; count < source.size(); count++)
+  {
+    EncodeDeltaPlanes(&expectedLow[0], &expectedHigh[0], &source[0], count, 42, SimdLevel_None);
+
+    // The transform is lossless
+    uint16_t previous = 42;
+    for (size_t j = 0; j < count; j++)
+    {
+      previous = static_cast<uint16_t>(previous + expectedLow[j] + 256 * expectedHigh[j]);
+      ASSERT_EQ(source[j], previous);
+    }
+
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+      EncodeDeltaPlanes(&actualLow[0], &actualHigh[0], &source[0], count, 42, levels[i]);
+      ASSERT_TRUE(std::equal(expectedLow.begin(), expectedLow.begin() + count, actualLow.begin()));
+      ASSERT_TRUE(std::equal(expectedHigh.begin(), expectedHigh.begin() + count, actualHigh.begin()));
+    }
+  }
+}
+
+
+#if ORTHANC_ENABLE_ZLIB == 1
+TEST(ImageKernels, DeltaBenchmark)
+{
+  // Synthetic 512x512 CT slice: Smooth anatomy with some noise, and
+  // the air around the body
+  const size_t width = 512;
+  const size_t height = 512;
+  const size_t count = width * height;
+
+  std::vector<uint16_t> source(count);
+  for (size_t y = 0; y < height; y++)
+  {
+    for (size_t x = 0; x < width; x++)
+    {
+      const int dx = static_cast<int>(x) - 256;
+      const int dy = static_cast<int>(y) - 256;
+      const int noise = static_cast<int>((x * 7919 + y * 104729) % 13);
+      source[y * width + x] = static_cast<uint16_t>(
+        dx * dx + dy * dy < 200 * 200 ? 1000 + (dx * dx - dy * dy) / 64 + noise : 24);
+    }
+  }
+
+  Orthanc::ZlibCompressor compressor;
+  compressor.SetPrefixWithUncompressedSize(false);
+
+  std::string deflate, delta, planes;
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+  compressor.Compress(deflate, &source[0], count * sizeof(uint16_t));
+
+  boost::posix_time::ptime middle = boost::posix_time::microsec_clock::universal_time();
+  planes.resize(2 * count);
+  uint8_t* p = reinterpret_cast<uint8_t*>(&planes[0]);
+  for (size_t y = 0; y < height; y++)
+  {
+    EncodeDeltaPlanes(p + y * width, p + count + y * width, &source[y * width], width,
+                      (y == 0 ? 0 : source[(y - 1) * width]), GetBestSimdLevel());
+  }
+  compressor.Compress(delta, planes.c_str(), planes.size());
+
+  boost::posix_time::ptime end = boost::posix_time::microsec_clock::universal_time();
+
+  LOG(WARNING) << "Deflate: " << deflate.size() << " bytes in "
+               << (middle - start).total_microseconds() << " us";
+  LOG(WARNING) << "Delta: " << delta.size() << " bytes in "
+               << (end - middle).total_microseconds() << " us";
+
+  ASSERT_LT(delta.size(), deflate.size());
+}
+#endif
+
+
+TEST(SeriesStatistics, Basic)
+{
+  SeriesStatistics statistics;
+
+  Json::Value json;
+  ASSERT_FALSE(statistics.Format(json));
+
+  Orthanc::Image color(Orthanc::PixelFormat_RGB24, 10, 10, false);
+  ASSERT_FALSE(statistics.AddFrame(color));
+
+  Orthanc::Image frame(Orthanc::PixelFormat_SignedGrayscale16, 100, 100, false);
+  for (unsigned int y = 0; y < frame.GetHeight(); y++)
+  {
+    int16_t* p = reinterpret_cast<int16_t*>(frame.GetRow(y));
+    for (unsigned int x = 0; x < frame.GetWidth(); x++)
+    {
+      p[x] = static_cast<int16_t>(x * 10 - 500);  // From -500 to 490
+    }
+  }
+
+  // Two outliers, that are ignored by the robust window
+  reinterpret_cast<int16_t*>(frame.GetRow(0))[0] = -3000;
+  reinterpret_cast<int16_t*>(frame.GetRow(99))[99] = 3000;
+
+  ASSERT_TRUE(statistics.AddFrame(frame));
+  ASSERT_TRUE(statistics.AddFrame(frame));
+  ASSERT_EQ(2u, statistics.GetFramesCount());
+  ASSERT_TRUE(statistics.Format(json));
+
+  ASSERT_EQ(-3000, json["MinValue"].asInt());
+  ASSERT_EQ(3000, json["MaxValue"].asInt());
+  ASSERT_EQ(2u, json["SampledFrames"].asUInt());
+  ASSERT_DOUBLE_EQ(0.0, json["Windows"]["Full"]["Center"].asDouble());
+  ASSERT_EQ(6000, json["Windows"]["Full"]["Width"].asInt());
+  ASSERT_DOUBLE_EQ(-5.0, json["Windows"]["Robust"]["Center"].asDouble());
+  ASSERT_EQ(990, json["Windows"]["Robust"]["Width"].asInt());
+
+  uint64_t total = 0;
+  for (Json::Value::ArrayIndex i = 0; i < json["Histogram"].size(); i++)
+  {
+    total += json["Histogram"][i].asUInt64();
+  }
+
+  ASSERT_EQ(20000u, total);
+
+  int64_t a, b;
+  ASSERT_TRUE(SeriesStatistics::GetRange(a, b, json));
+  ASSERT_EQ(-3000, a);
+  ASSERT_EQ(3000, b);
+  ASSERT_FALSE(SeriesStatistics::GetRange(a, b, Json::nullValue));
+}
+
+
+TEST(PrewarmBudget, Basic)
+{
+  const boost::posix_time::ptime start(boost::gregorian::date(2026, 1, 1), boost::posix_time::hours(8));
+
+  PrewarmBudget budget(100);
+  ASSERT_EQ(60u, budget.Reserve(60, start));
+  ASSERT_EQ(40u, budget.Reserve(60, start + boost::posix_time::minutes(10)));
+  ASSERT_EQ(0u, budget.Reserve(10, start + boost::posix_time::minutes(59)));
+
+  // The budget is renewed every hour
+  ASSERT_EQ(10u, budget.Reserve(10, start + boost::posix_time::minutes(61)));
+  ASSERT_EQ(90u, budget.Reserve(200, start + boost::posix_time::minutes(62)));
+
+  PrewarmBudget unlimited(0);
+  ASSERT_EQ(100000u, unlimited.Reserve(100000, start));
+  ASSERT_EQ(100000u, unlimited.Reserve(100000, start));
+}
+
+
+TEST(SeriesIndex, Basic)
+{
+  SeriesIndex index(2);
+
+  ASSERT_TRUE(index.Register("s1", "nope").get() == NULL);
+  ASSERT_TRUE(index.Register("s1", "{ \"Slices\" : 42 }").get() == NULL);
+
+  boost::shared_ptr<const SeriesSlices> slices =
+    index.Register("s1", "{ \"Slices\" : [ \"a_0\", \"b_0\", \"b_1\", \"c_0\" ] }");
+  ASSERT_TRUE(slices.get() != NULL);
+  ASSERT_EQ("s1", slices->GetSeriesId());
+  ASSERT_EQ(4u, slices->GetSlicesCount());
+  ASSERT_EQ("b_1", slices->GetSlice(2));
+  ASSERT_THROW(slices->GetSlice(4), Orthanc::OrthancException);
+
+  unsigned int position;
+  ASSERT_TRUE(slices->LookupPosition(position, "a_0"));  ASSERT_EQ(0u, position);
+  ASSERT_TRUE(slices->LookupPosition(position, "b_1"));  ASSERT_EQ(2u, position);
+  ASSERT_TRUE(slices->LookupPosition(position, "c_0"));  ASSERT_EQ(3u, position);
+  ASSERT_FALSE(slices->LookupPosition(position, "d_0"));
+
+  ASSERT_EQ(slices.get(), index.LookupInstance("b").get());
+  ASSERT_EQ(slices.get(), index.LookupSeries("s1").get());
+  ASSERT_TRUE(index.LookupInstance("d").get() == NULL);
+
+  // Updating the series, e.g. after the reception of new instances
+  boost::shared_ptr<const SeriesSlices> updated =
+    index.Register("s1", "{ \"Slices\" : [ \"a_0\", \"d_0\", \"b_0\", \"b_1\", \"c_0\" ] }");
+  ASSERT_EQ(updated.get(), index.LookupInstance("d").get());
+  ASSERT_EQ(updated.get(), index.LookupInstance("b").get());
+  ASSERT_TRUE(updated->LookupPosition(position, "b_1"));  ASSERT_EQ(3u, position);
+
+  // The previous version is still valid for its owners
+  ASSERT_TRUE(slices->LookupPosition(position, "b_1"));  ASSERT_EQ(2u, position);
+
+  // The index is emptied once too many series are indexed
+  ASSERT_TRUE(index.Register("s2", "{ \"Slices\" : [ \"e_0\" ] }").get() != NULL);
+  ASSERT_TRUE(index.LookupInstance("a").get() != NULL);
+  ASSERT_TRUE(index.Register("s3", "{ \"Slices\" : [ \"f_0\" ] }").get() != NULL);
+  ASSERT_TRUE(index.LookupInstance("a").get() == NULL);
+  ASSERT_TRUE(index.LookupSeries("s2").get() == NULL);
+  ASSERT_TRUE(index.LookupInstance("f").get() != NULL);
+}
+
+
+TEST(RecentMap, Basic)
+{
+  RecentMap<int> map(2);
+  map.Access("a") = 1;
+  map.Access("b") = 2;
+  ASSERT_EQ(2u, map.GetSize());
+
+  // Accessing "a" makes "b" the least recently accessed entry
+  ASSERT_EQ(1, map.Access("a"));
+  map.Access("c") = 3;
+  ASSERT_EQ(2u, map.GetSize());
+  ASSERT_TRUE(map.Contains("a"));
+  ASSERT_FALSE(map.Contains("b"));
+  ASSERT_TRUE(map.Contains("c"));
+
+  map.Remove("a");
+  map.Remove("nope");
+  ASSERT_EQ(1u, map.GetSize());
+  ASSERT_EQ(0, map.Access("a"));
+  ASSERT_EQ(3, map.Access("c"));
+  ASSERT_EQ(2u, map.GetSize());
+}
+
+
+TEST(ScrollTracker, Basic)
+{
+  const boost::posix_time::ptime start(boost::gregorian::date(2026, 1, 1), boost::posix_time::hours(8));
+
+  unsigned int ahead, behind;
+
+  ScrollTracker tracker;
+  tracker.Update("series", 50, start);
+  tracker.GetWindow(ahead, behind);
+  ASSERT_TRUE(tracker.IsForward());
+  ASSERT_EQ(10u, ahead);
+  ASSERT_EQ(3u, behind);
+
+  // Fast scrolling forward (40 slices per second): The window grows
+  for (unsigned int i = 1; i <= 10; i++)
+  {
+    tracker.Update("series", 50 + 2 * i, start + boost::posix_time::milliseconds(50 * i));
+  }
+
+  tracker.GetWindow(ahead, behind);
+  ASSERT_TRUE(tracker.IsForward());
+  ASSERT_GT(tracker.GetVelocity(), 35.0);
+  ASSERT_GT(ahead, 40u);
+  ASSERT_LE(ahead, 50u);
+  ASSERT_EQ(1u, behind);
+
+  // Slow scrolling backward
+  for (unsigned int i = 1; i <= 5; i++)
+  {
+    tracker.Update("series", 70 - i, start + boost::posix_time::milliseconds(500 + 100 * i));
+  }
+
+  tracker.GetWindow(ahead, behind);
+  ASSERT_FALSE(tracker.IsForward());
+  ASSERT_LT(tracker.GetVelocity(), 0.0);
+  ASSERT_GT(ahead, 10u);
+  ASSERT_LT(ahead, 40u);
+
+  // Same slice in another quality: No change
+  tracker.Update("series", 65, start + boost::posix_time::milliseconds(1200));
+  ASSERT_LT(tracker.GetVelocity(), 0.0);
+
+  // After a pause, the window shrinks, but keeps its direction
+  tracker.Update("series", 64, start + boost::posix_time::seconds(5));
+  tracker.GetWindow(ahead, behind);
+  ASSERT_FALSE(tracker.IsForward());
+  ASSERT_EQ(0.0, tracker.GetVelocity());
+  ASSERT_EQ(10u, ahead);
+  ASSERT_EQ(3u, behind);
+
+  // Opening another series
+  tracker.Update("other", 0, start + boost::posix_time::seconds(6));
+  ASSERT_TRUE(tracker.IsForward());
+  ASSERT_EQ(0.0, tracker.GetVelocity());
+}
+
+
+TEST(LatencyHistogram, Basic)
+{
+  LatencyHistogram h;
+  ASSERT_EQ(0u, h.GetCount());
+  ASSERT_EQ(1000u, LatencyHistogram::GetBucketBound(0));
+  ASSERT_EQ(0u, LatencyHistogram::GetBucketBound(LatencyHistogram::BUCKETS_COUNT - 1));
+  ASSERT_THROW(LatencyHistogram::GetBucketBound(LatencyHistogram::BUCKETS_COUNT), Orthanc::OrthancException);
+
+  h.Add(0);
+  h.Add(1000);     // The upper bounds are inclusive
+  h.Add(1001);
+  h.Add(7000);
+  h.Add(60000000);
+
+  ASSERT_EQ(5u, h.GetCount());
+  ASSERT_EQ(60009001u, h.GetTotalMicroseconds());
+  ASSERT_EQ(60000000u, h.GetMaxMicroseconds());
+  ASSERT_EQ(2u, h.GetBucket(0));
+  ASSERT_EQ(1u, h.GetBucket(1));
+  ASSERT_EQ(0u, h.GetBucket(2));
+  ASSERT_EQ(1u, h.GetBucket(3));
+  ASSERT_EQ(1u, h.GetBucket(LatencyHistogram::BUCKETS_COUNT - 1));
+
+  Json::Value v;
+  h.Format(v);
+  ASSERT_EQ(5u, v["Count"].asUInt());
+  ASSERT_EQ(2u, v["BucketsMs"]["1"].asUInt());
+  ASSERT_EQ(3u, v["BucketsMs"]["2"].asUInt());
+  ASSERT_EQ(4u, v["BucketsMs"]["10"].asUInt());
+  ASSERT_EQ(4u, v["BucketsMs"]["5000"].asUInt());
+  ASSERT_EQ(5u, v["BucketsMs"]["+Inf"].asUInt());
+
+  LatencyHistogram decode;
+  GetDecodingStageLatency(decode, DecodingStage_Decode);
+  const uint64_t count = decode.GetCount();
+
+  {
+    DecodingStageTimer timer(DecodingStage_Decode);
+  }
+
+  GetDecodingStageLatency(decode, DecodingStage_Decode);
+  ASSERT_EQ(count + 1, decode.GetCount());
+  ASSERT_STREQ("Decode", EnumerationToString(DecodingStage_Decode));
+}
+
+
+TEST(DecodingTimings, Basic)
+{
+  DecodingTimings a, b;
+
+  {
+    DecodingTimingsScope scope(a);
+
+    {
+      DecodingStageTimer timer(DecodingStage_Encode);
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+
+    {
+      // The scopes can be nested
+      DecodingTimingsScope nested(b);
+      DecodingStageTimer timer(DecodingStage_Fetch);
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+
+    DecodingStageTimer timer(DecodingStage_Encode);
+  }
+
+  {
+    // Outside of any scope, only the histograms are updated
+    DecodingStageTimer timer(DecodingStage_Decode);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_GE(a.GetMicroseconds(DecodingStage_Encode), 10000u);
+  ASSERT_EQ(0u, a.GetMicroseconds(DecodingStage_Fetch));
+  ASSERT_EQ(0u, b.GetMicroseconds(DecodingStage_Encode));
+  ASSERT_GE(b.GetMicroseconds(DecodingStage_Fetch), 10000u);
+  ASSERT_EQ(0u, a.GetMicroseconds(DecodingStage_Decode));
+  ASSERT_EQ(0u, b.GetMicroseconds(DecodingStage_Decode));
+
+  // The timings of the items are disabled by default
+  DecodingTimings c;
+  StoreItemTimings("a", a);
+  ASSERT_FALSE(LookupItemTimings(c, "a"));
+
+  SetMaxItemTimings(2);
+  StoreItemTimings("a", a);
+  StoreItemTimings("b", b);
+  ASSERT_TRUE(LookupItemTimings(c, "a"));
+  ASSERT_EQ(a.GetMicroseconds(DecodingStage_Encode), c.GetMicroseconds(DecodingStage_Encode));
+
+  StoreItemTimings("c", b);  // Forgets the oldest item
+  ASSERT_FALSE(LookupItemTimings(c, "a"));
+  ASSERT_TRUE(LookupItemTimings(c, "b"));
+  ASSERT_TRUE(LookupItemTimings(c, "c"));
+  ASSERT_EQ(b.GetMicroseconds(DecodingStage_Fetch), c.GetMicroseconds(DecodingStage_Fetch));
+
+  SetMaxItemTimings(0);
+  ASSERT_FALSE(LookupItemTimings(c, "b"));
+}
+
+
 int main(int argc, char **argv)
 {
   argc_ = argc;
@@ -25,6 +25,12 @@
 var compression = 'jpeg95';
 var isFirst = true;
 //var compression = 'deflate';
+//var compression = 'delta';  // Lossless, smaller than 'deflate' for grayscale images
+
+// Identifies this viewer, so that the server prefetches the slices
+// in the direction in which the user is scrolling
+var session = Math.random().toString(36).substring(2) + (new Date()).getTime().toString(36);
+
 var unsupportedMessage = 'Error: The Orthanc core does not support the decoding of this image. Make sure that you have properly installed a suitable decoder plugin (e.g. the official GDCM decoder plugin).';
 
 
@@ -259,8 +265,8 @@ function ZoomOut()
 
 
   function getPixelDataDeflate(image) {
-    // Decompresses the base64 buffer that was compressed with Deflate
-    var s = pako.inflate(window.atob(image.Orthanc.PixelData));
+    // Decompresses the buffer that was compressed with Deflate
+    var s = pako.inflate(image.Orthanc.PixelData);
     var pixels = null;
 
     if (image.color) {
@@ -295,20 +301,38 @@ function ZoomOut()
   }
 
 
-  // http://stackoverflow.com/a/11058858/881731
-  function str2ab(str) {
-    var buf = new ArrayBuffer(str.length);
-    var pixels = new Uint8Array(buf);
-    for (var i = 0, strLen=str.length; i<strLen; i++) {
-      pixels[i] = str.charCodeAt(i);
+  function getPixelDataDelta(image) {
+    // Decompresses the buffer that was compressed with Deflate, then
+    // undoes the delta predictor: The lower bytes of the differences
+    // are followed by their upper bytes
+    var s = pako.inflate(image.Orthanc.PixelData);
+    var count = s.length / 2;
+    var width = image.width;
+
+    var pixels = new Uint16Array(count);
+    var previous = 0;
+
+    for (var i = 0; i < count; i++) {
+      if (i % width == 0) {
+        // The first pixel of a row is predicted by the row above
+        previous = (i == 0 ? 0 : pixels[i - width]);
+      }
+
+      previous = (previous + s[i] + s[count + i] * 256) & 0xffff;
+      pixels[i] = previous;
+    }
+
+    if (image.Orthanc.IsSigned) {
+      return new Int16Array(pixels.buffer);
+    } else {
+      return pixels;
     }
-    return pixels;
   }
 
+
   function getPixelDataJpeg(image) {
     var jpegReader = new JpegImage();
-    var jpeg = str2ab(window.atob(image.Orthanc.PixelData));
-    jpegReader.parse(jpeg);
+    jpegReader.parse(image.Orthanc.PixelData);
     var s = jpegReader.getData(image.width, image.height);
     var pixels = null;
 
@@ -346,58 +370,101 @@ function ZoomOut()
   }
   
 
-  function getOrthancImage(imageId) {
-    var result = null;
-
-    $.ajax({
-      type: 'GET',
-      url: '../instances/' + compression + '-' + imageId,
-      dataType: 'json',
-      cache: true,
-      async: false,
-      success: function(image) {
-        image.imageId = imageId;
-        if (image.color)
-          image.render = cornerstone.renderColorImage;
-        else
-          image.render = cornerstone.renderGrayscaleImage;
-
-        if (isFirst) {
-          if (image.Orthanc.PhotometricInterpretation == "MONOCHROME1") {
-            image.invert = true;
-          } else {
-            image.invert = false;
-          }
-
-          isFirst = false;
+  // Parses the binary format of "/web-viewer/instances-binary/": The
+  // size of the JSON metadata (32-bit little-endian), the metadata,
+  // then the compressed pixel data
+  function parseBinaryImage(buffer) {
+    var size = new DataView(buffer).getUint32(0, true);
+    var header = new Uint8Array(buffer, 4, size);
+
+    var json = '';
+    for (var i = 0; i < size; i++) {
+      json += String.fromCharCode(header[i]);
+    }
+
+    var image = JSON.parse(json);
+    image.Orthanc.PixelData = new Uint8Array(buffer, 4 + size);
+    return image;
+  }
+
+  function loadOrthancImage(imageId, uri, isPreview) {
+    var deferred = $.Deferred();
+
+    var request = new XMLHttpRequest();
+    request.open('GET', uri, true);
+    request.responseType = 'arraybuffer';
+
+    for (var header in authorizationTokens) {
+      request.setRequestHeader(header, authorizationTokens[header]);
+    }
+
+    request.onload = function() {
+      if (request.status != 200) {
+        request.onerror();
+        return;
+      }
+
+      var image = parseBinaryImage(request.response);
+      image.imageId = imageId;
+      if (image.color)
+        image.render = cornerstone.renderColorImage;
+      else
+        image.render = cornerstone.renderGrayscaleImage;
+
+      if (isFirst) {
+        if (image.Orthanc.PhotometricInterpretation == "MONOCHROME1") {
+          image.invert = true;
+        } else {
+          image.invert = false;
         }
+
+        isFirst = false;
+      }
         
-        image.getPixelData = function() {
-          if (image.Orthanc.Compression == 'Deflate')
-            return getPixelDataDeflate(this);
+      image.getPixelData = function() {
+        if (image.Orthanc.Compression == 'Deflate')
+          return getPixelDataDeflate(this);
 
-          if (image.Orthanc.Compression == 'Jpeg')
-            return getPixelDataJpeg(this);
+        if (image.Orthanc.Compression == 'Delta')
+          return getPixelDataDelta(this);
 
-          // Unknown compression
-          return null;
-        }
+        if (image.Orthanc.Compression == 'Jpeg')
+          return getPixelDataJpeg(this);
 
-        result = image;
-      },
-      error: function() {
-        alert(unsupportedMessage);
+        // Unknown compression
         return null;
       }
-    });
-    
-    var deferred = $.Deferred();
-    deferred.resolve(result);
+
+      deferred.resolve(image);
+    };
+
+    request.onerror = function() {
+      if (!isPreview) {
+        // A missing preview is not an error, as the full-resolution
+        // image is loaded afterwards
+        alert(unsupportedMessage);
+      }
+
+      deferred.reject();
+    };
+
+    request.send();
     return deferred;
   }
 
+  function getOrthancImage(imageId) {
+    return loadOrthancImage(imageId, '../instances-binary/' + compression + '-' + imageId + '?session=' + session, false);
+  }
+
+  // The low-resolution previews are identified as "preview:<instance>_<frame>"
+  function getOrthancPreview(imageId) {
+    var instance = imageId.substring(imageId.indexOf(':') + 1);
+    return loadOrthancImage(imageId, '../previews/preview256-' + instance + '?session=' + session, true);
+  }
+
   // register our imageLoader plugin with cornerstone
   cornerstone.registerImageLoader('', getOrthancImage);
+  cornerstone.registerImageLoader('preview', getOrthancPreview);
 
 }(cornerstone));
 
@@ -419,7 +486,7 @@ $(document).ready(function() {
 
   $.ajax({
     type: 'GET',
-    url: '../series/' + series,
+    url: '../series/' + series + '?session=' + session,
     dataType: 'json',
     cache: false,
     async: false,
@@ -467,14 +534,78 @@ $(document).ready(function() {
   
 
   var currentImageIndex = 0;
+  var requestedImageIndex = 0;
+
+  // The previews are displayed while scrolling, and the full-resolution
+  // image is only loaded once the user stays on a slice for this delay
+  var FULL_RESOLUTION_DELAY = 150;  // In milliseconds
+  var fullResolutionTimer = null;
+  var fullResolutionLoaded = {};
+  var displayedPreviewScale = 0;  // 0 as long as no image is displayed
+
+  function displayImage(imageIndex, image) {
+    if (imageIndex != requestedImageIndex) {
+      // The images are loaded asynchronously: Ignore this image, as
+      // a more recent one was requested in the meantime
+      return;
+    }
+
+    // The preview is downscaled by "PreviewScale" (1 for the full
+    // resolution): Keep the same zoom and pan when switching
+    var previewScale = image.Orthanc.PreviewScale || 1;
+    var viewport = cornerstone.getViewport(element);
+
+    if (viewport &&
+        displayedPreviewScale != 0 &&
+        displayedPreviewScale != previewScale) {
+      viewport.scale *= previewScale / displayedPreviewScale;
+      viewport.translation.x *= displayedPreviewScale / previewScale;
+      viewport.translation.y *= displayedPreviewScale / previewScale;
+    }
+
+    currentImageIndex = imageIndex;
+    displayedPreviewScale = previewScale;
+    cornerstone.displayImage(element, image, viewport);
+  }
+
+  function loadFullResolution(imageIndex) {
+    return cornerstone.loadAndCacheImage(instances[imageIndex]).then(function(image) {
+      fullResolutionLoaded[imageIndex] = true;
+      displayImage(imageIndex, image);
+    });
+  }
 
   // updates the image display
   function updateTheImage(imageIndex) {
-    return cornerstone.loadAndCacheImage(instances[imageIndex]).then(function(image) {
-      currentImageIndex = imageIndex;
-      var viewport = cornerstone.getViewport(element);
-      cornerstone.displayImage(element, image, viewport);
+    requestedImageIndex = imageIndex;
+
+    if (fullResolutionTimer != null) {
+      clearTimeout(fullResolutionTimer);
+      fullResolutionTimer = null;
+    }
+
+    if (fullResolutionLoaded[imageIndex]) {
+      return loadFullResolution(imageIndex);
+    }
+
+    // Display the preview right away, then the full resolution
+    var displayed = $.Deferred();
+
+    cornerstone.loadAndCacheImage('preview:' + instances[imageIndex]).then(function(image) {
+      if (!fullResolutionLoaded[imageIndex]) {
+        displayImage(imageIndex, image);
+        displayed.resolve();
+      }
     });
+
+    fullResolutionTimer = setTimeout(function() {
+      fullResolutionTimer = null;
+      loadFullResolution(imageIndex).then(function() {
+        displayed.resolve();
+      });
+    }, FULL_RESOLUTION_DELAY);
+
+    return displayed;
   }
 
   // image enable the element
@@ -630,6 +761,7 @@ $(document).ready(function() {
   function SetCompression(c)
   {
     compression = c;
+    fullResolutionLoaded = {};
     cornerstone.imageCache.purgeCache();
     updateTheImage(currentImageIndex);
     cornerstone.invalidateImageId(instances[currentImageIndex]);
@@ -647,7 +779,7 @@ $(document).ready(function() {
     }).next().button({
       label: 'H'
     }).click(function() {
-      SetCompression('deflate');
+      SetCompression('delta');
     });
 
 
@@ -659,4 +791,15 @@ $(document).ready(function() {
     }
   });
 
+  // Let the server drop the slices it was prefetching for this viewer
+  $(window).on('pagehide', function() {
+    if (window.fetch) {
+      fetch('../sessions/' + session, {
+        method: 'DELETE',
+        keepalive: true,
+        headers: authorizationTokens
+      });
+    }
+  });
+
 });